@@ -0,0 +1,626 @@
+/*----------------------------------------------------------------------------*/
+/*-- ISOGen.cpp                                                             --*/
+/*-- Synthetic UMD/PS2 DVD-5 ISO images to test and benchmark UMD-REPLACE   --*/
+/*-- Copyright (C) 2012-2015 CUE  --  2022 Snake128                         --*/
+/*--                                                                        --*/
+/*-- This program is free software: you can redistribute it and/or modify   --*/
+/*-- it under the terms of the GNU General Public License as published by   --*/
+/*-- the Free Software Foundation, either version 3 of the License, or      --*/
+/*-- (at your option) any later version.                                    --*/
+/*--                                                                        --*/
+/*-- This program is distributed in the hope that it will be useful,        --*/
+/*-- but WITHOUT ANY WARRANTY; without even the implied warranty of         --*/
+/*-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the           --*/
+/*-- GNU General Public License for more details.                           --*/
+/*--                                                                        --*/
+/*-- You should have received a copy of the GNU General Public License      --*/
+/*-- along with this program. If not, see <http://www.gnu.org/licenses/>.   --*/
+/*----------------------------------------------------------------------------*/
+
+/*----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/*----------------------------------------------------------------------------*/
+typedef unsigned long long U64;
+
+typedef struct {
+    char          name[32];             // ISO9660 name, without ";1"
+    unsigned int  parent;               // parent folder
+    unsigned int  folder;               // 1 for folders
+    unsigned int  depth;                // folder depth, 0 for the root
+    unsigned int  lba;                  // LBA of the data
+    U64           size;                 // size of the data
+    unsigned int  first, count;         // children in 'order', for folders
+    unsigned int  number;               // path table number, for folders
+} NODE;
+
+/*----------------------------------------------------------------------------*/
+#define DESCRIPTOR_LBA   0x010          // LBA of the first volume descriptor
+#define LEN_SECTOR       0x800          // user data sectors only
+
+#define SHAPE_UMD        0              // PSP UMD, PSP_GAME folder
+#define SHAPE_DVD5       1              // PS2 DVD-5, SYSTEM.CNF in the root
+
+#define SECTORS_UMD      878906         // 1.8 GB
+#define SECTORS_DVD5     2295104        // 4.7 GB
+
+#define DIST_UNIFORM     0              // file sizes uniform in the range
+#define DIST_LOG         1              // file sizes log-uniform in the range
+
+#define MAX_FILESIZE     0xFFFFF800ULL  // 32-bit sizes in the records
+#define MAX_DEPTH        60             // below the limit of UMD-REPLACE
+#define BUFFER_SIZE      0x100000       // bytes written at once
+
+/*----------------------------------------------------------------------------*/
+#define EXIT(text)       { printf(text); exit(EXIT_FAILURE); }
+
+/*----------------------------------------------------------------------------*/
+void  Title(void);
+void  Usage(void);
+
+U64   Number(char* text);
+U64   Random(void);
+unsigned int Node(const char* name, unsigned int parent, unsigned int folder, U64 size);
+U64   FileSize(void);
+int   Compare(const void* a, const void* b);
+unsigned int Layout(void);
+unsigned int FolderSize(unsigned int folder);
+unsigned int Record(unsigned char* buffer, NODE* node, const char* name);
+void  Both32(unsigned char* buffer, unsigned int value);
+void  Both16(unsigned char* buffer, unsigned int value);
+void  Generate(char* filename);
+void  Put(FILE* fp, unsigned char* buffer, U64 length);
+void  Pad(FILE* fp, U64 length);
+void  PathTable(FILE* fp, int big);
+void  List(void);
+void  Path(unsigned int node, char* path);
+
+/*----------------------------------------------------------------------------*/
+NODE*         nodes;          // root, folders and files
+unsigned int  nodes_count, nodes_max;
+unsigned int* order;          // children grouped by folder, sorted by name
+unsigned int* folders;        // folders in path table order
+unsigned int  folders_count;
+
+unsigned int  shape;          // image shape
+unsigned int  files = 100;    // generated files
+unsigned int  subfolders = 16;// generated folders
+unsigned int  depth = 4;      // max depth of the generated folders
+U64           size_min = 0, size_max = 1048576; // generated file sizes
+unsigned int  dist = DIST_LOG;// file size distribution
+U64           total;          // image size, 0 for no scaling
+U64           seed = 1;       // random seed
+unsigned int  list;           // print the files
+
+unsigned int  table_len, table_sectors, table_lba[4];
+unsigned int  total_sectors;
+
+/*----------------------------------------------------------------------------*/
+int main(int argc, char** argv) {
+    char* text;
+    int   i;
+
+    Title();
+
+    // options
+    for (i = 1; (i < argc) && (argv[i][0] == '-'); i++) {
+        if (!strcmp(argv[i], "--shape=umd")) shape = SHAPE_UMD;
+        else if (!strcmp(argv[i], "--shape=dvd5")) shape = SHAPE_DVD5;
+        else if (!strncmp(argv[i], "--files=", 8)) files = atoi(argv[i] + 8);
+        else if (!strncmp(argv[i], "--folders=", 10)) subfolders = atoi(argv[i] + 10);
+        else if (!strncmp(argv[i], "--depth=", 8)) depth = atoi(argv[i] + 8);
+        else if (!strncmp(argv[i], "--size=", 7)) {
+            text = strchr(argv[i] + 7, '-');
+            if (text == NULL) Usage();
+            *text = '\0';
+            size_min = Number(argv[i] + 7);
+            size_max = Number(text + 1);
+        }
+        else if (!strcmp(argv[i], "--dist=uniform")) dist = DIST_UNIFORM;
+        else if (!strcmp(argv[i], "--dist=log")) dist = DIST_LOG;
+        else if (!strncmp(argv[i], "--total=", 8)) total = Number(argv[i] + 8);
+        else if (!strncmp(argv[i], "--seed=", 7)) seed = Number(argv[i] + 7);
+        else if (!strcmp(argv[i], "--list")) list = 1;
+        else Usage();
+    }
+    argv += i - 1; argc -= i - 1;
+
+    if (argc != 2) Usage();
+    if ((depth < 1) || (depth > MAX_DEPTH)) Usage();
+    if ((size_min > size_max) || (size_max > MAX_FILESIZE)) Usage();
+    if (!seed) seed = 1;
+
+    Generate(argv[1]);
+
+    if (list) List();
+
+    printf("\nDone\n");
+
+    exit(EXIT_SUCCESS);
+}
+
+/*----------------------------------------------------------------------------*/
+void Title(void) {
+    printf(
+        "\n"
+        "ISOGEN - Copyright (C) 2012-2015 CUE - 2022 Snake128\n"
+        "Synthetic UMD/PS2 DVD-5 ISO images to test and benchmark UMD-REPLACE\n"
+        "\n"
+    );
+}
+
+/*----------------------------------------------------------------------------*/
+void Usage(void) {
+    EXIT(
+        "Usage: ISOGEN [options] imagename\n"
+        "\n"
+        "Options:\n"
+        "  --shape=umd    PSP UMD image, up to 1.8 GB (default)\n"
+        "  --shape=dvd5   PS2 DVD-5 image, up to 4.7 GB\n"
+        "  --files=N      generated files (default 100)\n"
+        "  --folders=N    generated folders (default 16)\n"
+        "  --depth=N      max depth of the generated folders, 1-60 (default 4)\n"
+        "  --size=MIN-MAX range of the file sizes (default 0-1M)\n"
+        "  --dist=uniform file sizes uniform in the range\n"
+        "  --dist=log     file sizes log-uniform in the range, many small files\n"
+        "                 and a few big ones (default)\n"
+        "  --total=SIZE   scale the file sizes to get an image of about SIZE bytes\n"
+        "  --seed=N       random seed (default 1)\n"
+        "  --list         print the path, size and LBA of every file\n"
+        "\n"
+        "* sizes can end in K, M or G\n"
+        "* the same options and seed always give the same image\n"
+    );
+}
+
+/*----------------------------------------------------------------------------*/
+U64 Number(char* text) {
+    char* end;
+    U64   value;
+
+    value = strtoull(text, &end, 10);
+    if (end == text) Usage();
+
+    if ((*end == 'K') || (*end == 'k')) { value <<= 10; end++; }
+    else if ((*end == 'M') || (*end == 'm')) { value <<= 20; end++; }
+    else if ((*end == 'G') || (*end == 'g')) { value <<= 30; end++; }
+    if (*end) Usage();
+
+    return(value);
+}
+
+/*----------------------------------------------------------------------------*/
+U64 Random(void) {
+    // xorshift64*
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+
+    return(seed * 0x2545F4914F6CDD1DULL);
+}
+
+/*----------------------------------------------------------------------------*/
+unsigned int Node(const char* name, unsigned int parent, unsigned int folder, U64 size) {
+    NODE* node;
+
+    if (nodes_count == nodes_max) {
+        nodes_max = nodes_max ? nodes_max << 1 : 1024;
+        nodes = (NODE*)realloc(nodes, nodes_max * sizeof(NODE));
+        if (nodes == NULL) EXIT("Memory error\n");
+    }
+
+    node = &nodes[nodes_count];
+    memset(node, 0, sizeof(NODE));
+    strcpy(node->name, name);
+    node->parent = parent;
+    node->folder = folder;
+    node->depth = nodes_count ? nodes[parent].depth + 1 : 0;
+    node->size = size;
+
+    return(nodes_count++);
+}
+
+/*----------------------------------------------------------------------------*/
+U64 FileSize(void) {
+    double value;
+
+    if (dist == DIST_UNIFORM) {
+        return(size_min + Random() % (size_max - size_min + 1));
+    }
+
+    value = (double)(Random() >> 11) / (double)(1ULL << 53);
+    value = exp(log((double)size_min + 1) + value * (log((double)size_max + 1) - log((double)size_min + 1))) - 1;
+
+    return(value > (double)size_max ? size_max : (U64)value);
+}
+
+/*----------------------------------------------------------------------------*/
+int Compare(const void* a, const void* b) {
+    NODE* x = &nodes[*(unsigned int*)a];
+    NODE* y = &nodes[*(unsigned int*)b];
+
+    if (x->parent != y->parent) return(x->parent < y->parent ? -1 : 1);
+
+    return(strcmp(x->name, y->name));
+}
+
+/*----------------------------------------------------------------------------*/
+unsigned int Layout(void) {
+    NODE*        node;
+    unsigned int lba, i, j, k;
+
+    // the children of every folder together and sorted by name
+    for (i = 0; i < nodes_count - 1; i++) order[i] = i + 1;
+    qsort(order, nodes_count - 1, sizeof(unsigned int), Compare);
+
+    for (i = 0; i < nodes_count; i++) nodes[i].count = 0;
+    for (i = nodes_count - 1; i--; ) {
+        node = &nodes[nodes[order[i]].parent];
+        node->first = i;
+        node->count++;
+    }
+
+    // folders by level, parent and name, as in the path tables
+    folders_count = 0;
+    folders[folders_count++] = 0;
+    for (i = 0; i < folders_count; i++) {
+        node = &nodes[folders[i]];
+        node->number = i + 1;
+        for (j = 0; j < node->count; j++) {
+            k = order[node->first + j];
+            if (nodes[k].folder) folders[folders_count++] = k;
+        }
+    }
+
+    table_len = 0;
+    for (i = 0; i < folders_count; i++) {
+        k = i ? strlen(nodes[folders[i]].name) : 1;
+        table_len += 0x08 + k + (k & 0x1);
+    }
+    table_sectors = (table_len + LEN_SECTOR - 1) / LEN_SECTOR;
+
+    // volume descriptors, path tables, folders and files
+    lba = DESCRIPTOR_LBA + 2;
+    for (i = 0; i < 4; i++) {
+        table_lba[i] = lba;
+        lba += table_sectors;
+    }
+
+    for (i = 0; i < folders_count; i++) {
+        node = &nodes[folders[i]];
+        node->lba = lba;
+        node->size = FolderSize(folders[i]);
+        lba += node->size / LEN_SECTOR;
+    }
+
+    for (i = 0; i < folders_count; i++) {
+        node = &nodes[folders[i]];
+        for (j = 0; j < node->count; j++) {
+            k = order[node->first + j];
+            if (nodes[k].folder) continue;
+            nodes[k].lba = lba;
+            lba += (nodes[k].size + LEN_SECTOR - 1) / LEN_SECTOR;
+        }
+    }
+
+    return(lba);
+}
+
+/*----------------------------------------------------------------------------*/
+unsigned int FolderSize(unsigned int folder) {
+    NODE*        node, * child;
+    unsigned int sectors, pos, length, i;
+
+    node = &nodes[folder];
+
+    // the records never cross a sector
+    sectors = 1;
+    pos = 0x22 + 0x22;
+    for (i = 0; i < node->count; i++) {
+        child = &nodes[order[node->first + i]];
+        length = 0x21 + strlen(child->name) + (child->folder ? 0 : 2);
+        length += length & 0x1;
+        if (pos + length > LEN_SECTOR) { sectors++; pos = 0; }
+        pos += length;
+    }
+
+    return(sectors * LEN_SECTOR);
+}
+
+/*----------------------------------------------------------------------------*/
+unsigned int Record(unsigned char* buffer, NODE* node, const char* name) {
+    static const unsigned char date[7] = { 122, 5, 17, 0, 0, 0, 0 };
+    unsigned int length, nchars;
+
+    nchars = strlen(name);
+    if (!nchars) nchars = 1; // '.' and '..' have a single 0x00/0x01 char
+    length = 0x21 + nchars;
+    length += length & 0x1;
+
+    memset(buffer, 0, length);
+    buffer[0x000] = length;
+    Both32(buffer + 0x002, node->lba);
+    Both32(buffer + 0x00A, (unsigned int)node->size);
+    memcpy(buffer + 0x012, date, sizeof(date));
+    buffer[0x019] = node->folder ? 0x02 : 0x00;
+    Both16(buffer + 0x01C, 1);
+    buffer[0x020] = nchars;
+    memcpy(buffer + 0x021, name, strlen(name));
+
+    return(length);
+}
+
+/*----------------------------------------------------------------------------*/
+void Both32(unsigned char* buffer, unsigned int value) {
+    buffer[0] = buffer[7] = value;
+    buffer[1] = buffer[6] = value >> 8;
+    buffer[2] = buffer[5] = value >> 16;
+    buffer[3] = buffer[4] = value >> 24;
+}
+
+/*----------------------------------------------------------------------------*/
+void Both16(unsigned char* buffer, unsigned int value) {
+    buffer[0] = buffer[3] = value;
+    buffer[1] = buffer[2] = value >> 8;
+}
+
+/*----------------------------------------------------------------------------*/
+void Generate(char* filename) {
+    FILE*          fp;
+    NODE*          node, * child;
+    unsigned char* buffer, * folder;
+    char           name[32];
+    unsigned int   base, parent, first, max_sectors, lba, pos, length, pad;
+    unsigned int   i, j, k;
+    U64            sum, avail, size, count, w;
+
+    printf("- generating the folder tree\n");
+
+    nodes = NULL;
+    nodes_count = nodes_max = 0;
+
+    // fixed files of the shape
+    Node("", 0, 1, 0);
+    if (shape == SHAPE_UMD) {
+        Node("UMD_DATA.BIN", 0, 0, 64);
+        base = Node("PSP_GAME", 0, 1, 0);
+        Node("PARAM.SFO", base, 0, 1024);
+        Node("ICON0.PNG", base, 0, 20000);
+        i = Node("SYSDIR", base, 1, 0);
+        Node("EBOOT.BIN", i, 0, 2097152);
+        base = Node("USRDIR", base, 1, 0);
+        max_sectors = SECTORS_UMD;
+    }
+    else {
+        Node("SYSTEM.CNF", 0, 0, 64);
+        Node("SLUS_000.00", 0, 0, 2097152);
+        base = 0;
+        max_sectors = SECTORS_DVD5;
+    }
+
+    // generated folders, below the base folder or a previous one
+    first = nodes_count;
+    for (i = 0; i < subfolders; i++) {
+        do {
+            k = (unsigned int)(Random() % (i + 1));
+            parent = k ? first + k - 1 : base;
+        } while (nodes[parent].depth - nodes[base].depth >= depth);
+        sprintf(name, "DIR%05u", i);
+        Node(name, parent, 1, 0);
+    }
+
+    // generated files, in the base folder or any generated one
+    for (i = 0; i < files; i++) {
+        k = (unsigned int)(Random() % (subfolders + 1));
+        parent = k ? first + k - 1 : base;
+        sprintf(name, "FILE%06u.BIN", i);
+        Node(name, parent, 0, FileSize());
+    }
+    first += subfolders;
+
+    order = (unsigned int*)calloc(nodes_count, sizeof(unsigned int));
+    folders = (unsigned int*)calloc(nodes_count, sizeof(unsigned int));
+    if ((order == NULL) || (folders == NULL)) EXIT("Memory error\n");
+
+    total_sectors = Layout();
+
+    // the generated files get the sectors not used by the rest of the image
+    if (total) {
+        printf("- scaling the file sizes\n");
+
+        sum = 0;
+        for (i = first; i < nodes_count; i++) sum += (nodes[i].size + LEN_SECTOR - 1) / LEN_SECTOR;
+        avail = total / LEN_SECTOR;
+        for (i = first; i < nodes_count; i++) avail += (nodes[i].size + LEN_SECTOR - 1) / LEN_SECTOR;
+        avail = avail > total_sectors ? avail - total_sectors : 0;
+
+        if (!sum) EXIT("No data in the generated files to scale\n");
+
+        for (i = first; i < nodes_count; i++) {
+            size = (U64)((double)nodes[i].size * avail / sum);
+            nodes[i].size = size > MAX_FILESIZE ? MAX_FILESIZE : size;
+        }
+
+        total_sectors = Layout();
+    }
+
+    if (total_sectors > max_sectors) EXIT("Image too big for the shape\n");
+
+    printf("- writing %u sectors\n", total_sectors);
+
+    fp = fopen(filename, "wb");
+    if (fp == NULL) EXIT("File open error\n");
+
+    buffer = (unsigned char*)calloc(BUFFER_SIZE, sizeof(char));
+    if (buffer == NULL) EXIT("Memory error\n");
+
+    // system area
+    Pad(fp, DESCRIPTOR_LBA * LEN_SECTOR);
+
+    // primary volume descriptor
+    memset(buffer, 0, LEN_SECTOR);
+    buffer[0x000] = 0x01;
+    memcpy(buffer + 0x001, "CD001", 5);
+    buffer[0x006] = 0x01;
+    memset(buffer + 0x008, ' ', 0x040);
+    memcpy(buffer + 0x008, shape == SHAPE_UMD ? "PSP GAME" : "PLAYSTATION", shape == SHAPE_UMD ? 8 : 11);
+    memcpy(buffer + 0x028, "ISOGEN", 6);
+    Both32(buffer + 0x050, total_sectors);
+    Both16(buffer + 0x078, 1);
+    Both16(buffer + 0x07C, 1);
+    Both16(buffer + 0x080, LEN_SECTOR);
+    Both32(buffer + 0x084, table_len);
+    for (i = 0; i < 4; i++) {
+        for (j = 0; j < 4; j++) buffer[0x08C + 4 * i + j] = table_lba[i] >> (i & 0x2 ? 24 - 8 * j : 8 * j);
+    }
+    Record(buffer + 0x09C, &nodes[0], "");
+    memset(buffer + 0x0BE, ' ', 0x32D - 0x0BE);
+    for (i = 0; i < 4; i++) {
+        memset(buffer + 0x32D + 17 * i, '0', 16);
+    }
+    buffer[0x371] = 0x01;
+    Put(fp, buffer, LEN_SECTOR);
+
+    // volume descriptor set terminator
+    memset(buffer, 0, LEN_SECTOR);
+    buffer[0x000] = 0xFF;
+    memcpy(buffer + 0x001, "CD001", 5);
+    buffer[0x006] = 0x01;
+    Put(fp, buffer, LEN_SECTOR);
+
+    // path tables, little-endian and big-endian, both with a copy
+    PathTable(fp, 0);
+    PathTable(fp, 0);
+    PathTable(fp, 1);
+    PathTable(fp, 1);
+
+    // folders
+    for (i = 0; i < folders_count; i++) {
+        node = &nodes[folders[i]];
+
+        folder = (unsigned char*)calloc(node->size, sizeof(char));
+        if (folder == NULL) EXIT("Memory error\n");
+
+        pos = Record(folder, node, "");
+        pos += Record(folder + pos, &nodes[node->parent], "\1");
+
+        lba = 0;
+        for (j = 0; j < node->count; j++) {
+            child = &nodes[order[node->first + j]];
+            sprintf(name, child->folder ? "%s" : "%s;1", child->name);
+            length = 0x21 + strlen(name);
+            length += length & 0x1;
+            if (pos + length > LEN_SECTOR) { lba++; pos = 0; }
+            Record(folder + lba * LEN_SECTOR + pos, child, name);
+            pos += length;
+        }
+
+        Put(fp, folder, node->size);
+        free(folder);
+    }
+
+    // file data, random to not be compressed or deduplicated
+    for (i = 0; i < folders_count; i++) {
+        node = &nodes[folders[i]];
+        for (j = 0; j < node->count; j++) {
+            child = &nodes[order[node->first + j]];
+            if (child->folder) continue;
+
+            size = (child->size + LEN_SECTOR - 1) / LEN_SECTOR * LEN_SECTOR;
+            pad = size - child->size;
+            while (size) {
+                count = size > BUFFER_SIZE ? BUFFER_SIZE : size;
+                for (k = 0; k < count; k += 8) {
+                    w = Random();
+                    memcpy(buffer + k, &w, 8);
+                }
+                size -= count;
+
+                // the sector padding is zero-filled
+                if (!size) memset(buffer + count - pad, 0, pad);
+
+                Put(fp, buffer, count);
+            }
+        }
+    }
+
+    if (fclose(fp)) EXIT("File close error\n");
+
+    free(buffer);
+
+    printf("- %u folders, %u files, %llu bytes\n", folders_count, nodes_count - folders_count, (U64)total_sectors * LEN_SECTOR);
+}
+
+/*----------------------------------------------------------------------------*/
+void Put(FILE* fp, unsigned char* buffer, U64 length) {
+    if (fwrite(buffer, 1, length, fp) != length) EXIT("File write error\n");
+}
+
+/*----------------------------------------------------------------------------*/
+void Pad(FILE* fp, U64 length) {
+    static unsigned char zero[LEN_SECTOR];
+    U64 count;
+
+    while (length) {
+        count = length > LEN_SECTOR ? LEN_SECTOR : length;
+        Put(fp, zero, count);
+        length -= count;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+void PathTable(FILE* fp, int big) {
+    unsigned char* buffer;
+    unsigned int   parent, lba, pos, nchars, i, j;
+
+    buffer = (unsigned char*)calloc(table_sectors * LEN_SECTOR, sizeof(char));
+    if (buffer == NULL) EXIT("Memory error\n");
+
+    pos = 0;
+    for (i = 0; i < folders_count; i++) {
+        parent = nodes[nodes[folders[i]].parent].number;
+        lba = nodes[folders[i]].lba;
+        nchars = i ? strlen(nodes[folders[i]].name) : 1;
+
+        buffer[pos + 0x000] = nchars;
+        for (j = 0; j < 4; j++) buffer[pos + 0x002 + j] = lba >> (big ? 24 - 8 * j : 8 * j);
+        buffer[pos + 0x006] = big ? parent >> 8 : parent;
+        buffer[pos + 0x007] = big ? parent : parent >> 8;
+        if (i) memcpy(buffer + pos + 0x008, nodes[folders[i]].name, nchars);
+
+        pos += 0x08 + nchars + (nchars & 0x1);
+    }
+
+    Put(fp, buffer, table_sectors * LEN_SECTOR);
+
+    free(buffer);
+}
+
+/*----------------------------------------------------------------------------*/
+void List(void) {
+    char         path[1024];
+    unsigned int i;
+
+    printf("\n");
+    for (i = 0; i < nodes_count; i++) {
+        if (nodes[i].folder) continue;
+        Path(i, path);
+        printf("%s %llu %u\n", path, nodes[i].size, nodes[i].lba);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+void Path(unsigned int node, char* path) {
+    if (!node) { path[0] = '\0'; return; }
+
+    Path(nodes[node].parent, path);
+    strcat(path, "/");
+    strcat(path, nodes[node].name);
+}
+
+/*----------------------------------------------------------------------------*/
+/*--  EOF                     Copyright (C) 2012-2015 CUE  - 2022 Snake128  --*/
+/*----------------------------------------------------------------------------*/
@@ -0,0 +1,508 @@
+/*----------------------------------------------------------------------------*/
+/*-- UMDBench.cpp                                                           --*/
+/*-- Benchmark driver for the replace scenarios of UMD-REPLACE              --*/
+/*-- Copyright (C) 2012-2015 CUE  --  2022 Snake128                         --*/
+/*--                                                                        --*/
+/*-- This program is free software: you can redistribute it and/or modify   --*/
+/*-- it under the terms of the GNU General Public License as published by   --*/
+/*-- the Free Software Foundation, either version 3 of the License, or      --*/
+/*-- (at your option) any later version.                                    --*/
+/*--                                                                        --*/
+/*-- This program is distributed in the hope that it will be useful,        --*/
+/*-- but WITHOUT ANY WARRANTY; without even the implied warranty of         --*/
+/*-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the           --*/
+/*-- GNU General Public License for more details.                           --*/
+/*--                                                                        --*/
+/*-- You should have received a copy of the GNU General Public License      --*/
+/*-- along with this program. If not, see <http://www.gnu.org/licenses/>.   --*/
+/*----------------------------------------------------------------------------*/
+
+/*----------------------------------------------------------------------------*/
+#ifndef __linux__
+#error "UMD-BENCH needs Linux: fork/exec and /proc/pid/io"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/*----------------------------------------------------------------------------*/
+typedef unsigned long long U64;
+
+/*----------------------------------------------------------------------------*/
+#define DESCRIPTOR_LBA   0x010          // LBA of the first volume descriptor
+#define ROOT_FOLDER_LBA  0x09E          // LBA of the root folder
+#define ROOT_SIZE        0x0A6          // size of the root folder
+#define LEN_SECTOR       0x800          // user data sectors only
+
+#define PICK_MIDDLE      0              // file in the middle of the image
+#define PICK_FIRST       1              // first file in the image
+#define PICK_LAST        2              // last file in the image
+#define PICK_DEEP        3              // file with the deepest path
+#define PICK_BIG         4              // biggest file
+
+#define CHANGE_SAME      0              // same size
+#define CHANGE_SECTOR    1              // 1 sector more
+#define CHANGE_GROW      2              // 'grow' sectors more
+#define CHANGE_SHRINK    3              // half the size
+
+#define IO_FIELDS        6              // rchar, wchar, syscr, syscw, read_bytes, write_bytes
+#define MAX_PHASES       64             // progress lines of a run
+#define MAX_PATH         1024           // max length of a path in the image
+#define MAX_DEPTH        64             // max folder depth, to stop on loops
+#define BUFFER_SIZE      0x100000       // bytes copied at once
+
+#define WORKNAME         "umd-bench.iso" // copy of the image for every run
+#define DATANAME         "umd-bench.bin" // new data of the file
+
+/*----------------------------------------------------------------------------*/
+typedef struct {
+    char*         path;                 // file path in the image
+    unsigned int  lba;                  // LBA of the file data
+    unsigned int  size;                 // size of the file data
+    unsigned int  depth;                // folder depth
+} ENTRY;
+
+typedef struct {
+    const char*   name;                 // scenario name
+    int           pick;                 // file to replace
+    int           change;               // new size of the file
+} SCENARIO;
+
+typedef struct {
+    char          name[128];            // progress line of the tool
+    double        time;                 // elapsed milliseconds
+    U64           io[IO_FIELDS];        // /proc/pid/io differences
+} PHASE;
+
+/*----------------------------------------------------------------------------*/
+#define EXIT(text)       { printf(text); exit(EXIT_FAILURE); }
+
+/*----------------------------------------------------------------------------*/
+void  Title(void);
+void  Usage(void);
+
+void  Index(char* filename);
+void  Folder(int fd, char* path, unsigned int lba, unsigned int len, unsigned int depth);
+ENTRY* Pick(int pick);
+void  Copy(char* filename, char* newname);
+void  Data(char* filename, U64 size);
+void  Run(SCENARIO* scenario, char* tool, char** options, int count);
+void  Sample(int pid, U64* io);
+double Now(void);
+
+/*----------------------------------------------------------------------------*/
+SCENARIO scenarios[] = {
+    { "same",   PICK_MIDDLE, CHANGE_SAME   },
+    { "grow1",  PICK_MIDDLE, CHANGE_SECTOR },
+    { "grow",   PICK_MIDDLE, CHANGE_GROW   },
+    { "shrink", PICK_BIG,    CHANGE_SHRINK },
+    { "deep",   PICK_DEEP,   CHANGE_SECTOR },
+    { "end",    PICK_LAST,   CHANGE_SECTOR },
+    { "start",  PICK_FIRST,  CHANGE_SECTOR },
+};
+
+#define SCENARIOS        (sizeof(scenarios) / sizeof(SCENARIO))
+
+ENTRY*        entries;        // files in the image
+unsigned int  entries_count, entries_max;
+
+char*         imagename;      // original image, never changed
+unsigned int  grow = 4096;    // sectors for the 'grow' scenario
+unsigned int  repeat = 1;     // runs of every scenario
+unsigned int  warm;           // keep the image copy in the page cache
+
+/*----------------------------------------------------------------------------*/
+int main(int argc, char** argv) {
+    unsigned int selected, s, r;
+    int          i;
+
+    Title();
+
+    // options
+    selected = 0;
+    for (i = 1; (i < argc) && (argv[i][0] == '-'); i++) {
+        if (!strncmp(argv[i], "--scenario=", 11)) {
+            for (s = 0; s < SCENARIOS; s++) if (!strcmp(argv[i] + 11, scenarios[s].name)) break;
+            if (s == SCENARIOS) Usage();
+            selected |= 1 << s;
+        }
+        else if (!strncmp(argv[i], "--grow=", 7)) grow = atoi(argv[i] + 7);
+        else if (!strncmp(argv[i], "--repeat=", 9)) repeat = atoi(argv[i] + 9);
+        else if (!strcmp(argv[i], "--warm")) warm = 1;
+        else Usage();
+    }
+    argv += i - 1; argc -= i - 1;
+
+    if (argc < 3) Usage();
+    if ((grow < 1) || (repeat < 1)) Usage();
+    if (!selected) selected = (1 << SCENARIOS) - 1;
+
+    imagename = argv[2];
+    Index(imagename);
+    if (!entries_count) EXIT("No files in the image\n");
+
+    // the tool options are the arguments after the image name
+    for (s = 0; s < SCENARIOS; s++) {
+        if (!(selected & (1 << s))) continue;
+        for (r = 0; r < repeat; r++) Run(&scenarios[s], argv[1], argv + 3, argc - 3);
+    }
+
+    remove(WORKNAME);
+    remove(DATANAME);
+
+    printf("\nDone\n");
+
+    exit(EXIT_SUCCESS);
+}
+
+/*----------------------------------------------------------------------------*/
+void Title(void) {
+    printf(
+        "\n"
+        "UMD-BENCH - Copyright (C) 2012-2015 CUE - 2022 Snake128\n"
+        "Benchmark driver for the replace scenarios of UMD-REPLACE\n"
+        "\n"
+    );
+}
+
+/*----------------------------------------------------------------------------*/
+void Usage(void) {
+    EXIT(
+        "Usage: UMD-BENCH [options] toolname imagename [tool options]\n"
+        "\n"
+        "- 'toolname' is the UMD-REPLACE executable\n"
+        "- 'imagename' is the ISO image, it is copied for every run\n"
+        "- 'tool options' are given to every run of the tool\n"
+        "\n"
+        "Options:\n"
+        "  --scenario=S  run only the scenario S, can be repeated:\n"
+        "                same    same size, file in the middle of the image\n"
+        "                grow1   1 sector more, file in the middle of the image\n"
+        "                grow    N sectors more, file in the middle of the image\n"
+        "                shrink  half the size, biggest file\n"
+        "                deep    1 sector more, file with the deepest path\n"
+        "                end     1 sector more, last file of the image\n"
+        "                start   1 sector more, first file of the image\n"
+        "  --grow=N      sectors more in the 'grow' scenario (default 4096)\n"
+        "  --repeat=N    runs of every scenario (default 1)\n"
+        "  --warm        keep the copy of the image in the page cache\n"
+        "\n"
+        "* every progress line of the tool starts a phase, with its elapsed time\n"
+        "  and the /proc/pid/io counters: bytes and calls of the read/write\n"
+        "  system calls, and bytes read/written from/to the storage\n"
+    );
+}
+
+/*----------------------------------------------------------------------------*/
+void Index(char* filename) {
+    unsigned char buffer[LEN_SECTOR];
+    int           fd;
+
+    if ((fd = open(filename, O_RDONLY)) < 0) EXIT("File open error\n");
+    if (pread(fd, buffer, LEN_SECTOR, DESCRIPTOR_LBA * LEN_SECTOR) != LEN_SECTOR) EXIT("File read error\n");
+
+    entries = NULL;
+    entries_count = entries_max = 0;
+    Folder(fd, (char*)"", *(unsigned int*)(buffer + ROOT_FOLDER_LBA), *(unsigned int*)(buffer + ROOT_SIZE), 0);
+
+    close(fd);
+}
+
+/*----------------------------------------------------------------------------*/
+void Folder(int fd, char* path, unsigned int lba, unsigned int len, unsigned int depth) {
+    unsigned char buffer[LEN_SECTOR];
+    char          name[MAX_PATH];
+    unsigned int  pos, nbytes, nchars, length, i;
+    ENTRY*        entry;
+
+    if (depth > MAX_DEPTH) EXIT("Too many nested folders\n");
+
+    for (i = 0; i < (len + LEN_SECTOR - 1) / LEN_SECTOR; i++) {
+        if (pread(fd, buffer, LEN_SECTOR, (U64)(lba + i) * LEN_SECTOR) != LEN_SECTOR) EXIT("File read error\n");
+
+        for (pos = 0; pos < LEN_SECTOR; pos += nbytes) {
+            nbytes = buffer[pos];
+            if (!nbytes) break;
+
+            // skip '.' and '..', discard the ";1" final
+            nchars = buffer[pos + 0x020];
+            if ((nchars == 1) && (buffer[pos + 0x021] < 2)) continue;
+            if ((nchars > 2) && (buffer[pos + 0x021 + nchars - 2] == ';')) nchars -= 2;
+            length = strlen(path);
+            if (length + 1 + nchars >= MAX_PATH) EXIT("Path too long\n");
+
+            memcpy(name, path, length);
+            name[length] = '/';
+            memcpy(name + length + 1, buffer + pos + 0x021, nchars);
+            name[length + 1 + nchars] = '\0';
+
+            if (buffer[pos + 0x019] & 0x02) {
+                Folder(fd, name, *(unsigned int*)(buffer + pos + 0x002), *(unsigned int*)(buffer + pos + 0x00A), depth + 1);
+                continue;
+            }
+
+            if (entries_count == entries_max) {
+                entries_max = entries_max ? entries_max << 1 : 1024;
+                entries = (ENTRY*)realloc(entries, entries_max * sizeof(ENTRY));
+                if (entries == NULL) EXIT("Memory error\n");
+            }
+            entry = &entries[entries_count++];
+            entry->path = strdup(name);
+            entry->lba = *(unsigned int*)(buffer + pos + 0x002);
+            entry->size = *(unsigned int*)(buffer + pos + 0x00A);
+            entry->depth = depth;
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+ENTRY* Pick(int pick) {
+    ENTRY*       found;
+    unsigned int below, best, i, j;
+
+    // only files with data, the empty ones can share the LBA with others
+    found = NULL;
+    best = 0;
+    for (i = 0; i < entries_count; i++) {
+        if (!entries[i].size) continue;
+
+        if (found == NULL) { found = &entries[i]; continue; }
+
+        switch (pick) {
+            case PICK_FIRST: if (entries[i].lba < found->lba) found = &entries[i]; break;
+            case PICK_LAST:  if (entries[i].lba > found->lba) found = &entries[i]; break;
+            case PICK_DEEP:  if (entries[i].depth > found->depth) found = &entries[i]; break;
+            case PICK_BIG:   if (entries[i].size > found->size) found = &entries[i]; break;
+            default:
+                // the file with as many files before as after
+                below = 0;
+                for (j = 0; j < entries_count; j++) below += entries[j].lba < entries[i].lba;
+                if ((2 * below <= entries_count) && (below >= best)) { found = &entries[i]; best = below; }
+                break;
+        }
+    }
+
+    if (found == NULL) EXIT("No files with data in the image\n");
+
+    return(found);
+}
+
+/*----------------------------------------------------------------------------*/
+void Copy(char* filename, char* newname) {
+    char*   buffer;
+    ssize_t count;
+    int     fd, newfd;
+
+    if ((fd = open(filename, O_RDONLY)) < 0) EXIT("File open error\n");
+    if ((newfd = open(newname, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) EXIT("File open error\n");
+
+    buffer = (char*)malloc(BUFFER_SIZE);
+    if (buffer == NULL) EXIT("Memory error\n");
+
+    while ((count = read(fd, buffer, BUFFER_SIZE)) > 0) {
+        if (write(newfd, buffer, count) != count) EXIT("File write error\n");
+    }
+    if (count < 0) EXIT("File read error\n");
+
+    free(buffer);
+
+    // the tool reads the image from the storage, not from the page cache
+    if (fsync(newfd)) EXIT("File sync error\n");
+    if (!warm) posix_fadvise(newfd, 0, 0, POSIX_FADV_DONTNEED);
+
+    close(newfd);
+    close(fd);
+}
+
+/*----------------------------------------------------------------------------*/
+void Data(char* filename, U64 size) {
+    char* buffer;
+    U64   count, seed, i;
+    FILE* fp;
+
+    fp = fopen(filename, "wb");
+    if (fp == NULL) EXIT("File open error\n");
+
+    buffer = (char*)malloc(BUFFER_SIZE);
+    if (buffer == NULL) EXIT("Memory error\n");
+
+    seed = 0x9E3779B97F4A7C15ULL ^ size;
+    while (size) {
+        count = size > BUFFER_SIZE ? BUFFER_SIZE : size;
+        for (i = 0; i < count; i++) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            buffer[i] = seed >> 56;
+        }
+        if (fwrite(buffer, 1, count, fp) != count) EXIT("File write error\n");
+        size -= count;
+    }
+
+    free(buffer);
+
+    if (fclose(fp)) EXIT("File close error\n");
+}
+
+/*----------------------------------------------------------------------------*/
+void Run(SCENARIO* scenario, char* tool, char** options, int count) {
+    static const char* names[IO_FIELDS] = { "read MB", "write MB", "reads", "writes", "disk rd MB", "disk wr MB" };
+    PHASE         phases[MAX_PHASES], * phase, sum;
+    ENTRY*        entry;
+    FILE*         fp;
+    char**        args;
+    char          line[256];
+    U64           io[IO_FIELDS], size;
+    double        time;
+    struct rusage usage;
+    siginfo_t     info;
+    int           fds[2], pid, status, nphases, len, i, j;
+
+    entry = Pick(scenario->pick);
+
+    switch (scenario->change) {
+        case CHANGE_SECTOR: size = (U64)entry->size + LEN_SECTOR; break;
+        case CHANGE_GROW:   size = (U64)entry->size + (U64)grow * LEN_SECTOR; break;
+        case CHANGE_SHRINK: size = entry->size / 2; break;
+        default:            size = entry->size; break;
+    }
+
+    printf("scenario %s: %s, %u -> %llu bytes\n", scenario->name, entry->path, entry->size, size);
+
+    Copy(imagename, (char*)WORKNAME);
+    Data((char*)DATANAME, size);
+
+    // tool [tool options] image file newfile
+    args = (char**)calloc(count + 5, sizeof(char*));
+    if (args == NULL) EXIT("Memory error\n");
+    args[0] = tool;
+    for (i = 0; i < count; i++) args[1 + i] = options[i];
+    args[1 + count] = (char*)WORKNAME;
+    args[2 + count] = entry->path;
+    args[3 + count] = (char*)DATANAME;
+
+    fflush(stdout);
+    if (pipe(fds)) EXIT("Pipe error\n");
+
+    pid = fork();
+    if (pid < 0) EXIT("Fork error\n");
+    if (!pid) {
+        dup2(fds[1], 1);
+        close(fds[0]);
+        close(fds[1]);
+        execvp(tool, args);
+        _exit(127);
+    }
+    close(fds[1]);
+    free(args);
+
+    // a new phase on every progress line, the counters are sampled while
+    // the tool keeps running
+    nphases = 0;
+    phase = &phases[nphases++];
+    strcpy(phase->name, "- starting");
+    phase->time = Now();
+    Sample(pid, phase->io);
+
+    fp = fdopen(fds[0], "r");
+    if (fp == NULL) EXIT("Pipe error\n");
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if ((line[0] != '-') || (line[1] != ' ')) continue;
+
+        time = Now();
+        Sample(pid, io);
+
+        if (nphases == MAX_PHASES) nphases--;
+        phase->time = time - phase->time;
+        for (i = 0; i < IO_FIELDS; i++) phase->io[i] = io[i] - phase->io[i];
+
+        phase = &phases[nphases++];
+        len = strlen(line);
+        while (len && ((line[len - 1] == '\n') || (line[len - 1] == '\r'))) line[--len] = '\0';
+        snprintf(phase->name, sizeof(phase->name), "%s", line);
+        phase->time = time;
+        memcpy(phase->io, io, sizeof(io));
+    }
+    fclose(fp);
+
+    // the exited tool is not reaped until its counters are sampled
+    if (waitid(P_PID, pid, &info, WEXITED | WNOWAIT)) EXIT("Wait error\n");
+    time = Now();
+    Sample(pid, io);
+    phase->time = time - phase->time;
+    for (i = 0; i < IO_FIELDS; i++) phase->io[i] = io[i] - phase->io[i];
+
+    if (wait4(pid, &status, 0, &usage) != pid) EXIT("Wait error\n");
+
+    // report
+    printf("  %-40s %9s", "phase", "ms");
+    for (i = 0; i < IO_FIELDS; i++) printf(" %10s", names[i]);
+    printf("\n");
+
+    memset(&sum, 0, sizeof(sum));
+    strcpy(sum.name, "total");
+    for (j = 0; j <= nphases; j++) {
+        phase = j < nphases ? &phases[j] : &sum;
+        if (j < nphases) {
+            sum.time += phase->time;
+            for (i = 0; i < IO_FIELDS; i++) sum.io[i] += phase->io[i];
+        }
+
+        printf("  %-40.40s %9.1f", phase->name, phase->time);
+        for (i = 0; i < IO_FIELDS; i++) {
+            if (i & 0x2) printf(" %10llu", phase->io[i]);
+            else         printf(" %10.1f", phase->io[i] / 1048576.0);
+        }
+        printf("\n");
+    }
+
+    printf(
+        "  user %.3f s, system %.3f s, max RSS %ld KB, exit %d\n\n",
+        usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6,
+        usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6,
+        usage.ru_maxrss, WIFEXITED(status) ? WEXITSTATUS(status) : -1
+    );
+}
+
+/*----------------------------------------------------------------------------*/
+void Sample(int pid, U64* io) {
+    static const char* fields[IO_FIELDS] = { "rchar:", "wchar:", "syscr:", "syscw:", "read_bytes:", "write_bytes:" };
+    char  filename[64], line[128];
+    FILE* fp;
+    int   i;
+
+    memset(io, 0, IO_FIELDS * sizeof(U64));
+
+    sprintf(filename, "/proc/%d/io", pid);
+    fp = fopen(filename, "r");
+    if (fp == NULL) return;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        for (i = 0; i < IO_FIELDS; i++) {
+            if (!strncmp(line, fields[i], strlen(fields[i]))) io[i] = strtoull(line + strlen(fields[i]), NULL, 10);
+        }
+    }
+
+    fclose(fp);
+}
+
+/*----------------------------------------------------------------------------*/
+double Now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return(ts.tv_sec * 1e3 + ts.tv_nsec / 1e6);
+}
+
+/*----------------------------------------------------------------------------*/
+/*--  EOF                     Copyright (C) 2012-2015 CUE  - 2022 Snake128  --*/
+/*----------------------------------------------------------------------------*/
@@ -1,6 +1,6 @@
 /*----------------------------------------------------------------------------*/
 /*-- UMD-replace.c                                                          --*/
-/*-- Tiny tool to replace data files in a PSP UMD ISO and a PS2 layer0 ISO  --*/
+/*-- Tiny tool to replace data files in a PSP UMD ISO and a PS2 DVD ISO     --*/
 /*-- Copyright (C) 2012-2015 CUE  --  2022 Snake128                         --*/
 /*--                                                                        --*/
 /*-- This program is free software: you can redistribute it and/or modify   --*/
@@ -18,12 +18,342 @@
 /*----------------------------------------------------------------------------*/
 
 /*----------------------------------------------------------------------------*/
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HAVE_SSE2
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#include <io.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#endif
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_URING
+#endif
+#endif
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#ifdef _WIN32
+#pragma comment(lib, "zlib.lib")
+#endif
+#endif
+
+#include "UMDReplace_x64.h"
 
 /*----------------------------------------------------------------------------*/
 typedef unsigned long long U64;
 
+typedef struct {
+    char*  name;                        // file name
+#ifdef _WIN32
+    HANDLE fd;                          // file handle
+#else
+    int    fd;                          // file descriptor
+#endif
+    int    direct;                      // descriptor with O_DIRECT, or -1
+    U64    size;                        // cached file size
+    U64    time;                        // last modification time
+    U64    block;                       // filesystem block size
+    int    copy;                        // best copy method to this file
+    char*  map;                         // mapped image, or NULL
+    U64    map_size;                    // mapped bytes
+#ifdef _WIN32
+    HANDLE mapping;                     // file mapping handle
+#endif
+    struct PATCH* patch;                // changes recorded for a patch, or NULL
+    struct ZIP*   zip;                  // block index of a CSO/ZSO image, or NULL
+    struct SECTORS* sectors;            // metadata sectors kept in memory, or NULL
+    struct WRITES* writes;              // writes of an update to verify, or NULL
+    unsigned int mode;                  // image mode
+    unsigned int sector_size;           // sector size
+    unsigned int data_offset;           // sector data start
+    unsigned int sector_data;           // sector data length
+    unsigned int sector_address;        // address of the LBA 0 in the raw sector headers
+} IMAGE;
+
+typedef struct {
+    U64           position;             // image position of the record
+    unsigned int  lba;                  // LBA of the file/folder data in the image
+    unsigned int  size;                 // size of the file/folder data of the record
+    unsigned int  base;                 // first sector of the volume of the record
+    unsigned int  path;                 // offset of the path in 'paths', or NONE
+    unsigned int  extents;              // records of the file, 0 for the next extents
+    unsigned char flags;                // record flags
+} ENTRY;
+
+typedef struct {
+    ENTRY*        entries;              // all records, grouped by folder sector
+    unsigned int  count, max;
+    char*         paths;                // NUL-terminated file paths
+    unsigned int  paths_len, paths_max;
+    unsigned int* hash;                 // open addressing table, entry + 1
+    unsigned int  hash_size;            // power of 2
+} INDEX;
+
+typedef struct {
+    IMAGE         iso;                  // image, kept open
+    INDEX         index;                // all the records of the image
+    unsigned int  image_sectors;        // sectors in the volume descriptor
+    unsigned int  total_sectors;        // sectors in the image file
+    unsigned int  root_lba, root_length;
+    unsigned int  tbl_lba[4], tbl_len;  // path tables
+    unsigned int  layer_lba;            // first sector of the layer 1 volume, or 0
+    unsigned int  layer_sectors;        // sectors in its volume descriptor
+    unsigned int  layer_root_lba, layer_root_length;
+    unsigned int  layer_tbl_lba[4], layer_tbl_len;
+} VOLUME;
+
+typedef struct {
+    char*         oldname;              // file in the image
+    char*         newname;              // file with the new data
+    U64           position;             // image position of the record
+    unsigned int  file_lba;             // LBA of the old data
+    U64           old_filesize, new_filesize;
+    unsigned int  old_sectors, new_sectors;
+    unsigned int  extents;              // records of the file, one per extent
+    unsigned int  base;                 // first sector of the volume of the record
+    unsigned int  new_lba;              // LBA of the new data
+    int           diff;                 // size difference in sectors
+    int           shift;                // sum of the previous differences
+    unsigned int  path;                 // offset of the path in the index
+    U64           time;                 // modification time of the new file
+    U64           hash;                 // XXH64 of the new data, with a cache
+    int           hashed;               // 'hash' already known for all the images
+} CHANGE;
+
+typedef struct {
+    char*         path;                 // file in the image
+    unsigned int  lba;                  // data in the image
+    U64           size;
+    U64           time;                 // modification time of the file written
+    U64           hash;                 // XXH64 of the data
+} CACHED;
+
+typedef struct {
+    CACHED*       files;                // sorted by path, then the new ones
+    unsigned int  count, max, sorted;
+} CACHE;
+
+typedef struct {
+    U64           position;             // position in the new image
+    U64           source;               // position in the old image, or PATCH_NEW
+    U64           length;
+} EXTENT;
+
+typedef struct {
+    U64           lba;                  // sector of the image
+    char*         data;                 // whole sector, NULL if the slot is free
+    int           dirty;                // changed, written by SectorFlush()
+} SECTOR;
+
+typedef struct SECTORS {
+    SECTOR*       table;                // open addressing table by LBA
+    unsigned int  count, size;          // size is a power of 2
+} SECTORS;
+
+typedef struct PATCH {
+    IMAGE*        source;               // old image, not changed
+    EXTENT*       extents;              // copies of the old image and new data
+    unsigned int  count, max;
+    int           relocate;             // moved raw sectors relocated when applied
+} PATCH;
+
+typedef struct ZIP {
+    unsigned int  format;               // CSO (deflate) or ZSO (LZ4)
+    unsigned int  block;                // bytes per block
+    unsigned int  align;                // block positions shift
+    unsigned int  blocks;               // blocks in the image
+    unsigned int* index;                // block positions, 'blocks' + 1
+    U64           size;                 // compressed file size
+} ZIP;
+
+typedef struct {
+    U64           v[4];                 // XXH64 lanes
+    U64           total;                // bytes hashed
+    unsigned char tail[32];             // bytes of the next stripe
+    unsigned int  tail_len;
+} DIGEST;
+
+typedef struct {
+    unsigned int  h[5];                 // SHA-1 state
+    U64           total;                // bytes hashed
+    unsigned char tail[64];             // bytes of the next block
+    unsigned int  tail_len;
+} SHA;
+
+typedef struct {
+    U64           position, length;     // bytes of the image
+    unsigned int  crc;                  // CRC32 of them
+    int           known;                // hashed by the copy, not read
+} SPAN;
+
+typedef struct {
+    IMAGE*        image;                // image to hash
+    SPAN*         spans;                // all its bytes, in order
+    unsigned int  count;
+    std::atomic<unsigned int> next;     // next span to read
+    std::atomic<int> failed;            // a worker stopped on an error
+    std::exception_ptr error;           // the error of that worker
+} HASHING;
+
+typedef struct WRITES {
+    SPAN*         copies;               // blocks of the copy engine, any order
+    unsigned int  ncopies, max_copies;
+    unsigned int* sectors;              // metadata sectors, any order
+    unsigned int  nsectors, max_sectors;
+} WRITES;
+
+typedef struct {
+    unsigned int  type;                 // REGION_*
+    U64           lba, newlba;          // sectors in the old/new image
+    unsigned int  count;                // sectors, or bytes of a path table
+    unsigned int  base;                 // first sector of the volume of a path table
+    int           sw;                   // path table with big-endian numbers
+    CHANGE*       change;               // new file of the data
+    U64           offset, length;       // bytes of the new file
+} REGION;
+
+typedef struct {
+    VOLUME*       volume;               // index with the records of the new image
+    IMAGE         check;                // new image, read again
+    IMAGE*        iso;                  // old image, for the copied sectors
+    char*         name;                 // new image file
+    CHANGE*       changes;              // new files, by LBA
+    int           count;
+    unsigned int  volume_sectors;       // sectors of the volume descriptor
+    int           layer_diff;           // and of the layer 1 one
+    unsigned int  base;                 // first sector of the layer 1 volume
+    U64           size;                 // exact size of the new image, or 0
+    int           source;               // runs copied from the old image
+    WRITES*       writes;               // what the update wrote
+    unsigned int* folders;              // LBAs of the folders, sorted
+    unsigned int  nfolders;
+    ENTRY**       records;              // all the records, by position
+    REGION*       regions;              // parts of the image to read again
+    unsigned int  nregions, max_regions;
+    std::atomic<unsigned int> next;     // next region to read
+    std::atomic<int> failed;            // a worker stopped on an error
+    std::exception_ptr error;           // the error of that worker
+} VERIFY;
+
+typedef struct {
+    IMAGE         file;                 // new file, open while read
+    IMAGE         temp;                 // temporal image, open while written
+    CACHE         known;                // hashes of the previous runs
+    PATCH         recorded;             // changes of a patch/compressed image
+    char*         path;                 // normalized name while searched
+    char*         tempname, * dataname; // temporal files next to the image
+    int           temp_made, data_made; // temporal files to remove on errors
+    WRITES        writes;               // metadata sectors and copies to verify
+} UPDATE;
+
+typedef struct {
+    unsigned int  lba;                  // first free sector
+    unsigned int  sectors;              // number of free sectors
+} GAP;
+
+typedef struct {
+    IMAGE*        src, * dst;           // files to copy from/to
+    U64           position, newposition;
+    U64           length, block;        // bytes to copy, bytes per buffer
+    int           direct;               // O_DIRECT on both files
+    int           stream;               // page cache dropped after every block
+    std::atomic<U64> next;              // next block to copy
+    std::atomic<int> failed;            // a worker stopped on an error
+    std::exception_ptr error;           // the error of that worker
+} JOB;
+
+typedef struct {
+    IMAGE         file;                 // extracted file, open while written
+    char*         name;                 // name of the extracted file
+    ENTRY*        entry;                // record in the image
+    U64           size;                 // data of all the extents
+    std::atomic<unsigned int> pending;  // pieces not written yet
+} OUTPUT;
+
+typedef struct {
+    char*         buffer;               // sectors read at once
+    std::atomic<unsigned int> users;    // pieces not written yet
+} BLOCK;
+
+typedef struct {
+    OUTPUT*       output;               // file to write
+    BLOCK*        block;                // sectors with the data
+    U64           offset;               // position in the file
+    unsigned int  sector, length;       // first sector in the block, bytes
+} PIECE;
+
+typedef struct {
+    IMAGE*        iso;                  // image read
+    PIECE*        queue;                // pieces to write, circular
+    unsigned int  first, count, max;
+    unsigned int  blocks;               // blocks in memory
+    int           done;                 // no more pieces
+    std::mutex    lock;
+    std::condition_variable ready;      // a piece is queued, or done
+    std::condition_variable space;      // a block is released
+    std::atomic<int> failed;            // a worker stopped on an error
+    std::exception_ptr error;           // the error of that worker
+} EXTRACT;
+
+typedef struct {
+    char          name[128];            // progress line
+    double        time;                 // elapsed seconds
+    U64           read_bytes, write_bytes;
+    U64           reads, writes;        // I/O calls
+    U64           folder_sectors;       // folder sectors visited
+    U64           memory;               // peak resident memory
+} PHASE;
+
+#ifdef HAVE_URING
+typedef struct {
+    int           fd;                   // io_uring file descriptor
+    unsigned int* sq_head, * sq_tail, * sq_mask, * sq_array;
+    unsigned int* cq_head, * cq_tail, * cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void*         sq_ptr, * cq_ptr;     // mapped rings
+    size_t        sq_len, cq_len, sqes_len;
+    unsigned int  pending;              // queued entries not submitted
+} URING;
+#endif
+
 /*----------------------------------------------------------------------------*/
 #define VERSION          "20150303"     // tool version
 #define VERSION_x64      "20220517"     // tool version x64
@@ -41,52 +371,461 @@ typedef unsigned long long U64;
 #define LEN_SECTOR_M0    0x800 // M0
 #define LEN_DATA_M0      0x800 // M0
 #define POS_DATA_M0      0x000 // M0
+#define LEN_SECTOR_M1    0x930 // M1
+#define LEN_DATA_M1      0x800 // M1
+#define POS_DATA_M1      0x010 // M1
+#define LEN_SECTOR_M2    0x930 // M2F1
+#define LEN_DATA_M2      0x800 // M2F1
+#define POS_DATA_M2      0x018 // M2F1
+
+#define MODE_M0          0              // user data only
+#define MODE_M1          1              // raw Mode 1
+#define MODE_M2          2              // raw Mode 2 Form 1
+
+#define SECTOR_ADDRESS   150            // address of the LBA 0, 00:02:00
+#define ENCODE_SECTORS   256            // min raw sectors per encoding thread
 
-#define TMPNAME          "umd-replace.$" // temporal name
+#define TMPNAME          ".umd-replace.$" // temporal image, after the image name
+#define TMPDATA          ".umd-replace.$$" // new data of a patch/compressed image
 #define BLOCKSIZE        16384           // sectors to read/write at once
 
+#define IMAGE_READ       0              // open an existing file to read
+#define IMAGE_WRITE      1              // open an existing file to read/write
+#define IMAGE_CREATE     2              // create/truncate a file to read/write
+#define IO_CHUNK         0x40000000     // max bytes per positioned read/write
+
+#define COPY_CLONE       2              // reflink, the sectors are shared
+#define COPY_KERNEL      1              // copy_file_range, no userspace copy
+#define COPY_PLAIN       0              // read/write
+
+#define ENGINE_AUTO      0              // kernel copy, else pipelined copy
+#define ENGINE_URING     1              // pipelined copy with io_uring
+#define ENGINE_THREADS   2              // pipelined copy with threads
+#define ENGINE_SERIAL    3              // one block read/written at once
+
+#define QUEUE_DEPTH      8              // blocks in flight in the copy engine
+#define IO_JOBS          2              // images copying data at once
+#define BLOCK_SECTORS    512            // sectors per block in the copy engine
+#define ALIGNMENT        4096           // sector buffers alignment
+#define POOL_CLASSES     48             // buffer sizes, powers of 2
+#define POOL_MIN         12             // smallest buffer, 4 KB
+#define POOL_BYTES       0x8000000      // max free buffer bytes kept
+#define HUGE_PAGE        0x200000       // buffers in huge pages from this size
+
+#define PLACE_SHIFT      0              // move all the next sectors
+#define PLACE_GAP        1              // own slack, free gaps or image end
+#define PLACE_END        2              // own slack or image end
+
+#define STATS_NONE       0              // no statistics
+#define STATS_TEXT       1              // statistics table
+#define STATS_JSON       2              // statistics in a JSON line
+
+#define CACHE_SUFFIX     ".cache"       // cache name, after the image name
+#define CACHE_HEADER     "UMD-REPLACE cache 1" // cache format
+#define HASH_BLOCK       0x100000       // bytes read at once to hash/compare
+#define HASH_THREAD      0x4000000      // min bytes per CRC32 thread
+
+#define VERIFY_NONE      0              // the new image is not read again
+#define VERIFY_REGIONS   1              // the written regions are read again
+#define VERIFY_CRC32     2              // and the CRC32 of the whole image
+#define VERIFY_SHA1      3              // and the SHA-1 of the whole image
+#define REGION_METADATA  0              // written metadata sectors read again
+#define REGION_TABLE     1
+#define REGION_DATA      2
+#define REGION_COPY      3
+
+#define PATCH_MAGIC      "UMDPATCH"     // patch file signature
+#define PATCH_VERSION    2              // patch file format
+#define PATCH_END        0              // patch operations
+#define PATCH_COPY       1
+#define PATCH_DATA       2
+#define PATCH_NEW        0xFFFFFFFFFFFFFFFFULL // new data, not from the old image
+
+#define ZIP_CSO          0              // CSO, raw deflate blocks
+#define ZIP_ZSO          1              // ZSO, LZ4 blocks
+#define ZIP_HEADER       0x18           // CSO/ZSO header size
+#define ZIP_PLAIN        0x80000000     // block stored uncompressed
+#define ZIP_BATCH        0x800000       // bytes compressed at once
+#define ZIP_BLOCKS       64             // min blocks per compression thread
+
+#define XXH_P1           0x9E3779B185EBCA87ULL // XXH64 primes
+#define XXH_P2           0xC2B2AE3D27D4EB4FULL
+#define XXH_P3           0x165667B19E3779F9ULL
+#define XXH_P4           0x85EBCA77C2B2AE63ULL
+#define XXH_P5           0x27D4EB2F165667C5ULL
+
+#define NONE             0xFFFFFFFF     // no path for '.' and '..' entries
+#define EXTENT_SIZE      0xFFFFF800     // bytes in a full extent of a multi-extent file
+#define MAX_PATH         1024           // max length of a path in the image
+#define MAX_DEPTH        64             // max folder depth, to stop on loops
+
 /*----------------------------------------------------------------------------*/
-#define EXIT(text)       { printf(text); exit(EXIT_FAILURE); }
+// the errors are exceptions, printed by main() or returned by IsoImage
+#define EXIT(text)       { throw IsoError(text); }
+
+#define XXH_ROTL(x, r)   (((x) << (r)) | ((x) >> (64 - (r))))
+#define XXH_ROUND(a, x)  (XXH_ROTL((a) + (x) * XXH_P2, 31) * XXH_P1)
+#define SHA_ROTL(x, r)   (((x) << (r)) | ((x) >> (32 - (r))))
 
 /*----------------------------------------------------------------------------*/
 void  Title(void);
 void  Usage(void);
+int   Option(char* arg);
+void  Phase(const char* format, ...);
+void  PhaseEnd(void);
+void  Stats(IMAGE* iso);
+void  JSON(const char* text);
+double Clock(void);
+U64   PeakMemory(void);
+
+void  Open(IMAGE* image, char* filename, int access);
+void  OpenError(char* filename);
+void  Close(IMAGE* image);
+void  Unopened(IMAGE* image);
+void  Map(IMAGE* image);
+void  Unmap(IMAGE* image);
+void  PRead(IMAGE* image, U64 position, char* buffer, U64 length);
+void  PWrite(IMAGE* image, U64 position, char* buffer, U64 length);
+void  PWriteData(IMAGE* image, U64 position, char* buffer, U64 length);
+void  Sparse(IMAGE* image, U64 position, char* buffer, U64 length);
+void  Hole(IMAGE* image, U64 position, U64 length);
+int   Zeros(char* buffer, U64 length);
+U64   SeekData(IMAGE* image, U64 position, U64 end);
+U64   SeekHole(IMAGE* image, U64 position, U64 end);
 
 U64   FileSize(char* filename);
-char* Load(char* filename);
+int   Exists(char* filename);
 void  Save(char* filename, char* buffer, int length);
-char* Read(char* filename, U64 position, int length);
-void  Write(char* filename, U64 position, int length, char* buffer);
+char* Read(IMAGE* image, U64 position, int length);
+void  ReadData(IMAGE* image, U64 position, char* buffer, U64 length);
+void  Write(IMAGE* image, U64 position, int length, char* buffer);
 void  Create(char* filename);
 char* Memory(int length, int size);
 int   StrLen(char* data);
 int   ChangeEndian(char* value);
 
-void  Replace(char* isoname, char* oldname, char* newname);
-U64   Search(char* isoname, char* filename, char* path, int lba, int len);
-void  PathTable(char* isoname, int lba, int len, int lba_old, int diff, int sw);
-void  TOC(char* isoname, int lba, int len, U64 found, int lba_old, int diff);
-char* ReadSectors(char* isoname, U64 lba, int sectors);
-void WriteSectors(char* isoname, U64 lba, char* buffer, int sectors);
+int   Tool(int argc, char** argv);
+void  Replace(char* isoname, CHANGE* changes, int count);
+void  Images(char** isonames, int images, CHANGE* changes, int count, int jobs, int io);
+void  Prepare(CHANGE* changes, int count);
+void  IoBegin(void);
+void  IoEnd(void);
+char* Temporal(char* isoname, const char* suffix);
+void  Server(char* isoname, char* socketname);
+FILE* Replies(void);
+int   Session(IsoImage* image, char* isoname, FILE* in, FILE* out);
+char* Word(char* text);
+void  VolumeOpen(VOLUME* volume, char* isoname, int access);
+void  VolumeClose(VOLUME* volume);
+int   Apply(VOLUME* volume, CHANGE* changes, int count);
+int   Update(VOLUME* volume, CHANGE* changes, int count, UPDATE* update);
+void  UpdateFree(UPDATE* update);
+char* Normalize(char* filename);
+void  FileError(char* filename, const char* text);
+U64   Length(ENTRY* entry);
+int   Contiguous(IMAGE* iso, ENTRY* entry);
+int   Unchanged(IMAGE* iso, CHANGE* change, IMAGE* file, CACHE* cache, char* path);
+int   Same(IMAGE* iso, CHANGE* change, IMAGE* file, U64* hash);
+void  Verify(VOLUME* volume, char* name, CHANGE* changes, int count, unsigned int volume_sectors, int layer_diff, U64 size, int source, WRITES* writes);
+void  VerifyImage(VERIFY* work);
+REGION* VerifyAdd(VERIFY* work, unsigned int type, U64 newlba, unsigned int count);
+void  VerifyWorker(VERIFY* work);
+void  VerifyFree(VERIFY* work);
+void  VerifyMetadata(VERIFY* work, REGION* region);
+void  VerifyVolume(IMAGE* image, unsigned char* buffer, U64 lba, unsigned int sectors);
+void  VerifyTable(VERIFY* work, REGION* region);
+void  VerifyData(VERIFY* work, REGION* region, IMAGE* file);
+void  VerifyCopy(VERIFY* work, REGION* region);
+void  VerifySectors(IMAGE* image, unsigned char* sectors, U64 lba, unsigned int count, const char* text);
+void  VerifyError(const char* text, U64 lba);
+void  Uncache(IMAGE* image, U64 position, U64 length);
+int   CompareLBA(const void* a, const void* b);
+int   CompareRecord(const void* a, const void* b);
+U64   Digest(IMAGE* file);
+void  DigestInit(DIGEST* digest);
+void  DigestUpdate(DIGEST* digest, unsigned char* data, U64 length);
+U64   DigestFinal(DIGEST* digest);
+void  Checksum(IMAGE* image, WRITES* writes);
+void  CRCTables(void);
+void  CRCWorker(HASHING* hashing);
+void  Copied(IMAGE* dst, U64 position, char* buffer, U64 length);
+void  Written(IMAGE* iso, U64 lba, int sectors);
+int   CompareSpan(const void* a, const void* b);
+unsigned int CRC32(unsigned int crc, unsigned char* data, U64 length);
+unsigned int CRC32Combine(unsigned int crc1, unsigned int crc2, U64 length2);
+unsigned int GF2Times(unsigned int* matrix, unsigned int vector);
+void  GF2Square(unsigned int* square, unsigned int* matrix);
+void  ShaInit(SHA* sha);
+void  ShaUpdate(SHA* sha, unsigned char* data, U64 length);
+void  ShaFinal(SHA* sha, unsigned char* hash);
+void  ShaBlock(SHA* sha, unsigned char* data);
+void  CacheLoad(CACHE* cache, IMAGE* iso);
+void  CacheUpdate(CACHE* cache, INDEX* index, CHANGE* changes, int count);
+void  CacheSave(CACHE* cache, char* isoname);
+void  CacheFree(CACHE* cache);
+CACHED* CacheFind(CACHE* cache, char* path);
+int   CompareCached(const void* a, const void* b);
+void  PatchInit(PATCH* patch, IMAGE* source);
+void  PatchFree(PATCH* patch);
+void  PatchAdd(IMAGE* image, U64 position, U64 source, U64 length);
+void  PatchRead(IMAGE* image, U64 position, char* buffer, U64 length);
+void  PatchWrite(IMAGE* image, char* patchname);
+void  PatchApply(char* patchname, char* isoname);
+void  PatchSource(DIGEST* digest, IMAGE* source, U64 position, U64 length);
+int   CompareExtent(const void* a, const void* b);
+void  PatchSplit(PATCH* patch, EXTENT** new_data, unsigned int* new_count, EXTENT** old_data, unsigned int* old_count);
+void  ZipOpen(IMAGE* image);
+void  ZipClose(IMAGE* image);
+void  ZipRead(IMAGE* image, U64 position, char* buffer, U64 length);
+void  ZipWrite(IMAGE* image, char* filename);
+void  ZipEncode(ZIP* zip, unsigned char* data, unsigned int blocks, unsigned int last, unsigned char* out, unsigned int* sizes);
+void  ZipEncodeBlocks(ZIP* zip, unsigned char* data, unsigned int blocks, unsigned int last, unsigned char* out, unsigned int* sizes);
+unsigned int ZipCopied(ZIP* zip, EXTENT* copies, unsigned int ncopies, unsigned int* k, unsigned int block, U64 size, U64 old_size);
+unsigned int ZipBound(ZIP* zip);
+unsigned int LZ4Encode(unsigned char* src, unsigned int length, unsigned char* dst, unsigned int size);
+unsigned int LZ4Decode(unsigned char* src, unsigned int length, unsigned char* dst, unsigned int size);
+void  List(char* isoname, char* pattern);
+void  Extract(char* isoname, char* folder, char* pattern);
+void  ExtractQueue(EXTRACT* work, PIECE* piece);
+void  ExtractWorker(EXTRACT* work);
+void  ExtractBlock(EXTRACT* work, BLOCK* block);
+void  ExtractOutput(OUTPUT* output);
+void  ExtractFail(EXTRACT* work);
+int   Selected(char* pattern, char* path);
+int   Contained(char* path);
+int   Match(char* pattern, char* text);
+void  Folder(char* name);
+int   CompareOutput(const void* a, const void* b);
+CHANGE* Manifest(char* filename, int* count);
+int   Compare(const void* a, const void* b);
+int   ShiftLBA(CHANGE* changes, int count, unsigned int lba, U64 position);
+int   ShiftSector(CHANGE* changes, int count, U64 lba);
+unsigned int Place(IMAGE* iso, IMAGE* out, INDEX* index, CHANGE* changes, int count, unsigned int* tables, unsigned int tbl_len, unsigned int total_sectors);
+int   CompareGap(const void* a, const void* b);
+void  Release(GAP** gaps, int* count, int* max, unsigned int lba, unsigned int sectors);
+int   Zeroed(IMAGE* iso, U64 lba, U64 sectors);
+void  Zero(IMAGE* iso, U64 lba, U64 sectors);
+void  CopySectors(IMAGE* src, U64 lba, IMAGE* dst, U64 newlba, U64 sectors);
+void  CopyData(IMAGE* src, U64 position, IMAGE* dst, U64 newposition, U64 length);
+void  CopyRange(IMAGE* src, U64 position, IMAGE* dst, U64 newposition, U64 length);
+U64   CopyClone(IMAGE* src, U64 position, IMAGE* dst, U64 newposition, U64 length);
+U64   CopyKernel(IMAGE* src, U64 position, IMAGE* dst, U64 newposition, U64 length);
+void  CopyEngine(IMAGE* src, U64 position, IMAGE* dst, U64 newposition, U64 length);
+int   CopyUring(IMAGE* src, U64 position, IMAGE* dst, U64 newposition, U64 length);
+void  CopyThreads(IMAGE* src, U64 position, IMAGE* dst, U64 newposition, U64 length);
+void  CopyWorker(JOB* job);
+int   CopyDirect(IMAGE* src, U64 position, IMAGE* dst, U64 newposition, U64 length);
+void  CopyBlock(JOB* job, char* buffer, U64 offset, U64 count);
+void  Stream(IMAGE* src, U64 position, IMAGE* dst, U64 newposition, U64 length);
+#ifdef HAVE_URING
+int   UringOpen(URING* ring, unsigned int entries);
+void  UringClose(URING* ring);
+void  UringQueue(URING* ring, int opcode, int fd, char* buffer, U64 length, U64 position, U64 data, struct iovec* iov);
+void  UringSubmit(URING* ring, unsigned int wait);
+#endif
+char* Aligned(U64 length);
+void  AlignedFree(char* buffer);
+void  MoveImage(IMAGE* iso, CHANGE* changes, int count, U64 total_sectors);
+int   MoveBlocks(IMAGE* iso, CHANGE* changes, int count, U64 total_sectors);
+void  MoveSectors(IMAGE* iso, U64 lba, U64 newlba, U64 sectors);
+void  Truncate(IMAGE* image, U64 size);
+void  WriteData(IMAGE* out, U64 lba, IMAGE* file);
+void  Format(IMAGE* iso);
+void  FormatAs(IMAGE* image, IMAGE* model);
+void  Tables(void);
+void  Encode(IMAGE* image, char* buffer, U64 lba, U64 sectors);
+template <unsigned int MODE> void EncodeSectors(IMAGE* image, unsigned char* buffer, U64 lba, U64 sectors);
+void  Relocate(IMAGE* image, char* buffer, U64 lba, U64 sectors);
+void  Address(IMAGE* image, unsigned char* sector, U64 lba);
+unsigned int EDC(unsigned char* data, unsigned int length);
+void  ECC(unsigned char* sector);
+void  ECCBlock(unsigned char* data, unsigned int columns, unsigned int rows, unsigned char* parity);
+void  IndexTree(VOLUME* volume);
+void  IndexFolder(IMAGE* iso, INDEX* index, char* path, unsigned int base, int lba, int len, int depth);
+int   ValidName(char* name, unsigned int length);
+void  IndexFree(INDEX* index);
+unsigned int Hash(char* path);
+ENTRY* Search(INDEX* index, char* filename);
+void  PathTable(IMAGE* iso, INDEX* index, CHANGE* changes, int count, unsigned int base, int lba, int len, int sw);
+void  TOC(IMAGE* iso, INDEX* index, CHANGE* changes, int count);
+char* ReadSectors(IMAGE* iso, U64 lba, int sectors);
+void  WriteSectors(IMAGE* iso, U64 lba, char* buffer, int sectors);
+char* GetSectors(IMAGE* iso, U64 lba, int sectors);
+void  PutSectors(IMAGE* iso, U64 lba, char* buffer, int sectors);
+void  DropSectors(IMAGE* iso, char* buffer);
+void  SectorCache(IMAGE* iso);
+char* SectorGet(IMAGE* iso, U64 lba, int sectors);
+void  SectorPut(IMAGE* iso, U64 lba, char* buffer, int sectors);
+void  SectorFlush(IMAGE* iso);
+void  SectorFree(IMAGE* iso);
+void  SectorDrop(IMAGE* iso, U64 position, U64 length);
+SECTOR* SectorFind(SECTORS* cache, U64 lba);
+SECTOR* SectorAdd(SECTORS* cache, U64 lba, unsigned int length);
+void  SectorRemove(SECTORS* cache, SECTOR* sector);
+unsigned int SectorSlot(SECTORS* cache, U64 lba);
+int   CompareSector(const void* a, const void* b);
 
 /*----------------------------------------------------------------------------*/
-unsigned int mode;        // image mode
-unsigned int sector_size; // sector size
-unsigned int data_offset; // sector data start
-unsigned int sector_data; // sector data length
+unsigned int   edc_table[8][256]; // EDC, 8 bytes at once
+unsigned int   crc_table[8][256]; // CRC32, 8 bytes at once
+unsigned char  ecc_f[256];        // ECC, multiply by 2 in GF(2^8)
+unsigned char  ecc_b[256];        // ECC, divide by 3 in GF(2^8)
+unsigned short ecc_q[43 * 52];    // ECC, Q diagonals as rows
+
+unsigned int inplace;     // move the sectors inside the image, no temporal image
+unsigned int place;       // placement of the new data
+unsigned int mapped;      // patch the metadata in a memory map of the image
+unsigned int stats;       // statistics of every phase
+unsigned int cache;       // hashes of the data written, next to the image
+char*        patchname;   // patch to write instead of changing the image
+unsigned int sparse;      // zero blocks are holes in the new image
+unsigned int direct;      // bulk copies with O_DIRECT, out of the page cache
+unsigned int verify;      // the written regions are read again after the update
+
+PHASE*       phases;      // phases for the statistics
+unsigned int phases_count, phases_max;
+
+std::atomic<U64> read_bytes, write_bytes; // I/O counters for the statistics
+std::atomic<U64> reads, writes;
+U64          folder_sectors;
+
+char*        pool[POOL_CLASSES];          // free aligned buffers by size
+U64          pool_bytes;                  // bytes in 'pool'
+std::mutex   pool_lock;
+std::mutex   size_lock;                   // image sizes grown by many writers
+std::mutex   writes_lock;                 // blocks hashed by many copy workers
+std::once_flag crc_tables;                // CRC32 tables, built once
+
+char*        label = (char*)"";           // image of the progress lines
+FILE*        replies;                     // answers of a server on stdin
+int          io_lock = -1;                // file with a lock slot per image copying data
+int          io_slots;                    // lock slots of 'io_lock'
+int          io_held = -1;                // slot of 'io_lock' taken
+
+unsigned int engine;                      // copy method
+unsigned int queue_depth = QUEUE_DEPTH;   // copy engine blocks in flight
+unsigned int block_sectors = BLOCK_SECTORS; // copy engine sectors per block
 
+#ifndef UMD_LIBRARY
 /*----------------------------------------------------------------------------*/
 int main(int argc, char** argv) {
+    int i;
+
+    // the progress lines are seen as they are printed, also through a pipe
+    setvbuf(stdout, NULL, _IOLBF, BUFSIZ);
+
+    // a server on stdin keeps stdout for the answers, the banner and the
+    // progress lines go to stderr
+    for (i = 1; (i < argc) && (argv[i][0] == '-'); i++) {
+        if (!strcmp(argv[i], "--server")) replies = Replies();
+    }
+
     Title();
 
-    if (argc != 4) Usage();
-    
-    Replace(argv[1], argv[2], argv[3]);
+    try {
+        Tool(argc, argv);
+    }
+    catch (IsoError& e) {
+        printf("%s", e.what());
+        exit(EXIT_FAILURE);
+    }
+
+    exit(EXIT_SUCCESS);
+}
+
+/*----------------------------------------------------------------------------*/
+int Tool(int argc, char** argv) {
+    CHANGE* changes;
+    char*   manifest, * apply, * extract, * files, * socketname;
+    int     count, list, jobs, io, server;
+    int     i;
+
+    // options
+    manifest = apply = extract = files = socketname = NULL;
+    list = server = 0;
+    jobs = 0;
+    io = IO_JOBS;
+    for (i = 1; (i < argc) && (argv[i][0] == '-'); i++) {
+        if (!strncmp(argv[i], "--manifest=", 11)) manifest = argv[i] + 11;
+        else if (!strncmp(argv[i], "--jobs=", 7) && (atoi(argv[i] + 7) > 0)) jobs = atoi(argv[i] + 7);
+        else if (!strncmp(argv[i], "--io=", 5) && (atoi(argv[i] + 5) > 0)) io = atoi(argv[i] + 5);
+        else if (!strncmp(argv[i], "--apply=", 8)) apply = argv[i] + 8;
+        else if (!strcmp(argv[i], "--list")) list = 1;
+        else if (!strncmp(argv[i], "--extract=", 10) && argv[i][10]) extract = argv[i] + 10;
+        else if (!strncmp(argv[i], "--files=", 8) && argv[i][8]) files = argv[i] + 8;
+        else if (!strcmp(argv[i], "--server")) server = 1;
+        else if (!strncmp(argv[i], "--server=", 9) && argv[i][9]) server = 1, socketname = argv[i] + 9;
+        else if (!Option(argv[i])) Usage();
+    }
+    argv += i - 1; argc -= i - 1;
+
+    if (list || (extract != NULL)) {
+        if ((argc != 2) || (manifest != NULL) || (apply != NULL) || server || (list && (extract != NULL))) Usage();
+
+        if (list) List(argv[1], files);
+        else      Extract(argv[1], extract, files);
+
+        printf("\nDone\n");
+
+        return(EXIT_SUCCESS);
+    }
+    if (files != NULL) Usage();
+
+    if (apply != NULL) {
+        if ((argc != 2) || (manifest != NULL) || server) Usage();
+
+        PatchApply(apply, argv[1]);
+
+        printf("\nDone\n");
+
+        return(EXIT_SUCCESS);
+    }
+
+    if (server) {
+        if ((argc != 2) || (manifest != NULL)) Usage();
+
+        Server(argv[1], socketname);
+
+        printf("\nDone\n");
+
+        return(EXIT_SUCCESS);
+    }
+
+    if (manifest != NULL) {
+        if (argc < 2) Usage();
+
+        changes = Manifest(manifest, &count);
+
+        // the same files in every image
+        if (argc > 2) {
+            Images(argv + 1, argc - 1, changes, count, jobs, io);
+            free(changes);
+
+            printf("\nDone\n");
+
+            return(EXIT_SUCCESS);
+        }
+    }
+    else {
+        if ((argc < 4) || (argc & 1)) Usage();
+
+        count = (argc - 2) / 2;
+        changes = (CHANGE*)Memory(count, sizeof(CHANGE));
+        for (i = 0; i < count; i++) {
+            changes[i].oldname = argv[2 + 2 * i];
+            changes[i].newname = argv[3 + 2 * i];
+        }
+    }
+
+    Replace(argv[1], changes, count);
+
+    free(changes);
 
     printf("\nDone\n");
 
-    exit(EXIT_SUCCESS);
+    return(EXIT_SUCCESS);
 }
+#endif
 
 /*----------------------------------------------------------------------------*/
 void Title(void) {
@@ -94,7 +833,7 @@ void Title(void) {
         "\n"
         "UMD-REPLACE version %s - Copyright (C) 2012-2015 CUE\n"
         "UMD-REPLACE_x64 version %s - Copyright (C) 2022 Snake128\n"
-        "Tiny tool to replace data files in a PSP UMD ISO and PS2 layer0 ISO\n"
+        "Tiny tool to replace data files in a PSP UMD ISO and PS2 DVD ISO\n"
         "\n",
         VERSION, VERSION_x64
     );
@@ -103,349 +842,5088 @@ void Title(void) {
 /*----------------------------------------------------------------------------*/
 void Usage(void) {
     EXIT(
-        "Usage: UMD-REPLACE imagename filename newfile\n"
+        "Usage: UMD-REPLACE [options] imagename filename newfile [filename newfile ...]\n"
+        "       UMD-REPLACE [options] --manifest=listfile imagename [imagename ...]\n"
+        "       UMD-REPLACE --apply=patchfile imagename\n"
+        "       UMD-REPLACE [options] --list imagename\n"
+        "       UMD-REPLACE [options] --extract=folder imagename\n"
+        "       UMD-REPLACE [options] --server[=socket] imagename\n"
         "\n"
         "- 'imagename' is the name of the ISO image\n"
         "- 'filename' is the file in the ISO image with the data to be replaced\n"
         "- 'newfile' is the file with the new data\n"
+        "- 'listfile' is a text file with a 'filename newfile' pair per line\n"
+        "- 'patchfile' is a patch written with '--patch'\n"
+        "- 'folder' is the folder for the extracted files, created if needed\n"
+        "- 'socket' is the UNIX socket of the server, else stdin/stdout\n"
         "\n"
         "* 'imagename' must be a valid UMD/PS2 ISO image\n"
+        "* 'imagename' can have 2048-byte or raw 2352-byte sectors (Mode 1 or\n"
+        "  Mode 2 Form 1), the EDC/ECC of the raw sectors is updated\n"
+        "* 'imagename' can be a CSO or ZSO compressed image, written compressed\n"
         "* 'filename' can use either the slash or backslash\n"
-        "* 'newfile' can be different size as 'filename'\n"
+        "* 'newfile' can be different size as 'filename', and larger than 4 GB\n"
+        "  if 'filename' has enough extents\n"
+        "* all the files are replaced with a single rewrite of the image\n"
+        "\n"
+        "Options:\n"
+        "  --inplace  move the next sectors inside the image instead of writing a\n"
+        "             temporal image (half the disk space, no copy of the previous\n"
+        "             sectors, but the image is lost if the process is stopped)\n"
+        "  --mmap     map the image in memory and patch the volume descriptor, path\n"
+        "             tables and folder records in place\n"
+        "  --place=shift  move all the next sectors when a file changes its size\n"
+        "             (default)\n"
+        "  --place=gap    keep the data in its sectors plus the free ones after them,\n"
+        "             or move it to the best free gap, or to the end of the image\n"
+        "  --place=end    keep the data in its sectors plus the free ones after them,\n"
+        "             or move it to the end of the image\n"
+        "  --copy=auto    copy inside the kernel (reflink, copy_file_range), else\n"
+        "             pipelined copy (default)\n"
+        "  --copy=uring   pipelined copy with io_uring, else with threads\n"
+        "  --copy=threads pipelined copy with a thread per block in flight\n"
+        "  --copy=serial  read and write one block at once\n"
+        "  --queue=N  blocks in flight in the pipelined copy (default 8)\n"
+        "  --block=N  sectors per block in the pipelined copy (default 512)\n"
+        "  --stats    time, I/O and memory of every phase at the end\n"
+        "  --stats=json  the same in a single JSON line\n"
+        "  --cache    hashes of the files written in 'imagename.cache', to skip\n"
+        "             the files with the same data in the next runs\n"
+        "  --patch=patchfile  write the changes to 'patchfile', the image is not\n"
+        "             changed, '--apply' changes an image as the patch\n"
+        "  --direct   copy the data with O_DIRECT, out of the page cache, or drop\n"
+        "             the pages after every block if not supported\n"
+        "  --sparse   zero blocks are holes in the new image, and the holes of the\n"
+        "             images and new files are not read\n"
+        "  --verify   read the new data, the moved sectors and the patched metadata\n"
+        "             again from the storage and check them\n"
+        "  --verify=crc32  the same, plus the CRC32 of the whole image\n"
+        "  --verify=sha1   the same, plus the SHA-1 of the whole image\n"
+        "  --jobs=N   images updated at once with a manifest (default: cores)\n"
+        "  --io=N     images copying data at once with a manifest (default 2)\n"
+        "  --server   keep the image open and indexed, and replace the files\n"
+        "             with the commands read line by line ('replace filename\n"
+        "             newfile', 'lookup filename', 'commit', 'discard', 'quit')\n"
+        "  --files=pattern  only list/extract the paths matching 'pattern' ('*'\n"
+        "             any characters, '?' one character) or inside a matching folder\n"
     );
 }
 
 /*----------------------------------------------------------------------------*/
-U64 FileSize(char* filename) {
-    FILE* fp;
-    U64   fs;
-    fp = fopen(filename, "r");
-    if (!fp)perror("fopen");
+int Option(char* arg) {
+    unsigned int value;
 
-    if (fp == NULL) EXIT("File open error\n");
-    _fseeki64(fp, 0, SEEK_END);
-    fs = _ftelli64(fp);
-    if (fclose(fp) == EOF) EXIT("File close error\n");
+    // the options shared by the tool and the library, 0 if unknown
+    if (!strcmp(arg, "--inplace")) inplace = 1;
+    else if (!strcmp(arg, "--mmap")) mapped = 1;
+    else if (!strcmp(arg, "--stats")) stats = STATS_TEXT;
+    else if (!strcmp(arg, "--stats=json")) stats = STATS_JSON;
+    else if (!strcmp(arg, "--cache")) cache = 1;
+    else if (!strcmp(arg, "--sparse")) sparse = 1;
+    else if (!strcmp(arg, "--direct")) direct = 1;
+    else if (!strcmp(arg, "--verify")) verify = VERIFY_REGIONS;
+    else if (!strcmp(arg, "--verify=crc32")) verify = VERIFY_CRC32;
+    else if (!strcmp(arg, "--verify=sha1")) verify = VERIFY_SHA1;
+    else if (!strncmp(arg, "--patch=", 8) && arg[8]) {
+        free(patchname);
+        patchname = Memory(StrLen(arg + 8) + 1, sizeof(char));
+        strcpy(patchname, arg + 8);
+    }
+    else if (!strcmp(arg, "--place=shift")) place = PLACE_SHIFT;
+    else if (!strcmp(arg, "--place=gap")) place = PLACE_GAP;
+    else if (!strcmp(arg, "--place=end")) place = PLACE_END;
+    else if (!strcmp(arg, "--copy=auto")) engine = ENGINE_AUTO;
+    else if (!strcmp(arg, "--copy=uring")) engine = ENGINE_URING;
+    else if (!strcmp(arg, "--copy=threads")) engine = ENGINE_THREADS;
+    else if (!strcmp(arg, "--copy=serial")) engine = ENGINE_SERIAL;
+    else if (!strncmp(arg, "--queue=", 8)) {
+        value = atoi(arg + 8);
+        if ((value < 1) || (value > 256)) return(0);
+        queue_depth = value;
+    }
+    else if (!strncmp(arg, "--block=", 8)) {
+        value = atoi(arg + 8);
+        if ((value < 1) || (value > BLOCKSIZE)) return(0);
+        block_sectors = value;
+    }
+    else return(0);
 
-    return(fs);
+    return(1);
 }
 
 /*----------------------------------------------------------------------------*/
-char* Load(char* filename) {
-    return(Read(filename, 0, FileSize(filename)));
+void Phase(const char* format, ...) {
+    PHASE*  phase;
+    va_list args;
+
+    printf("- %s", label);
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf("\n");
+
+    if (!stats) return;
+
+    PhaseEnd();
+
+    if (phases_count == phases_max) {
+        phases_max = phases_max ? phases_max << 1 : 32;
+        phases = (PHASE*)realloc(phases, phases_max * sizeof(PHASE));
+        if (phases == NULL) EXIT("Memory error\n");
+    }
+
+    // the counters when the phase starts, the differences when it ends
+    phase = &phases[phases_count++];
+    va_start(args, format);
+    vsnprintf(phase->name, sizeof(phase->name), format, args);
+    va_end(args);
+    phase->time = Clock();
+    phase->read_bytes = read_bytes;
+    phase->write_bytes = write_bytes;
+    phase->reads = reads;
+    phase->writes = writes;
+    phase->folder_sectors = folder_sectors;
+    phase->memory = 0;
 }
 
 /*----------------------------------------------------------------------------*/
-void Save(char* filename, char* buffer, int length) {
-    Write(filename, 0, length, buffer);
+void PhaseEnd(void) {
+    PHASE* phase;
+
+    if (!phases_count) return;
+
+    phase = &phases[phases_count - 1];
+    if (phase->memory) return;
+
+    phase->time = Clock() - phase->time;
+    phase->read_bytes = read_bytes - phase->read_bytes;
+    phase->write_bytes = write_bytes - phase->write_bytes;
+    phase->reads = reads - phase->reads;
+    phase->writes = writes - phase->writes;
+    phase->folder_sectors = folder_sectors - phase->folder_sectors;
+    phase->memory = PeakMemory();
+    if (!phase->memory) phase->memory = 1;
 }
 
 /*----------------------------------------------------------------------------*/
-char* Read(char* filename, U64 position, int length) {
-    FILE* fp;
-    char* fb;
+void Stats(IMAGE* iso) {
+    PHASE        total, * phase;
+    unsigned int i;
+
+    PhaseEnd();
 
-    if (position + length > FileSize(filename)) EXIT("Read past the end\n");
+    memset(&total, 0, sizeof(total));
+    strcpy(total.name, "total");
+    for (i = 0; i < phases_count; i++) {
+        phase = &phases[i];
+        total.time += phase->time;
+        total.read_bytes += phase->read_bytes;
+        total.write_bytes += phase->write_bytes;
+        total.reads += phase->reads;
+        total.writes += phase->writes;
+        total.folder_sectors += phase->folder_sectors;
+        if (phase->memory > total.memory) total.memory = phase->memory;
+    }
 
-    if ((fp = fopen(filename, "rb")) == NULL) EXIT("File open error\n");
-    fb = Memory(length, sizeof(char));
-    if (_fseeki64(fp, position, SEEK_SET)) EXIT("File seek error\n");
-    if (fread(fb, 1, length, fp) != length) EXIT("File read error\n");
-    if (fclose(fp) == EOF) EXIT("File close error\n");
+    if (stats == STATS_JSON) {
+        // a single line, with the phases in order and the totals
+        printf("{\"image\":");
+        JSON(iso->name);
+        printf(",\"sector_size\":%u,\"phases\":[", iso->sector_size);
+        for (i = 0; i <= phases_count; i++) {
+            phase = i < phases_count ? &phases[i] : &total;
+            if (i == phases_count) printf("],\"total\":");
+            else if (i) printf(",");
+            printf("{\"name\":");
+            JSON(phase->name);
+            printf(
+                ",\"seconds\":%.6f,\"read_bytes\":%llu,\"write_bytes\":%llu,"
+                "\"read_sectors\":%llu,\"write_sectors\":%llu,\"reads\":%llu,\"writes\":%llu,"
+                "\"folder_sectors\":%llu,\"peak_memory\":%llu}",
+                phase->time, phase->read_bytes, phase->write_bytes,
+                phase->read_bytes / iso->sector_size, phase->write_bytes / iso->sector_size,
+                phase->reads, phase->writes, phase->folder_sectors, phase->memory
+            );
+        }
+        printf("}\n");
+        return;
+    }
 
-    return(fb);
+    printf(
+        "\n%-40s %9s %9s %9s %9s %9s %9s %9s %9s\n",
+        "phase", "seconds", "read MB", "write MB", "sectors r", "sectors w", "reads", "writes", "folders"
+    );
+    for (i = 0; i <= phases_count; i++) {
+        phase = i < phases_count ? &phases[i] : &total;
+        printf(
+            "%-40.40s %9.3f %9.1f %9.1f %9llu %9llu %9llu %9llu %9llu\n",
+            phase->name, phase->time, phase->read_bytes / 1048576.0, phase->write_bytes / 1048576.0,
+            phase->read_bytes / iso->sector_size, phase->write_bytes / iso->sector_size,
+            phase->reads, phase->writes, phase->folder_sectors
+        );
+    }
+    printf("peak memory: %.1f MB\n", total.memory / 1048576.0);
 }
 
 /*----------------------------------------------------------------------------*/
-void Write(char* filename, U64 position, int length, char* buffer) {
-    FILE* fp;
+void JSON(const char* text) {
+    printf("\"");
+    for ( ; *text; text++) {
+        if ((*text == '"') || (*text == '\\')) printf("\\%c", *text);
+        else if ((unsigned char)*text < 0x20) printf("\\u%04x", *text);
+        else printf("%c", *text);
+    }
+    printf("\"");
+}
 
-    if ((fp = fopen(filename, "r+b")) == NULL) EXIT("File open error\n");
-    if (_fseeki64(fp, position, SEEK_SET)) EXIT("File seek error\n");
-    if (fwrite(buffer, 1, length, fp) != length) EXIT("File write error\n");
-    if (fclose(fp) == EOF) EXIT("File close error\n");
+/*----------------------------------------------------------------------------*/
+double Clock(void) {
+    return(std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count());
 }
 
 /*----------------------------------------------------------------------------*/
-void Create(char* filename) {
-    FILE* fp;
+U64 PeakMemory(void) {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) return(0);
 
-    if ((fp = fopen(filename, "w+b")) == NULL) EXIT("File create error\n");
-    if (fclose(fp) == EOF) EXIT("File close error\n");
+    return(pmc.PeakWorkingSetSize);
+#else
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage)) return(0);
+
+#ifdef __APPLE__
+    return(usage.ru_maxrss);
+#else
+    return((U64)usage.ru_maxrss * 1024);
+#endif
+#endif
 }
 
 /*----------------------------------------------------------------------------*/
-char* Memory(int length, int size) {
-    char* fb;
+void Open(IMAGE* image, char* filename, int access) {
+#ifdef _WIN32
+    LARGE_INTEGER fs;
+    FILETIME      ft;
 
-    fb = (char*)calloc(length * size, size);
-    if (fb == NULL) EXIT("Memory error\n");
+    Unopened(image);
+    image->fd = CreateFileA(
+        filename,
+        access == IMAGE_READ ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ, NULL,
+        access == IMAGE_CREATE ? CREATE_ALWAYS : OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, NULL
+    );
+    if (image->fd == INVALID_HANDLE_VALUE) OpenError(filename);
+    if (!GetFileSizeEx(image->fd, &fs)) EXIT("File size error\n");
+    image->size = fs.QuadPart;
+    if (!GetFileTime(image->fd, NULL, NULL, &ft)) EXIT("File time error\n");
+    image->time = ((U64)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    image->block = 4096;
+    image->copy = COPY_PLAIN;
+    image->direct = -1;
+#else
+    struct stat st;
+    int         flags;
 
-    return(fb);
+    Unopened(image);
+    flags = access == IMAGE_READ ? O_RDONLY : O_RDWR;
+    if (access == IMAGE_CREATE) flags |= O_CREAT | O_TRUNC;
+
+    if ((image->fd = open(filename, flags, 0644)) < 0) OpenError(filename);
+    if (fstat(image->fd, &st)) EXIT("File size error\n");
+    // a folder is open for reading, but not as a file
+    if (S_ISDIR(st.st_mode)) {
+        close(image->fd);
+        image->fd = -1;
+        OpenError(filename);
+    }
+    image->size = st.st_size;
+#ifdef __APPLE__
+    image->time = (U64)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    image->time = (U64)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    image->block = st.st_blksize;
+#ifdef __linux__
+    image->copy = COPY_CLONE;
+#else
+    image->copy = COPY_PLAIN;
+#endif
+
+    // a second descriptor for the bulk copies, -1 if the filesystem
+    // doesn't support it
+    image->direct = -1;
+#ifdef O_DIRECT
+    if (direct) image->direct = open(filename, (flags & O_ACCMODE) | O_DIRECT);
+#endif
+#endif
+
+    image->name = filename;
+    image->map = NULL;
+    image->map_size = 0;
+    image->patch = NULL;
+    image->zip = NULL;
+    image->sectors = NULL;
+    image->writes = NULL;
+
+    // user data only, until the format is found
+    image->mode = MODE_M0;
+    image->sector_size = LEN_SECTOR_M0;
+    image->data_offset = POS_DATA_M0;
+    image->sector_data = LEN_DATA_M0;
+    image->sector_address = SECTOR_ADDRESS;
 }
 
 /*----------------------------------------------------------------------------*/
-int StrLen(char* data) {
-    unsigned int i;
-
-    for (i = 0; data[i]; i++);
+void OpenError(char* filename) {
+    char text[MAX_PATH + 32];
 
-    return(i);
+    // with the name, as an update opens many files
+    snprintf(text, sizeof(text), "%s: File open error\n", filename);
+    EXIT(text);
 }
 
 /*----------------------------------------------------------------------------*/
-int ChangeEndian(char* value) {
-    char newChar[4];
+void Close(IMAGE* image) {
+#ifdef _WIN32
+    HANDLE fd;
 
-    newChar[0] = value[3];
-    newChar[1] = value[2];
-    newChar[2] = value[1];
-    newChar[3] = value[0];
+    // an image not open, or closed, is not closed again, also after an error
+    fd = image->fd;
+    if (fd == INVALID_HANDLE_VALUE) return;
+    image->fd = INVALID_HANDLE_VALUE;
+    if (!CloseHandle(fd)) EXIT("File close error\n");
+#else
+    int fd, fd_direct;
 
-    return(*(int*)newChar);
+    // an image not open, or closed, is not closed again, also after an error
+    fd = image->fd;
+    fd_direct = image->direct;
+    if (fd < 0) return;
+    image->fd = image->direct = -1;
+    if (close(fd)) EXIT("File close error\n");
+    if ((fd_direct >= 0) && close(fd_direct)) EXIT("File close error\n");
+#endif
 }
 
 /*----------------------------------------------------------------------------*/
-void Replace(char* isoname, char* oldname, char* newname) {
-    FILE* fp_iso;
-    unsigned char* buffer, * tmp, name[256];
-    unsigned int   image_sectors, total_sectors, root_lba, root_length;
-    U64            found_position;
-    unsigned int   found_lba, found_offset;
-    unsigned int   old_filesize, old_sectors, file_lba;
-    unsigned int   new_filesize, new_sectors, new_length;
-    unsigned int   diff, l_endian, b_endian, lba;
-    unsigned int   tbl_lba, tbl_len;
-    unsigned int   count, maxim;
-    unsigned int   i, j, k;
+void Unopened(IMAGE* image) {
+    // nothing to close or free, until the image is open
+#ifdef _WIN32
+    image->fd = INVALID_HANDLE_VALUE;
+#else
+    image->fd = -1;
+#endif
+    image->direct = -1;
+    image->map = NULL;
+    image->map_size = 0;
+    image->patch = NULL;
+    image->zip = NULL;
+    image->sectors = NULL;
+    image->writes = NULL;
+}
 
-    sector_size = LEN_SECTOR_M0;
-    data_offset = POS_DATA_M0;
-    sector_data = LEN_DATA_M0;
+/*----------------------------------------------------------------------------*/
+void Map(IMAGE* image) {
+    // an empty file can not be mapped, the sectors are read/written
+    if (!image->size) return;
 
-    // get data from the primary volume descriptor
-    buffer = (unsigned char*)ReadSectors(isoname, DESCRIPTOR_LBA, 1);
+#ifdef _WIN32
+    image->mapping = CreateFileMappingA(image->fd, NULL, PAGE_READWRITE, 0, 0, NULL);
+    if (image->mapping == NULL) EXIT("File map error\n");
+    image->map = (char*)MapViewOfFile(image->mapping, FILE_MAP_WRITE, 0, 0, 0);
+    if (image->map == NULL) EXIT("File map error\n");
+#else
+    image->map = (char*)mmap(NULL, image->size, PROT_READ | PROT_WRITE, MAP_SHARED, image->fd, 0);
+    if (image->map == MAP_FAILED) EXIT("File map error\n");
+#endif
+    image->map_size = image->size;
+}
 
-    image_sectors = *(unsigned int*)(buffer + data_offset + TOTAL_SECTORS);
-    total_sectors = FileSize(isoname) / sector_size;
-    root_lba = *(unsigned int*)(buffer + data_offset + ROOT_FOLDER_LBA);
-    root_length = *(unsigned int*)(buffer + data_offset + ROOT_SIZE);
-    free(buffer);
+/*----------------------------------------------------------------------------*/
+void Unmap(IMAGE* image) {
+    if (image->map == NULL) return;
 
-    // get new data from the new file
-    new_filesize = FileSize(newname);
-    new_sectors = (new_filesize + sector_data - 1) / sector_data;
+    // only the dirty pages are written back
+#ifdef _WIN32
+    if (!FlushViewOfFile(image->map, 0)) EXIT("File unmap error\n");
+    if (!UnmapViewOfFile(image->map)) EXIT("File unmap error\n");
+    if (!CloseHandle(image->mapping)) EXIT("File unmap error\n");
+#else
+    if (msync(image->map, image->map_size, MS_ASYNC)) EXIT("File unmap error\n");
+    if (munmap(image->map, image->map_size)) EXIT("File unmap error\n");
+#endif
+    image->map = NULL;
+    image->map_size = 0;
+}
 
-    // 'oldname' must start with a path separator
-    if ((oldname[0] != '/') && (oldname[0] != '\\')) {
-        i = StrLen(oldname) + 1;
-        while (i--) oldname[i + 1] = oldname[i];
-        oldname[0] = '/';
-    }
-    // change all backslashes by slashes in 'oldname'
-    i = StrLen(oldname);
-    while (i--) if (oldname[i] == '\\') oldname[i] = '/';
+/*----------------------------------------------------------------------------*/
+void PRead(IMAGE* image, U64 position, char* buffer, U64 length) {
+    U64 count;
 
-    // search 'oldname' in the image
-    found_position = Search(isoname, oldname, (char*)"", root_lba, root_length);
-    if (!found_position) EXIT("File not found in the UMD image\n");
+    while (length) {
+        count = length > IO_CHUNK ? IO_CHUNK : length;
+#ifdef _WIN32
+        OVERLAPPED ov;
+        DWORD      done;
 
-    found_lba = found_position / sector_size;
-    found_offset = found_position % sector_size;
+        memset(&ov, 0, sizeof(ov));
+        ov.Offset = (DWORD)position;
+        ov.OffsetHigh = (DWORD)(position >> 32);
+        if (!ReadFile(image->fd, buffer, (DWORD)count, &done, &ov)) EXIT("File read error\n");
+        count = done;
+#else
+        ssize_t done;
 
-    // get data from the old file
-    buffer = (unsigned char*)ReadSectors(isoname, found_lba, 1);
+        done = pread(image->fd, buffer, count, position);
+        if (done < 0) EXIT("File read error\n");
+        count = done;
+#endif
+        if (!count) EXIT("File read error\n");
 
-    old_filesize = *(unsigned int*)(buffer + found_offset + 0x0A);
-    old_sectors = (old_filesize + sector_data - 1) / sector_data;
-    file_lba = *(unsigned int*)(buffer + found_offset + 0x02);
+        reads++;
+        read_bytes += count;
 
-    free(buffer);
+        position += count;
+        buffer += count;
+        length -= count;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+void PWrite(IMAGE* image, U64 position, char* buffer, U64 length) {
+    // the zero blocks are not written
+    if (sparse && (length >= image->block)) Sparse(image, position, buffer, length);
+    else PWriteData(image, position, buffer, length);
+}
 
-    // size difference in sectors
-    diff = new_sectors - old_sectors;
+/*----------------------------------------------------------------------------*/
+void PWriteData(IMAGE* image, U64 position, char* buffer, U64 length) {
+    U64 count;
 
-    // image name
-    sprintf((char*)name, "%s", old_sectors == new_sectors ? isoname : TMPNAME);
-    
-    if (diff) {
-        // create the new image
-        printf("- creating temporal image\n");
+    // the copy engine and the extractor write an image from many threads,
+    // the size is only grown
+    {
+        std::lock_guard<std::mutex> lock(size_lock);
+        if (position + length > image->size) image->size = position + length;
+    }
 
-        Create((char*)name);
+    while (length) {
+        count = length > IO_CHUNK ? IO_CHUNK : length;
+#ifdef _WIN32
+        OVERLAPPED ov;
+        DWORD      done;
 
-        lba = 0;
+        memset(&ov, 0, sizeof(ov));
+        ov.Offset = (DWORD)position;
+        ov.OffsetHigh = (DWORD)(position >> 32);
+        if (!WriteFile(image->fd, buffer, (DWORD)count, &done, &ov)) EXIT("File write error\n");
+        count = done;
+#else
+        ssize_t done;
 
-        // update the previous sectors
-        printf("- updating previous data sectors\n");
+        done = pwrite(image->fd, buffer, count, position);
+        if (done < 0) EXIT("File write error\n");
+        count = done;
+#endif
+        if (!count) EXIT("File write error\n");
 
-        maxim = file_lba;
+        writes++;
+        write_bytes += count;
 
-        for (i = 0; i < file_lba; ) {
-            count = maxim >= BLOCKSIZE ? BLOCKSIZE : maxim; maxim -= count;
+        position += count;
+        buffer += count;
+        length -= count;
+    }
+}
 
-            buffer = (unsigned char*)ReadSectors(isoname, i, count);
-            WriteSectors((char*)name, lba, (char*)buffer, count); lba += count;
-            free(buffer);
+/*----------------------------------------------------------------------------*/
+void Sparse(IMAGE* image, U64 position, char* buffer, U64 length) {
+    U64 start, end, next, last;
+    int zero;
 
-            i += count;
+    // the runs of whole filesystem blocks of zeros are holes, the partial
+    // blocks at the ends are written
+    last = position + length;
+    for (start = position; start < last; start = end) {
+        zero = -1;
+        for (end = start; end < last; end = next) {
+            next = (end / image->block + 1) * image->block;
+            if (next > last) next = last;
+            if (zero < 0) zero = (next - end == image->block) && Zeros(buffer + (end - position), image->block);
+            else if (zero != ((next - end == image->block) && Zeros(buffer + (end - position), image->block))) break;
         }
+
+        if (zero) Hole(image, start, end - start);
+        else PWriteData(image, start, buffer + (start - position), end - start);
     }
-    else {
-        lba = file_lba;
-    }
+}
 
-    // update the new file
-    printf("- updating file data\n");
+/*----------------------------------------------------------------------------*/
+void Hole(IMAGE* image, U64 position, U64 length) {
+    char* buffer;
+    U64   count;
 
-    if (new_sectors) {
-        // read and update all data sectors except the latest one (maybe incomplete)
-        maxim = --new_sectors;
-        for (i = 0; i < new_sectors; ) {
-            count = maxim >= BLOCKSIZE ? BLOCKSIZE : maxim; maxim -= count;
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+    if (!fallocate(image->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, position, length)) {
+        // the file size is kept, so a hole at the end needs its last byte,
+        // and the file is never truncated under the other writers
+        if (position + length >= image->size) {
+            char zero = 0;
+            PWriteData(image, position + length - 1, &zero, 1);
+        }
+        return;
+    }
+    if ((errno != EOPNOTSUPP) && (errno != ENOSYS)) EXIT("File write error\n");
+#endif
 
-            buffer = (unsigned char*)Memory(count * sector_size, sizeof(char));
-            tmp = (unsigned char*)Read(newname, i * sector_data, count * sector_data);
-            for (j = 0; j < count; j++) {
-                for (k = 0; k < sector_data; k++) {
-                    buffer[j * sector_size + data_offset + k] = tmp[j * sector_data + k];
-                }
-            }
-            WriteSectors((char*)name, lba, (char*)buffer, count); lba += count;
-            free(tmp);
-            free(buffer);
+    // no holes in this filesystem, the zeros are written
+    buffer = Memory(length > HASH_BLOCK ? HASH_BLOCK : length, sizeof(char));
+    for (; length; position += count, length -= count) {
+        count = length > HASH_BLOCK ? HASH_BLOCK : length;
+        PWriteData(image, position, buffer, count);
+    }
+    free(buffer);
+}
 
-            i += count;
-        }
-        new_sectors++;
+/*----------------------------------------------------------------------------*/
+int Zeros(char* buffer, U64 length) {
+    U64 i;
 
-        // read and update the remaining data sector
-        new_length = new_filesize - i * sector_data;
+#ifdef HAVE_SSE2
+    __m128i zero = _mm_setzero_si128();
 
-        buffer = (unsigned char*)Memory(sector_size, sizeof(char));
-        tmp = (unsigned char*)Read(newname, i * sector_data, new_length);
-        for (j = 0; j < new_length; j++) buffer[data_offset + j] = tmp[j];
-        WriteSectors((char*)name, lba++, (char*)buffer, 1);
-        free(tmp);
-        free(buffer);
+    // 64 bytes at once, stop at the first one not zero
+    for (i = 0; i + 64 <= length; i += 64) {
+        __m128i v = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((__m128i*)(buffer + i)), _mm_loadu_si128((__m128i*)(buffer + i + 16))),
+            _mm_or_si128(_mm_loadu_si128((__m128i*)(buffer + i + 32)), _mm_loadu_si128((__m128i*)(buffer + i + 48)))
+        );
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xFFFF) return(0);
+    }
+#else
+    for (i = 0; i + 8 <= length; i += 8) {
+        if (*(U64*)(buffer + i)) return(0);
+    }
+#endif
+    for (; i < length; i++) {
+        if (buffer[i]) return(0);
     }
 
-    if (diff) {
-        // update the next sectors
-        printf("- updating next data sectors\n");
-
-        maxim = total_sectors - (file_lba + old_sectors);
-        for (i = file_lba + old_sectors; i < total_sectors; ) {
-            count = maxim >= BLOCKSIZE ? BLOCKSIZE : maxim; maxim -= count;
+    return(1);
+}
 
-            buffer = (unsigned char*)ReadSectors(isoname, i, count);
-            WriteSectors((char*)name, lba, (char*)buffer, count); lba += count;
-            free(buffer);
+/*----------------------------------------------------------------------------*/
+U64 SeekData(IMAGE* image, U64 position, U64 end) {
+#if !defined(_WIN32) && defined(SEEK_DATA)
+    off_t found;
 
-            i += count;
-        }
-    }
+    // the start of the next data, or the end if only a hole is left
+    found = lseek(image->fd, position, SEEK_DATA);
+    if (found < 0) return(errno == ENXIO ? end : position);
 
-    if (new_filesize != old_filesize) {
-        // update the file size
-        printf("- updating file size\n");
+    return((U64)found < end ? found : end);
+#else
+    return(position);
+#endif
+}
 
-        l_endian = new_filesize;
-        b_endian = ChangeEndian((char*)&l_endian);
+/*----------------------------------------------------------------------------*/
+U64 SeekHole(IMAGE* image, U64 position, U64 end) {
+#if !defined(_WIN32) && defined(SEEK_HOLE)
+    off_t found;
 
-        buffer = (unsigned char*)ReadSectors((char*)name, found_lba, 1);
-        *(unsigned int*)(buffer + found_offset + 0x0A) = l_endian;
-        *(unsigned int*)(buffer + found_offset + 0x0E) = b_endian;
-        WriteSectors((char*)name, found_lba, (char*)buffer, 1);
-        free(buffer);
-    }
+    // the start of the next hole, the end of the file is one too
+    found = lseek(image->fd, position, SEEK_HOLE);
+    if (found < 0) return(end);
 
-    if (diff) {
-        // update the primary volume descriptor
-        printf("- updating primary volume descriptor\n");
+    return((U64)found < end ? found : end);
+#else
+    return(end);
+#endif
+}
 
-        l_endian = image_sectors + diff;
-        b_endian = ChangeEndian((char*)&l_endian);
+/*----------------------------------------------------------------------------*/
+U64 FileSize(char* filename) {
+    IMAGE file;
 
-        buffer = (unsigned char*)ReadSectors((char*)name, DESCRIPTOR_LBA, 1);
-        *(unsigned int*)(buffer + data_offset + TOTAL_SECTORS) = l_endian;
-        *(unsigned int*)(buffer + data_offset + TOTAL_SECTORS + 4) = b_endian;
-        WriteSectors((char*)name, DESCRIPTOR_LBA, (char*)buffer, 1);
-        free(buffer);
+    Open(&file, filename, IMAGE_READ);
+    Close(&file);
 
-        // update the path tables
-        printf("- updating path tables\n");
+    return(file.size);
+}
 
-        buffer = (unsigned char*)ReadSectors((char*)name, DESCRIPTOR_LBA, 1);
-        for (i = 0; i < 4; i++) {
-            tbl_len = *(unsigned int*)(buffer + data_offset + TABLE_PATH_LEN);
-            tbl_lba = *(unsigned int*)(buffer + data_offset + TABLE_PATH_LBA + 4 * i);
-            if (tbl_lba) {
-                if (i & 0x2) tbl_lba = ChangeEndian((char*)&tbl_lba);
-                PathTable((char*)name, tbl_lba, tbl_len, file_lba, diff, i & 0x2);
-            }
-        }
-        free(buffer);
+/*----------------------------------------------------------------------------*/
+int Exists(char* filename) {
+#ifdef _WIN32
+    return(GetFileAttributesA(filename) != INVALID_FILE_ATTRIBUTES);
+#else
+    return(!access(filename, F_OK));
+#endif
+}
 
-        // update the file/folder LBAs
-        printf("- updating entire TOCs\n");
+/*----------------------------------------------------------------------------*/
+void Save(char* filename, char* buffer, int length) {
+    IMAGE file;
 
-        TOC((char*)name, root_lba, root_length, found_position, file_lba, diff);
+    Open(&file, filename, IMAGE_CREATE);
+    Write(&file, 0, length, buffer);
+    Close(&file);
+}
 
-        // remove the old image
-        printf("- removing old image\n");
+/*----------------------------------------------------------------------------*/
+char* Read(IMAGE* image, U64 position, int length) {
+    char* fb;
 
-        if (remove(isoname)) EXIT("Remove file error\n");
+    if (position + length > image->size) EXIT("Read past the end\n");
 
-        // rename the new image
-        printf("- renaming temporal image\n");
+    // overwritten by the data, not zero-filled
+    fb = Aligned(length);
+    ReadData(image, position, fb, length);
 
-        if (rename((char*)name, isoname)) EXIT("Rename file error\n");
-    }
+    return(fb);
+}
 
-    printf("- the new image has ");
-    if ((int)diff > 0) printf("%d more", diff);
-    else if ((int)diff < 0) printf("%d fewer", -(int)diff);
-    else                    printf("the same", diff);
-    printf(" sector"); if (((int)diff != 1) && ((int)diff != -1)) printf("s");
-    if (!diff) printf(" as"); else printf(" than");
-    printf(" the original image\n");
-    if (diff) {
-        printf("- maybe you need to hand update the cuesheet file");
-        printf(" (if exist and needed)\n");
-    }
+/*----------------------------------------------------------------------------*/
+void ReadData(IMAGE* image, U64 position, char* buffer, U64 length) {
+    // the recorded changes and the compressed images are read as images
+    if (image->patch != NULL)    PatchRead(image, position, buffer, length);
+    else if (image->zip != NULL) ZipRead(image, position, buffer, length);
+    else                         PRead(image, position, buffer, length);
 }
 
 /*----------------------------------------------------------------------------*/
-U64 Search(char* isoname, char* filename, char* path, int lba, int len) {
-    unsigned char* buffer;
-    unsigned char  name[256], newpath[256];
-    U64            found;
-    unsigned int   total, pos, nbytes, nchars, newlba, newlen;
-    unsigned int   i, j;
+void Write(IMAGE* image, U64 position, int length, char* buffer) {
+    if (image->patch != NULL) PatchAdd(image, position, PATCH_NEW, length);
+    if (image->sectors != NULL) SectorDrop(image, position, length);
 
-    // total sectors
-    total = (len + LEN_SECTOR_M0 - 1) / LEN_SECTOR_M0;
+    PWrite(image, position, buffer, length);
+}
 
-    for (i = 0; i < total; i++) {
-        // read 1 sector
-        buffer = (unsigned char*)ReadSectors(isoname, lba + i, 1);
+/*----------------------------------------------------------------------------*/
+void Create(char* filename) {
+    IMAGE file;
 
-        // check the entries in each sector
-        pos = 0;
-        while (pos < sector_data) {
-            // field size
-            nbytes = *(unsigned char*)(buffer + data_offset + pos);
-            if (!nbytes) break; // no more entries in this sector
+    Open(&file, filename, IMAGE_CREATE);
+    Close(&file);
+}
 
-            // name size
-            nchars = *(unsigned char*)(buffer + data_offset + pos + 0x020);
-            for (j = 0; j < nchars; j++) {
-                name[j] = *(unsigned char*)(buffer + data_offset + pos + 0x021 + j);
-            }
-            name[j] = '\0';
+/*----------------------------------------------------------------------------*/
+char* Memory(int length, int size) {
+    char* fb;
 
-            // discard the ";1" final
+    fb = (char*)calloc(length, size);
+    if (fb == NULL) EXIT("Memory error\n");
+
+    return(fb);
+}
+
+/*----------------------------------------------------------------------------*/
+int StrLen(char* data) {
+    unsigned int i;
+
+    for (i = 0; data[i]; i++);
+
+    return(i);
+}
+
+/*----------------------------------------------------------------------------*/
+int ChangeEndian(char* value) {
+    char newChar[4];
+
+    newChar[0] = value[3];
+    newChar[1] = value[2];
+    newChar[2] = value[1];
+    newChar[3] = value[0];
+
+    return(*(int*)newChar);
+}
+
+/*----------------------------------------------------------------------------*/
+void Replace(char* isoname, CHANGE* changes, int count) {
+    VOLUME volume;
+
+    VolumeOpen(&volume, isoname, IMAGE_WRITE);
+    if (Apply(&volume, changes, count)) VolumeClose(&volume);
+
+    if (stats) Stats(&volume.iso);
+}
+
+/*----------------------------------------------------------------------------*/
+void Images(char** isonames, int images, CHANGE* changes, int count, int jobs, int io) {
+    CHANGE* work;
+    int     failed;
+    int     i;
+
+    // the new files are read once for all the images
+    Prepare(changes, count);
+
+    if (!jobs) jobs = std::thread::hardware_concurrency();
+    if (jobs > images) jobs = images;
+    if (jobs < 1) jobs = 1;
+
+    work = (CHANGE*)Memory(count, sizeof(CHANGE));
+    failed = 0;
+
+#ifdef _WIN32
+    // one image after another
+    for (i = 0; i < images; i++) {
+        label = Memory(StrLen(isonames[i]) + 3, sizeof(char));
+        sprintf(label, "%s: ", isonames[i]);
+        memcpy(work, changes, count * sizeof(CHANGE));
+        try {
+            Replace(isonames[i], work, count);
+        }
+        catch (IsoError& e) {
+            printf("%s%s", label, e.what());
+            failed++;
+        }
+        free(label);
+    }
+    label = (char*)"";
+#else
+    FILE*  slots;
+    pid_t* pids;
+    pid_t  pid;
+    int    running, status, j;
+
+    // a process per image, with its own temporal image, statistics and
+    // errors, and a lock slot of a temporal file to copy data, dropped by
+    // the kernel also when the process is killed
+    slots = tmpfile();
+    if (slots == NULL) EXIT("Lock error\n");
+    io_lock = fileno(slots);
+    io_slots = io;
+
+    pids = (pid_t*)Memory(images, sizeof(pid_t));
+    for (i = running = 0; (i < images) || running; ) {
+        if ((i < images) && (running < jobs)) {
+            fflush(stdout);
+            pid = fork();
+            if (pid < 0) EXIT("Process error\n");
+            if (!pid) {
+                label = Memory(StrLen(isonames[i]) + 3, sizeof(char));
+                sprintf(label, "%s: ", isonames[i]);
+                memcpy(work, changes, count * sizeof(CHANGE));
+                try {
+                    Replace(isonames[i], work, count);
+                }
+                catch (IsoError& e) {
+                    printf("%s%s", label, e.what());
+                    exit(EXIT_FAILURE);
+                }
+                exit(EXIT_SUCCESS);
+            }
+            pids[i++] = pid;
+            running++;
+            continue;
+        }
+
+        pid = wait(&status);
+        if (pid < 0) EXIT("Process error\n");
+        for (j = 0; (j < i) && (pids[j] != pid); j++);
+        if (j == i) continue;
+        running--;
+
+        if (WIFEXITED(status) && (WEXITSTATUS(status) == EXIT_SUCCESS)) {
+            printf("- %s: done\n", isonames[j]);
+        }
+        else {
+            printf("- %s: failed\n", isonames[j]);
+            failed++;
+        }
+    }
+    free(pids);
+
+    fclose(slots);
+    io_lock = -1;
+#endif
+
+    free(work);
+
+    if (failed) {
+        printf("- %d of %d image%s failed\n", failed, images, images == 1 ? "" : "s");
+        EXIT("Image update error\n");
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+void Prepare(CHANGE* changes, int count) {
+    IMAGE file;
+    int   i;
+
+    Phase("reading new files");
+
+    for (i = 0; i < count; i++) {
+        Open(&file, changes[i].newname, IMAGE_READ);
+
+        // the hash for the caches of all the images, else the data is read
+        // ahead, and every image reads it from the page cache
+        if (cache) {
+            changes[i].hash = Digest(&file);
+            changes[i].hashed = 1;
+        }
+#if defined(__linux__)
+        else {
+            posix_fadvise(file.fd, 0, 0, POSIX_FADV_WILLNEED);
+        }
+#endif
+
+        Close(&file);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+void IoBegin(void) {
+#ifndef _WIN32
+    struct flock lock;
+    int          slot;
+
+    if ((io_lock < 0) || (io_held >= 0)) return;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_len = 1;
+
+    // a free slot, else wait for an image to end its copies
+    for (slot = 0; slot < io_slots; slot++) {
+        lock.l_start = slot;
+        if (!fcntl(io_lock, F_SETLK, &lock)) break;
+        if ((errno != EACCES) && (errno != EAGAIN)) EXIT("Lock error\n");
+    }
+    if (slot == io_slots) {
+        slot = getpid() % io_slots;
+        lock.l_start = slot;
+        while (fcntl(io_lock, F_SETLKW, &lock)) {
+            if (errno != EINTR) EXIT("Lock error\n");
+        }
+    }
+    io_held = slot;
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+void IoEnd(void) {
+#ifndef _WIN32
+    struct flock lock;
+
+    if (io_held < 0) return;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_UNLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = io_held;
+    lock.l_len = 1;
+    if (fcntl(io_lock, F_SETLK, &lock)) EXIT("Lock error\n");
+    io_held = -1;
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+char* Temporal(char* isoname, const char* suffix) {
+    char* name;
+
+    // next to the image, on the same filesystem, and one for every image
+    name = Memory(StrLen(isoname) + StrLen((char*)suffix) + 1, sizeof(char));
+    sprintf(name, "%s%s", isoname, suffix);
+
+    return(name);
+}
+
+/*----------------------------------------------------------------------------*/
+void Server(char* isoname, char* socketname) {
+    IsoImage image;
+    char     text[300];
+#ifndef _WIN32
+    struct sockaddr_un address;
+    struct stat        st;
+    FILE*    in, * out;
+    int      fd, client, done;
+#endif
+
+    // parsed once, and kept open and indexed between the commits
+    if (image.open(isoname)) {
+        snprintf(text, sizeof(text), "%s\n", image.error());
+        EXIT(text);
+    }
+
+    if (socketname == NULL) {
+        Session(&image, isoname, stdin, replies != NULL ? replies : stdout);
+        return;
+    }
+
+#ifdef _WIN32
+    EXIT("Server socket not supported\n");
+#else
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (StrLen(socketname) >= (int)sizeof(address.sun_path)) EXIT("Socket name too long\n");
+    strcpy(address.sun_path, socketname);
+
+    // the socket of a previous server is replaced, but not any other file
+    if (!lstat(socketname, &st)) {
+        if (!S_ISSOCK(st.st_mode)) EXIT("Socket name of another file\n");
+        unlink(socketname);
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) EXIT("Socket error\n");
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) || listen(fd, 8)) EXIT("Socket error\n");
+
+    // a client stopped before the answer doesn't stop the server
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("- %sserving on %s\n", label, socketname);
+
+    // a client at once, the changes not committed are kept for the next one
+    for (done = 0; !done; ) {
+        client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR) continue;
+            EXIT("Socket error\n");
+        }
+
+        in = fdopen(client, "r");
+        out = fdopen(dup(client), "w");
+        if ((in == NULL) || (out == NULL)) EXIT("Socket error\n");
+
+        done = Session(&image, isoname, in, out);
+
+        fclose(in);
+        fclose(out);
+    }
+
+    close(fd);
+    unlink(socketname);
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+FILE* Replies(void) {
+    FILE* out;
+    int   fd;
+
+    // a copy of stdout for the answers, then stdout writes to stderr, the
+    // answers stay on stdout if it can't be done
+    if (replies != NULL) return(replies);
+    fflush(stdout);
+    fd = dup(fileno(stdout));
+    if (fd < 0) return(NULL);
+    out = fdopen(fd, "w");
+    if (out == NULL) {
+        close(fd);
+        return(NULL);
+    }
+    if (dup2(fileno(stderr), fileno(stdout)) < 0) {
+        fclose(out);
+        return(NULL);
+    }
+
+    return(out);
+}
+
+/*----------------------------------------------------------------------------*/
+int Session(IsoImage* image, char* isoname, FILE* in, FILE* out) {
+    char         line[4096], * command, * name, * newfile;
+    unsigned int lba;
+    U64          size;
+    int          i;
+
+    // a command per line, answered with 'ok' or with 'error' and the message
+    while (fgets(line, sizeof(line), in) != NULL) {
+        for (i = StrLen(line); i && ((line[i - 1] == '\n') || (line[i - 1] == '\r') || (line[i - 1] == ' ') || (line[i - 1] == '\t')); i--) line[i - 1] = '\0';
+        for (command = line; (*command == ' ') || (*command == '\t'); command++);
+        if (!*command || (*command == '#')) continue;
+
+        // 'filename' has no spaces, 'newfile' is the rest of the line
+        name = Word(command);
+        newfile = Word(name);
+
+        if (!strcmp(command, "replace") && *newfile) {
+            if (image->replace(name, newfile)) fprintf(out, "error %s\n", image->error());
+            else                               fprintf(out, "ok\n");
+        }
+        else if (!strcmp(command, "lookup") && *name && !*newfile) {
+            if (image->lookup64(name, &lba, &size)) fprintf(out, "error %s\n", image->error());
+            else                                    fprintf(out, "ok %u %llu\n", lba, size);
+        }
+        else if (!strcmp(command, "commit") && !*name) {
+            // all the queued files in a single update
+            if (image->commit()) {
+                fprintf(out, "error %s\n", image->error());
+
+                // the image is parsed again after a failed update
+                if (image->open(isoname)) printf("- %s%s\n", label, image->error());
+            }
+            else {
+                fprintf(out, "ok\n");
+            }
+        }
+        else if (!strcmp(command, "discard") && !*name) {
+            image->discard();
+            fprintf(out, "ok\n");
+        }
+        else if (!strcmp(command, "quit") && !*name) {
+            fprintf(out, "ok\n");
+            fflush(out);
+            return(1);
+        }
+        else {
+            fprintf(out, "error Unknown command\n");
+        }
+        fflush(out);
+    }
+
+    return(0);
+}
+
+/*----------------------------------------------------------------------------*/
+char* Word(char* text) {
+    // ends the first word of 'text', and returns the next one
+    while (*text && (*text != ' ') && (*text != '\t')) text++;
+    while ((*text == ' ') || (*text == '\t')) *text++ = '\0';
+
+    return(text);
+}
+
+/*----------------------------------------------------------------------------*/
+void VolumeOpen(VOLUME* volume, char* isoname, int access) {
+    IMAGE*         iso;
+    unsigned char* buffer;
+    int            i;
+
+    // open the image, kept open until the changes are applied
+    iso = &volume->iso;
+    Open(iso, isoname, access);
+    ZipOpen(iso);
+    Format(iso);
+    if (mapped && (access != IMAGE_READ) && (iso->zip == NULL)) Map(iso);
+    if (iso->map == NULL) SectorCache(iso);
+
+    // get data from the primary volume descriptor
+    buffer = (unsigned char*)GetSectors(iso, DESCRIPTOR_LBA, 1);
+
+    volume->image_sectors = *(unsigned int*)(buffer + iso->data_offset + TOTAL_SECTORS);
+    volume->total_sectors = iso->size / iso->sector_size;
+    volume->root_lba = *(unsigned int*)(buffer + iso->data_offset + ROOT_FOLDER_LBA);
+    volume->root_length = *(unsigned int*)(buffer + iso->data_offset + ROOT_SIZE);
+    volume->tbl_len = *(unsigned int*)(buffer + iso->data_offset + TABLE_PATH_LEN);
+    for (i = 0; i < 4; i++) {
+        volume->tbl_lba[i] = *(unsigned int*)(buffer + iso->data_offset + TABLE_PATH_LBA + 4 * i);
+        if (i & 0x2) volume->tbl_lba[i] = ChangeEndian((char*)&volume->tbl_lba[i]);
+    }
+    DropSectors(iso, (char*)buffer);
+
+    // a dual-layer DVD has the volume of the layer 1 after the sectors of
+    // the layer 0, with its own folder tree and LBAs from its first sector
+    volume->layer_lba = volume->layer_sectors = 0;
+    if ((U64)volume->image_sectors + DESCRIPTOR_LBA < volume->total_sectors) {
+        buffer = (unsigned char*)GetSectors(iso, volume->image_sectors + DESCRIPTOR_LBA, 1);
+        if (!memcmp(buffer + iso->data_offset, "\1CD001", 6)) {
+            volume->layer_lba = volume->image_sectors;
+            volume->layer_sectors = *(unsigned int*)(buffer + iso->data_offset + TOTAL_SECTORS);
+            volume->layer_root_lba = *(unsigned int*)(buffer + iso->data_offset + ROOT_FOLDER_LBA);
+            volume->layer_root_length = *(unsigned int*)(buffer + iso->data_offset + ROOT_SIZE);
+            volume->layer_tbl_len = *(unsigned int*)(buffer + iso->data_offset + TABLE_PATH_LEN);
+            for (i = 0; i < 4; i++) {
+                volume->layer_tbl_lba[i] = *(unsigned int*)(buffer + iso->data_offset + TABLE_PATH_LBA + 4 * i);
+                if (i & 0x2) volume->layer_tbl_lba[i] = ChangeEndian((char*)&volume->layer_tbl_lba[i]);
+            }
+        }
+        DropSectors(iso, (char*)buffer);
+    }
+
+    // index all the folders
+    Phase("indexing folder tree");
+
+    IndexTree(volume);
+}
+
+/*----------------------------------------------------------------------------*/
+void VolumeClose(VOLUME* volume) {
+    SectorFree(&volume->iso);
+    Unmap(&volume->iso);
+    IndexFree(&volume->index);
+    ZipClose(&volume->iso);
+    Close(&volume->iso);
+}
+
+/*----------------------------------------------------------------------------*/
+int Apply(VOLUME* volume, CHANGE* changes, int count) {
+    UPDATE update;
+    int    keep;
+
+    // the files of the update are closed and the temporal files removed,
+    // also on an error, then the image must be opened again
+    memset(&update, 0, sizeof(update));
+    Unopened(&update.file);
+    Unopened(&update.temp);
+    try {
+        keep = Update(volume, changes, count, &update);
+    }
+    catch (...) {
+        volume->iso.writes = NULL;
+        try {
+            UpdateFree(&update);
+        }
+        catch (...) {
+        }
+        throw;
+    }
+    volume->iso.writes = NULL;
+    UpdateFree(&update);
+
+    return(keep);
+}
+
+/*----------------------------------------------------------------------------*/
+int Update(VOLUME* volume, CHANGE* changes, int count, UPDATE* update) {
+    IMAGE          *file, *temp, *iso, *out;
+    INDEX*         index;
+    ENTRY*         entry;
+    CHANGE*        change, swap;
+    CACHE*         known;
+    PATCH*         recorded;
+    unsigned char* buffer;
+    char*          tempname, * dataname;
+    unsigned int   image_sectors, total_sectors;
+    unsigned int   found_lba, found_offset;
+    unsigned int   l_endian, b_endian, lba, base;
+    unsigned int   volume_sectors;
+    int            diff, layer_diff, resize, total, move, record, renamed, keep;
+    int            i, j, k;
+    U64            done, size, offset, image_size;
+
+    iso = &volume->iso;
+    index = &volume->index;
+    file = &update->file;
+    temp = &update->temp;
+    known = &update->known;
+    recorded = &update->recorded;
+    image_sectors = volume->image_sectors;
+    total_sectors = volume->total_sectors;
+    image_size = iso->size;
+
+    // the hashes of the data written by the previous runs
+    if (cache) CacheLoad(known, iso);
+
+    // the files with the same data are not written again
+    Phase("comparing file data");
+
+    total = count;
+    for (i = 0; i < count; i++) {
+        change = &changes[i];
+
+        // get new data from the new file
+        Open(file, change->newname, IMAGE_READ);
+        change->new_filesize = file->size;
+        change->new_sectors = (change->new_filesize + iso->sector_data - 1) / iso->sector_data;
+        change->time = file->time;
+
+        // search 'oldname' in the image
+        update->path = Normalize(change->oldname);
+        entry = Search(index, update->path);
+        if (entry == NULL) {
+            FileError(change->oldname, "File not found in the UMD image\n");
+        }
+        free(update->path);
+        update->path = NULL;
+
+        // get data from the old file, all its extents
+        change->position = entry->position;
+        change->old_filesize = Length(entry);
+        change->old_sectors = (change->old_filesize + iso->sector_data - 1) / iso->sector_data;
+        change->file_lba = entry->lba;
+        change->path = entry->path;
+        change->extents = entry->extents;
+        change->base = entry->base;
+
+        // the new data in the same records, as many extents as the old file
+        if (!Contiguous(iso, entry)) {
+            FileError(change->oldname, "File extents not contiguous\n");
+        }
+        if (change->new_filesize > (U64)change->extents * EXTENT_SIZE) {
+            FileError(change->oldname, "New file larger than the extents of the old file\n");
+        }
+
+        // size difference in sectors
+        change->diff = change->new_sectors - change->old_sectors;
+
+        j = Unchanged(iso, change, file, cache ? known : NULL, index->paths + entry->path);
+        Close(file);
+
+        // moved to the end of the list, only for the cache
+        if (j) {
+            swap = *change; *change = changes[count - 1]; changes[count - 1] = swap;
+            count--; i--;
+        }
+    }
+
+    if (count < total) printf("- %s%d file%s with the same data\n", label, total - count, total - count == 1 ? "" : "s");
+
+    // sort the files by LBA, the data sectors can't be shared
+    qsort(changes, count, sizeof(CHANGE), Compare);
+
+    diff = 0;
+    resize = 0;
+    for (i = 0; i < count; i++) {
+        change = &changes[i];
+        if (i && (change->file_lba < changes[i - 1].file_lba + changes[i - 1].old_sectors)) {
+            FileError(change->oldname, "File data shared with another replaced file\n");
+        }
+        if (i && (change->position == changes[i - 1].position)) {
+            FileError(change->oldname, "File replaced twice\n");
+        }
+
+        change->shift = diff;
+        diff += change->diff;
+        if (change->diff) resize = 1;
+
+        change->new_lba = change->file_lba + change->shift;
+    }
+
+    // a dual-layer image moves the layer 1 by the changes in the layer 0,
+    // each volume gets its own changes
+    layer_diff = 0;
+    for (i = 0; i < count; i++) {
+        if (volume->layer_lba && (changes[i].file_lba >= volume->layer_lba)) layer_diff += changes[i].diff;
+    }
+    if (volume->layer_lba && resize && (place != PLACE_SHIFT)) EXIT("Placement in free sectors of a dual-layer image not supported\n");
+
+    volume_sectors = image_sectors + diff - layer_diff;
+
+    // output image
+    out = iso;
+    tempname = update->tempname = Temporal(iso->name, TMPNAME);
+    dataname = update->dataname = Temporal(iso->name, TMPDATA);
+
+    // the data is copied by a few images at once
+    IoBegin();
+
+    // the metadata sectors and the blocks of the copy engine, for the
+    // verification of the new image
+    if (verify) iso->writes = &update->writes;
+
+    // a patch or a compressed image is written from a sparse image with the
+    // new data, the rest is recorded as copies of the image, which is not
+    // changed
+    if ((patchname != NULL) && (iso->zip != NULL)) EXIT("Patch of a compressed image not supported\n");
+    record = (patchname != NULL) || ((iso->zip != NULL) && count);
+    move = inplace && !record;
+    renamed = 0;
+    if (record) {
+        Phase("recording changes");
+
+        Open(temp, dataname, IMAGE_CREATE);
+        update->data_made = 1;
+        FormatAs(temp, iso);
+        temp->writes = iso->writes;
+        PatchInit(recorded, iso);
+        recorded->relocate = patchname != NULL;
+        temp->patch = recorded;
+        out = temp;
+
+        // the whole image if no sector is moved, the free sectors are
+        // searched in the records
+        if ((place != PLACE_SHIFT) || !resize) CopyData(iso, 0, out, 0, iso->size);
+    }
+
+    // new data in free sectors, no sector is moved
+    if ((place != PLACE_SHIFT) && resize) {
+        Phase("placing file data");
+
+        volume_sectors = Place(iso, out, index, changes, count, volume->tbl_lba, volume->tbl_len, total_sectors);
+        if (volume_sectors < image_sectors) volume_sectors = image_sectors;
+
+        for (i = 0; i < count; i++) changes[i].diff = changes[i].shift = 0;
+        diff = resize = 0;
+    }
+
+    if (resize) {
+        // an empty file moves the non-empty data with the same LBA and
+        // a previous record, as it is not relocated
+        for (i = 0; i < count; i++) {
+            if (changes[i].old_sectors) continue;
+            for (j = 0; j < (int)index->count; j++) {
+                entry = &index->entries[j];
+                if ((entry->lba == changes[i].file_lba) && entry->size && !(entry->flags & 0x02) && (entry->position < changes[i].position)) {
+                    FileError(changes[i].oldname, "Empty file sharing LBA with a previous file\n");
+                }
+            }
+        }
+    }
+
+    // the image size can change, nothing is mapped while moving the data,
+    // and the kept folder sectors are only valid if they are not moved
+    Unmap(iso);
+    if ((out != iso) || resize) SectorFree(iso);
+
+    if (resize && move) {
+        // move the sectors after the files, the previous ones are not touched
+        Phase("moving next data sectors");
+
+        MoveImage(iso, changes, count, total_sectors);
+    }
+    else if (resize) {
+        // create the new image
+        if (out == iso) {
+            Phase("creating temporal image");
+
+            Open(temp, tempname, IMAGE_CREATE);
+            update->temp_made = 1;
+            FormatAs(temp, iso);
+            temp->writes = iso->writes;
+            out = temp;
+        }
+
+        // update the previous sectors
+        Phase("updating previous data sectors");
+
+        CopySectors(iso, 0, out, 0, changes[0].file_lba);
+    }
+
+    for (i = 0; i < count; i++) {
+        change = &changes[i];
+
+        // update the new file
+        if (count == 1) Phase("updating file data");
+        else            Phase("updating file data: %s", change->oldname);
+
+        Open(file, change->newname, IMAGE_READ);
+        WriteData(out, change->new_lba, file);
+        Close(file);
+
+        if (resize && !move) {
+            // update the next sectors
+            Phase("updating next data sectors");
+
+            lba = i + 1 < count ? changes[i + 1].file_lba : total_sectors;
+            CopySectors(
+                iso, change->file_lba + change->old_sectors,
+                out, change->file_lba + change->old_sectors + change->shift + change->diff,
+                lba - (change->file_lba + change->old_sectors)
+            );
+        }
+    }
+
+    // the metadata is patched in the mapping of the new image, a patch
+    // image is read through the records
+    if (mapped && (out->patch == NULL)) Map(out);
+    if (out->map == NULL) SectorCache(out);
+
+    if (volume_sectors != image_sectors) {
+        // update the primary volume descriptor
+        Phase("updating primary volume descriptor");
+
+        buffer = (unsigned char*)GetSectors(out, DESCRIPTOR_LBA, 1);
+
+        l_endian = volume_sectors;
+        b_endian = ChangeEndian((char*)&l_endian);
+
+        *(unsigned int*)(buffer + out->data_offset + TOTAL_SECTORS) = l_endian;
+        *(unsigned int*)(buffer + out->data_offset + TOTAL_SECTORS + 4) = b_endian;
+        PutSectors(out, DESCRIPTOR_LBA, (char*)buffer, 1);
+    }
+
+    // the layer 1 starts after the new sectors of the layer 0
+    base = volume->layer_lba + diff - layer_diff;
+    if (layer_diff) {
+        Phase("updating layer 1 volume descriptor");
+
+        buffer = (unsigned char*)GetSectors(out, base + DESCRIPTOR_LBA, 1);
+
+        l_endian = volume->layer_sectors + layer_diff;
+        b_endian = ChangeEndian((char*)&l_endian);
+
+        *(unsigned int*)(buffer + out->data_offset + TOTAL_SECTORS) = l_endian;
+        *(unsigned int*)(buffer + out->data_offset + TOTAL_SECTORS + 4) = b_endian;
+        PutSectors(out, base + DESCRIPTOR_LBA, (char*)buffer, 1);
+    }
+
+    if (resize) {
+        // update the path tables
+        Phase("updating path tables");
+
+        for (i = 0; i < 4; i++) {
+            if (volume->tbl_lba[i]) {
+                PathTable(out, index, changes, count, 0, volume->tbl_lba[i], volume->tbl_len, i & 0x2);
+            }
+            if (volume->layer_lba && volume->layer_tbl_lba[i]) {
+                PathTable(out, index, changes, count, volume->layer_lba, volume->layer_lba + volume->layer_tbl_lba[i], volume->layer_tbl_len, i & 0x2);
+            }
+        }
+
+        // update the file/folder LBAs
+        Phase("updating entire TOCs");
+
+        TOC(out, index, changes, count);
+    }
+
+    for (i = 0; i < count; i++) {
+        change = &changes[i];
+        lba = change->new_lba != change->file_lba + change->shift;
+        if ((change->new_filesize == change->old_filesize) && !lba) continue;
+
+        // update the file size
+        if (count == 1) Phase("updating file %s", lba ? "position" : "size");
+        else            Phase("updating file %s: %s", lba ? "position" : "size", change->oldname);
+
+        // the LBAs of the records are from the first sector of their volume,
+        // moved by the changes before it
+        base = change->base + ShiftSector(changes, count, change->base);
+
+        // the extents are full but the last one, the next ones are empty
+        entry = Search(index, index->paths + change->path);
+        done = 0;
+        for (k = 0; k < (int)change->extents; k++) {
+            size = change->new_filesize - done;
+            if ((k + 1 < (int)change->extents) && (size > EXTENT_SIZE)) size = EXTENT_SIZE;
+
+            // the folder sector is moved if it is after a resized file, the
+            // records of a file are in the same folder
+            offset = change->position + (entry[k].position - entry->position);
+            found_lba = offset / out->sector_size;
+            found_offset = offset % out->sector_size;
+            found_lba += ShiftSector(changes, count, found_lba);
+
+            buffer = (unsigned char*)GetSectors(out, found_lba, 1);
+            folder_sectors++;
+
+            if (lba || (change->extents > 1)) {
+                l_endian = change->new_lba + done / out->sector_data - base;
+                b_endian = ChangeEndian((char*)&l_endian);
+
+                *(unsigned int*)(buffer + found_offset + 0x02) = l_endian;
+                *(unsigned int*)(buffer + found_offset + 0x06) = b_endian;
+            }
+
+            l_endian = size;
+            b_endian = ChangeEndian((char*)&l_endian);
+
+            *(unsigned int*)(buffer + found_offset + 0x0A) = l_endian;
+            *(unsigned int*)(buffer + found_offset + 0x0E) = b_endian;
+            PutSectors(out, found_lba, (char*)buffer, 1);
+
+            // the index has the records of the new image, as TOC() does
+            if (lba || (change->extents > 1)) entry[k].lba = change->new_lba + done / out->sector_data;
+            entry[k].size = size;
+
+            done += size;
+        }
+    }
+
+    SectorFlush(out);
+    Unmap(out);
+    if (out != iso) SectorFree(out);
+
+    // the LBAs in the new image, before the index is released
+    if (cache && (patchname == NULL)) CacheUpdate(known, index, changes, total);
+
+    if (patchname != NULL) {
+        // only the new data and the copies, the image is not changed
+        Phase("writing patch");
+
+        PatchWrite(out, patchname);
+    }
+    else if (record) {
+        // the blocks not changed are copied compressed
+        Phase("writing compressed image");
+
+        update->temp_made = 1;
+        ZipWrite(out, tempname);
+        renamed = 1;
+    }
+    else if (resize && !move) {
+        Close(temp);
+        renamed = 1;
+    }
+
+    if (record) {
+        PatchFree(recorded);
+        Close(temp);
+        update->data_made = 0;
+        if (remove(dataname)) EXIT("Remove file error\n");
+    }
+
+    // the new image is read again, before the old one is removed, with the
+    // exact size if all the next sectors are moved
+    if (verify && (patchname == NULL)) {
+        Verify(
+            volume, renamed ? tempname : iso->name, changes, count, volume_sectors, layer_diff,
+            place == PLACE_SHIFT ? image_size + (U64)diff * iso->sector_size : 0, renamed && (place == PLACE_SHIFT),
+            &update->writes
+        );
+    }
+
+    // an image updated in place, with no sector moved, is kept open with
+    // the new LBAs and sizes in the index, else it must be parsed again
+    keep = (out == iso) && !resize;
+    if (keep) {
+        volume->image_sectors = volume_sectors;
+        volume->total_sectors = iso->size / iso->sector_size;
+        if (mapped && (iso->zip == NULL)) Map(iso);
+        if (iso->map == NULL) SectorCache(iso);
+    }
+    else {
+        VolumeClose(volume);
+    }
+    IoEnd();
+
+    if (renamed) {
+        // remove the old image, the new one is kept from now on
+        Phase("removing old image");
+
+        update->temp_made = 0;
+        if (remove(iso->name)) EXIT("Remove file error\n");
+
+        // rename the new image
+        Phase("renaming temporal image");
+
+        if (rename(tempname, iso->name)) EXIT("Rename file error\n");
+    }
+    // saved with the time of the new image
+    if (cache && (patchname == NULL)) CacheSave(known, iso->name);
+
+    // the kept image has the time of the update, as the cache
+    if (keep) {
+        Open(file, iso->name, IMAGE_READ);
+        iso->time = file->time;
+        Close(file);
+    }
+
+    printf("- %sthe new image has ", label);
+    if (diff > 0)      printf("%d more", diff);
+    else if (diff < 0) printf("%d fewer", -diff);
+    else               printf("the same");
+    printf(" sector"); if ((diff != 1) && (diff != -1)) printf("s");
+    if (!diff) printf(" as"); else printf(" than");
+    printf(" the original image\n");
+    if (diff) {
+        printf("- %smaybe you need to hand update the cuesheet file", label);
+        printf(" (if exist and needed)\n");
+    }
+
+    return(keep);
+}
+
+/*----------------------------------------------------------------------------*/
+void UpdateFree(UPDATE* update) {
+    // the temporal files are removed only while the old image is there
+    free(update->path);
+    free(update->writes.copies);
+    free(update->writes.sectors);
+    Close(&update->file);
+    SectorFree(&update->temp);
+    Unmap(&update->temp);
+    Close(&update->temp);
+    if (update->temp_made) remove(update->tempname);
+    if (update->data_made) remove(update->dataname);
+    PatchFree(&update->recorded);
+    CacheFree(&update->known);
+    free(update->tempname);
+    free(update->dataname);
+    IoEnd();
+}
+
+/*----------------------------------------------------------------------------*/
+char* Normalize(char* filename) {
+    char* path;
+    int   i, j;
+
+    // 'filename' must start with a path separator
+    j = (filename[0] != '/') && (filename[0] != '\\');
+    path = Memory(StrLen(filename) + j + 1, sizeof(char));
+    path[0] = '/';
+    for (i = 0; filename[i]; i++) path[j + i] = filename[i];
+    // change all backslashes by slashes in 'filename'
+    i = StrLen(path);
+    while (i--) if (path[i] == '\\') path[i] = '/';
+
+    return(path);
+}
+
+/*----------------------------------------------------------------------------*/
+void FileError(char* filename, const char* text) {
+    char message[MAX_PATH + 128];
+
+    // a single message, as the server answers it in a line
+    snprintf(message, sizeof(message), "%s: %s", filename, text);
+    EXIT(message);
+}
+
+/*----------------------------------------------------------------------------*/
+U64 Length(ENTRY* entry) {
+    U64          length;
+    unsigned int i;
+
+    // the data of all the extents of the file
+    length = 0;
+    for (i = 0; i < entry->extents; i++) length += entry[i].size;
+
+    return(length);
+}
+
+/*----------------------------------------------------------------------------*/
+int Contiguous(IMAGE* iso, ENTRY* entry) {
+    unsigned int lba, i;
+    int          partial;
+
+    // every extent with data starts after the previous one, which has whole
+    // sectors, the empty ones are skipped
+    lba = entry->lba;
+    partial = 0;
+    for (i = 0; i < entry->extents; i++) {
+        if (!entry[i].size) continue;
+        if (partial || (entry[i].lba != lba)) return(0);
+
+        lba += entry[i].size / iso->sector_data;
+        partial = entry[i].size % iso->sector_data != 0;
+    }
+
+    return(1);
+}
+
+/*----------------------------------------------------------------------------*/
+int Unchanged(IMAGE* iso, CHANGE* change, IMAGE* file, CACHE* cache, char* path) {
+    CACHED* known;
+
+    // the cached data must be the one of the record
+    known = cache != NULL ? CacheFind(cache, path) : NULL;
+    if ((known != NULL) && ((known->lba != change->file_lba) || (known->size != change->old_filesize))) known = NULL;
+
+    if (!change->hashed) change->hash = 0;
+
+    // the same new file as written by a previous run, nothing is read
+    if ((known != NULL) && (file->size == known->size) && (file->time == known->time)) {
+        change->hash = known->hash;
+        return(1);
+    }
+
+    // the hash of the new data against the cached one
+    if ((known != NULL) || ((cache != NULL) && (change->new_filesize != change->old_filesize))) {
+        if (!change->hashed) change->hash = Digest(file);
+        return((known != NULL) && (file->size == known->size) && (change->hash == known->hash));
+    }
+
+    // else the old data is read, only for the same size
+    if (change->new_filesize != change->old_filesize) return(0);
+
+    return(Same(iso, change, file, (cache != NULL) && !change->hashed ? &change->hash : NULL));
+}
+
+/*----------------------------------------------------------------------------*/
+int Same(IMAGE* iso, CHANGE* change, IMAGE* file, U64* hash) {
+    DIGEST         digest;
+    unsigned char* data, * sectors;
+    unsigned int   length, count, i;
+    U64            done;
+    int            same;
+
+    // the new file against the user data of the old sectors, until the
+    // first difference if no hash is needed
+    DigestInit(&digest);
+    same = 1;
+    for (done = 0; done < file->size; done += length) {
+        length = file->size - done > HASH_BLOCK ? HASH_BLOCK : file->size - done;
+
+        data = (unsigned char*)Read(file, done, length);
+        if (hash != NULL) DigestUpdate(&digest, data, length);
+
+        if (same) {
+            count = (length + iso->sector_data - 1) / iso->sector_data;
+            sectors = (unsigned char*)ReadSectors(iso, change->file_lba + done / iso->sector_data, count);
+            for (i = 0; same && (i < count); i++) {
+                same = !memcmp(
+                    sectors + i * iso->sector_size + iso->data_offset, data + i * iso->sector_data,
+                    i + 1 < count ? iso->sector_data : length - i * iso->sector_data
+                );
+            }
+            AlignedFree((char*)sectors);
+        }
+
+        AlignedFree((char*)data);
+
+        if (!same && (hash == NULL)) break;
+    }
+
+    if (hash != NULL) *hash = DigestFinal(&digest);
+
+    return(same);
+}
+
+/*----------------------------------------------------------------------------*/
+void Verify(VOLUME* volume, char* name, CHANGE* changes, int count, unsigned int volume_sectors, int layer_diff, U64 size, int source, WRITES* writes) {
+    VERIFY work;
+
+    work.volume = volume;
+    work.iso = &volume->iso;
+    work.name = name;
+    work.changes = changes;
+    work.count = count;
+    work.volume_sectors = volume_sectors;
+    work.layer_diff = layer_diff;
+    work.size = size;
+    work.source = source;
+    work.writes = writes;
+    work.folders = NULL;
+    work.records = NULL;
+    work.regions = NULL;
+    work.nregions = work.max_regions = 0;
+    work.next = 0;
+    work.failed = 0;
+    Unopened(&work.check);
+
+    // the new image is closed and the lists freed, also on an error
+    try {
+        VerifyImage(&work);
+    }
+    catch (...) {
+        try {
+            VerifyFree(&work);
+        }
+        catch (...) {
+        }
+        throw;
+    }
+    VerifyFree(&work);
+}
+
+/*----------------------------------------------------------------------------*/
+void VerifyImage(VERIFY* work) {
+    VOLUME*        volume;
+    IMAGE*         check;
+    INDEX*         index;
+    CHANGE*        change;
+    REGION*        region;
+    WRITES*        writes;
+    std::thread*   threads;
+    unsigned int*  tables, * sectors;
+    unsigned int   ntables, nsectors, run, lba, end, table, len, first;
+    unsigned int   i, j, k;
+    int            shift;
+    U64            offset, length;
+
+    volume = work->volume;
+    check = &work->check;
+    index = &volume->index;
+    writes = work->writes;
+
+    Phase("verifying new image");
+
+    Open(check, work->name, IMAGE_READ);
+    ZipOpen(check);
+    FormatAs(check, work->iso);
+
+    // the writes are on the storage, the pages of every region are dropped
+    // before it is read, and all the pages of a compressed image now, as
+    // they are not at the sector positions
+#ifndef _WIN32
+    if (fsync(check->fd)) EXIT("File write error\n");
+#endif
+#ifdef __linux__
+    if (check->zip != NULL) posix_fadvise(check->fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+
+    if (work->size ? check->size != work->size : check->size < (U64)work->volume_sectors * check->sector_size) {
+        EXIT("Verify error in the image size\n");
+    }
+
+    // the metadata sectors written by the update, once each
+    sectors = writes->sectors;
+    qsort(sectors, writes->nsectors, sizeof(unsigned int), CompareLBA);
+    for (nsectors = i = 0; i < writes->nsectors; i++) {
+        if (!nsectors || (sectors[i] != sectors[nsectors - 1])) sectors[nsectors++] = sectors[i];
+    }
+    writes->nsectors = nsectors;
+
+    // the records and the folders of the index, which has the LBAs and the
+    // positions of the new image, only searched in memory
+    work->base = volume->layer_lba + ShiftSector(work->changes, work->count, volume->layer_lba);
+    work->records = (ENTRY**)Memory(index->count + 1, sizeof(ENTRY*));
+    work->folders = (unsigned int*)Memory(index->count + 1, sizeof(unsigned int));
+    work->nfolders = 0;
+    for (i = 0; i < index->count; i++) {
+        work->records[i] = &index->entries[i];
+        if (index->entries[i].flags & 0x02) work->folders[work->nfolders++] = index->entries[i].lba;
+    }
+    qsort(work->records, index->count, sizeof(ENTRY*), CompareRecord);
+    qsort(work->folders, work->nfolders, sizeof(unsigned int), CompareLBA);
+
+    // a path table with a written sector is read whole, the records can
+    // be split between its sectors
+    tables = (unsigned int*)Memory(1, sizeof(unsigned int));
+    ntables = 0;
+    for (i = 0; i < 8; i++) {
+        if (i < 4) {
+            if (!volume->tbl_lba[i]) continue;
+            table = volume->tbl_lba[i];
+            len = volume->tbl_len;
+            first = 0;
+        }
+        else {
+            if (!volume->layer_lba || !volume->layer_tbl_lba[i - 4]) continue;
+            table = volume->layer_lba + volume->layer_tbl_lba[i - 4];
+            len = volume->layer_tbl_len;
+            first = work->base;
+        }
+        table += ShiftSector(work->changes, work->count, table);
+        run = (len + LEN_SECTOR_M0 - 1) / LEN_SECTOR_M0;
+
+        for (j = 0; j < run; j++) {
+            lba = table + j;
+            if (bsearch(&lba, sectors, nsectors, sizeof(unsigned int), CompareLBA)) break;
+        }
+        if (j == run) continue;
+
+        region = VerifyAdd(work, REGION_TABLE, table, run);
+        region->count = len;
+        region->base = first;
+        region->sw = i & 0x2;
+
+        tables = (unsigned int*)realloc(tables, (ntables + run) * sizeof(unsigned int));
+        if (tables == NULL) EXIT("Memory error\n");
+        for (j = 0; j < run; j++) tables[ntables++] = table + j;
+    }
+    qsort(tables, ntables, sizeof(unsigned int), CompareLBA);
+
+    // the other written sectors in runs, with the volume descriptors and the
+    // folder records in them
+    run = HASH_BLOCK / check->sector_size;
+    for (i = 0; i < nsectors; i = j) {
+        if (bsearch(&sectors[i], tables, ntables, sizeof(unsigned int), CompareLBA)) {
+            j = i + 1;
+            continue;
+        }
+        for (j = i + 1; (j < nsectors) && (j - i < run) && (sectors[j] == sectors[j - 1] + 1); j++) {
+            if (bsearch(&sectors[j], tables, ntables, sizeof(unsigned int), CompareLBA)) break;
+        }
+        VerifyAdd(work, REGION_METADATA, sectors[i], j - i);
+    }
+    free(tables);
+
+    // the new data against the new files, in parts for the threads, and an
+    // empty file is only checked as not changed
+    for (i = 0; i < (unsigned int)work->count; i++) {
+        change = &work->changes[i];
+        offset = 0;
+        do {
+            length = change->new_filesize - offset > HASH_THREAD ? HASH_THREAD : change->new_filesize - offset;
+
+            region = VerifyAdd(work, REGION_DATA, change->new_lba + offset / check->sector_data, 0);
+            region->change = change;
+            region->offset = offset;
+            region->length = length;
+
+            offset += length;
+        } while (offset < change->new_filesize);
+    }
+
+    // the first and the last sector of every run copied from the old image,
+    // with the shift of the file before it, if not written after the copy
+    if (work->source) {
+        for (i = 0; i <= (unsigned int)work->count; i++) {
+            change = i ? &work->changes[i - 1] : NULL;
+            lba = change != NULL ? change->file_lba + change->old_sectors : 0;
+            end = i < (unsigned int)work->count ? work->changes[i].file_lba : volume->total_sectors;
+            shift = change != NULL ? change->shift + change->diff : 0;
+            if (lba >= end) continue;
+
+            for (k = 0; k < 2; k++) {
+                if (k && (end - 1 == lba)) break;
+                table = (k ? end - 1 : lba) + shift;
+                if (bsearch(&table, sectors, nsectors, sizeof(unsigned int), CompareLBA)) continue;
+
+                region = VerifyAdd(work, REGION_COPY, table, 1);
+                region->lba = k ? end - 1 : lba;
+            }
+        }
+    }
+
+    // the regions are read by the cores, the first error stops the others
+    k = std::thread::hardware_concurrency();
+    if (k > work->nregions) k = work->nregions;
+    if (k < 1) k = 1;
+
+    threads = new std::thread[k];
+    for (i = 0; i < k; i++) threads[i] = std::thread(VerifyWorker, work);
+    for (i = 0; i < k; i++) threads[i].join();
+    delete[] threads;
+
+    if (work->failed) std::rethrow_exception(work->error);
+
+    // the whole image, mostly in the page cache after the update, with the
+    // blocks hashed by the copy engine
+    if (verify >= VERIFY_CRC32) Checksum(check, writes);
+}
+
+/*----------------------------------------------------------------------------*/
+REGION* VerifyAdd(VERIFY* work, unsigned int type, U64 newlba, unsigned int count) {
+    REGION* region;
+
+    if (work->nregions == work->max_regions) {
+        work->max_regions = work->max_regions ? work->max_regions << 1 : 64;
+        work->regions = (REGION*)realloc(work->regions, work->max_regions * sizeof(REGION));
+        if (work->regions == NULL) EXIT("Memory error\n");
+    }
+    region = &work->regions[work->nregions++];
+    memset(region, 0, sizeof(REGION));
+    region->type = type;
+    region->lba = region->newlba = newlba;
+    region->count = count;
+
+    return(region);
+}
+
+/*----------------------------------------------------------------------------*/
+void VerifyWorker(VERIFY* work) {
+    IMAGE        file;
+    REGION*      region;
+    unsigned int i;
+
+    // the library errors are exceptions, thrown again by VerifyImage()
+    Unopened(&file);
+    try {
+        for (;;) {
+            i = work->next++;
+            if (i >= work->nregions) break;
+
+            region = &work->regions[i];
+            if (region->type == REGION_METADATA)   VerifyMetadata(work, region);
+            else if (region->type == REGION_TABLE) VerifyTable(work, region);
+            else if (region->type == REGION_DATA)  VerifyData(work, region, &file);
+            else                                   VerifyCopy(work, region);
+        }
+    }
+    catch (...) {
+        // the first error is kept, the other workers stop at the next region
+        if (!work->failed.exchange(1)) work->error = std::current_exception();
+        work->next = work->nregions;
+        try {
+            Close(&file);
+        }
+        catch (...) {
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+void VerifyFree(VERIFY* work) {
+    free(work->regions);
+    free(work->records);
+    free(work->folders);
+    work->regions = NULL;
+    work->records = NULL;
+    work->folders = NULL;
+
+    ZipClose(&work->check);
+    Close(&work->check);
+}
+
+/*----------------------------------------------------------------------------*/
+void VerifyMetadata(VERIFY* work, REGION* region) {
+    IMAGE*         image;
+    ENTRY*         entry;
+    unsigned char* buffer, * record;
+    unsigned int   low, high, mid, lba;
+    U64            start, end;
+
+    image = &work->check;
+    start = region->newlba * image->sector_size;
+    end = start + (U64)region->count * image->sector_size;
+
+    Uncache(image, start, end - start);
+    buffer = (unsigned char*)ReadSectors(image, region->newlba, region->count);
+    VerifySectors(image, buffer, region->newlba, region->count, "a metadata sector");
+
+    // the volume descriptors with the new sizes
+    if ((region->newlba <= DESCRIPTOR_LBA) && (DESCRIPTOR_LBA < region->newlba + region->count)) {
+        VerifyVolume(image, buffer + (DESCRIPTOR_LBA - region->newlba) * image->sector_size, DESCRIPTOR_LBA, work->volume_sectors);
+    }
+    lba = work->base + DESCRIPTOR_LBA;
+    if (work->volume->layer_lba && (region->newlba <= lba) && (lba < region->newlba + region->count)) {
+        VerifyVolume(image, buffer + (lba - region->newlba) * image->sector_size, lba, work->volume->layer_sectors + work->layer_diff);
+    }
+
+    // every record in the sectors has the LBA and the size of the index,
+    // from the first one after the start
+    low = 0;
+    high = work->volume->index.count;
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (work->records[mid]->position < start) low = mid + 1;
+        else                                      high = mid;
+    }
+    for (; (low < work->volume->index.count) && (work->records[low]->position < end); low++) {
+        entry = work->records[low];
+        record = buffer + (entry->position - start);
+        lba = entry->lba - entry->base;
+        if (
+            (*(unsigned int*)(record + 0x02) != lba) ||
+            ((unsigned int)ChangeEndian((char*)record + 0x06) != lba) ||
+            (*(unsigned int*)(record + 0x0A) != entry->size) ||
+            ((unsigned int)ChangeEndian((char*)record + 0x0E) != entry->size)
+        ) {
+            VerifyError("a folder record", entry->position / image->sector_size);
+        }
+    }
+
+    AlignedFree((char*)buffer);
+}
+
+/*----------------------------------------------------------------------------*/
+void VerifyVolume(IMAGE* image, unsigned char* buffer, U64 lba, unsigned int sectors) {
+    unsigned char* data;
+
+    data = buffer + image->data_offset;
+    if (
+        memcmp(data, "\1CD001", 6) ||
+        (*(unsigned int*)(data + TOTAL_SECTORS) != sectors) ||
+        ((unsigned int)ChangeEndian((char*)data + TOTAL_SECTORS + 4) != sectors)
+    ) {
+        VerifyError("a volume descriptor", lba);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+void VerifyTable(VERIFY* work, REGION* region) {
+    IMAGE*         image;
+    unsigned char* buffer, * table;
+    unsigned int   total, len, pos, nbytes, folder;
+    unsigned int   i;
+
+    image = &work->check;
+    len = region->count;
+    total = (len + LEN_SECTOR_M0 - 1) / LEN_SECTOR_M0;
+
+    Uncache(image, region->newlba * image->sector_size, (U64)total * image->sector_size);
+    buffer = (unsigned char*)ReadSectors(image, region->newlba, total);
+    VerifySectors(image, buffer, region->newlba, total, "a path table");
+
+    // the table is contiguous only in the user data sectors
+    table = (unsigned char*)Memory(total * image->sector_data, sizeof(char));
+    for (i = 0; i < total; i++) memcpy(table + i * image->sector_data, buffer + i * image->sector_size + image->data_offset, image->sector_data);
+
+    // every folder of the table is a folder of the index, from the first
+    // sector of its volume
+    pos = 0;
+    while (pos < len) {
+        nbytes = *(unsigned char*)(table + pos);
+        if (!nbytes) break;
+
+        folder = *(unsigned int*)(table + pos + 0x002);
+        if (region->sw) folder = ChangeEndian((char*)&folder);
+        folder += region->base;
+        if (bsearch(&folder, work->folders, work->nfolders, sizeof(unsigned int), CompareLBA) == NULL) {
+            VerifyError("a path table", region->newlba + pos / image->sector_data);
+        }
+
+        pos += 0x08 + nbytes + (nbytes & 0x1);
+    }
+
+    free(table);
+    AlignedFree((char*)buffer);
+}
+
+/*----------------------------------------------------------------------------*/
+void VerifyData(VERIFY* work, REGION* region, IMAGE* file) {
+    IMAGE*         image;
+    CHANGE*        change;
+    unsigned char* data, * sectors;
+    unsigned int   length, count, i;
+    U64            done, lba;
+
+    image = &work->check;
+    change = region->change;
+
+    // the new file against the user data of its new sectors, the file
+    // must not be changed since it was written
+    Open(file, change->newname, IMAGE_READ);
+    if ((file->size != change->new_filesize) || (file->time != change->time)) {
+        FileError(change->oldname, "New file changed while replaced\n");
+    }
+
+    count = (region->length + image->sector_data - 1) / image->sector_data;
+    Uncache(image, region->newlba * image->sector_size, (U64)count * image->sector_size);
+
+    for (done = 0; done < region->length; done += length) {
+        length = region->length - done > HASH_BLOCK ? HASH_BLOCK : region->length - done;
+
+        data = (unsigned char*)Read(file, region->offset + done, length);
+        count = (length + image->sector_data - 1) / image->sector_data;
+        lba = region->newlba + done / image->sector_data;
+        sectors = (unsigned char*)ReadSectors(image, lba, count);
+        VerifySectors(image, sectors, lba, count, change->oldname);
+
+        for (i = 0; i < count; i++) {
+            if (memcmp(
+                sectors + i * image->sector_size + image->data_offset, data + i * image->sector_data,
+                i + 1 < count ? image->sector_data : length - i * image->sector_data
+            )) {
+                VerifyError(change->oldname, lba + i);
+            }
+        }
+
+        AlignedFree((char*)sectors);
+        AlignedFree((char*)data);
+    }
+
+    Close(file);
+}
+
+/*----------------------------------------------------------------------------*/
+void VerifyCopy(VERIFY* work, REGION* region) {
+    IMAGE*         image;
+    unsigned char* old, * buffer;
+    unsigned int   start;
+
+    image = &work->check;
+
+    old = (unsigned char*)ReadSectors(work->iso, region->lba, 1);
+    Uncache(image, region->newlba * image->sector_size, image->sector_size);
+    buffer = (unsigned char*)ReadSectors(image, region->newlba, 1);
+
+    // a moved raw sector has a new header, and a new EDC/ECC in Mode 1,
+    // else it is the same sector
+    start = 0;
+    if ((region->lba != region->newlba) && (image->mode != MODE_M0)) {
+        VerifySectors(image, buffer, region->newlba, 1, "a moved sector");
+        start = image->mode == MODE_M1 ? image->data_offset : 0x010;
+    }
+    if (memcmp(
+        old + start, buffer + start,
+        start == image->data_offset ? image->sector_data : image->sector_size - start
+    )) {
+        VerifyError("a moved sector", region->newlba);
+    }
+
+    AlignedFree((char*)buffer);
+    AlignedFree((char*)old);
+}
+
+/*----------------------------------------------------------------------------*/
+void VerifySectors(IMAGE* image, unsigned char* sectors, U64 lba, unsigned int count, const char* text) {
+    unsigned char* sector;
+    unsigned int   address, edc, i;
+
+    if (image->mode == MODE_M0) return;
+
+    // the address of the header and the EDC of every raw sector, as written
+    // by EncodeSectors()
+    for (i = 0; i < count; i++) {
+        sector = sectors + i * image->sector_size;
+
+        address = lba + i + image->sector_address;
+        if (
+            (sector[0x00C] != (((address / 75 / 60 / 10) << 4) | (address / 75 / 60 % 10))) ||
+            (sector[0x00D] != (((address / 75 % 60 / 10) << 4) | (address / 75 % 60 % 10))) ||
+            (sector[0x00E] != (((address % 75 / 10) << 4) | (address % 75 % 10))) ||
+            (sector[0x00F] != image->mode)
+        ) {
+            VerifyError(text, lba + i);
+        }
+
+        if (image->mode == MODE_M1) edc = EDC(sector, 0x810);
+        else                        edc = EDC(sector + 0x010, 0x808);
+        if (memcmp(&edc, sector + (image->mode == MODE_M1 ? 0x810 : 0x818), 4)) VerifyError(text, lba + i);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+void VerifyError(const char* text, U64 lba) {
+    char message[MAX_PATH + 128];
+
+    snprintf(message, sizeof(message), "Verify error in %s, sector %llu\n", text, lba);
+    EXIT(message);
+}
+
+/*----------------------------------------------------------------------------*/
+void Uncache(IMAGE* image, U64 position, U64 length) {
+#ifdef __linux__
+    // the pages of a compressed image are not at the sector positions, all
+    // of them were dropped before the first region
+    if (image->zip != NULL) return;
+    posix_fadvise(image->fd, position, length, POSIX_FADV_DONTNEED);
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+int CompareLBA(const void* a, const void* b) {
+    unsigned int x, y;
+
+    x = *(unsigned int*)a;
+    y = *(unsigned int*)b;
+
+    return(x < y ? -1 : x > y);
+}
+
+/*----------------------------------------------------------------------------*/
+int CompareRecord(const void* a, const void* b) {
+    U64 x, y;
+
+    x = (*(ENTRY**)a)->position;
+    y = (*(ENTRY**)b)->position;
+
+    return(x < y ? -1 : x > y);
+}
+
+/*----------------------------------------------------------------------------*/
+void CacheLoad(CACHE* cache, IMAGE* iso) {
+    IMAGE        list;
+    CACHED*      known;
+    char*        name, * buffer, * line, * next;
+    U64          size, time;
+    int          pos;
+
+    cache->count = cache->sorted = 0;
+    cache->max = 64;
+    cache->files = (CACHED*)Memory(cache->max, sizeof(CACHED));
+
+    name = Memory(StrLen(iso->name) + sizeof(CACHE_SUFFIX), sizeof(char));
+    sprintf(name, "%s%s", iso->name, CACHE_SUFFIX);
+
+    // no cache yet
+    if (!Exists(name)) {
+        free(name);
+        return;
+    }
+
+    // load the cache as a text
+    Open(&list, name, IMAGE_READ);
+    buffer = Memory(list.size + 1, sizeof(char));
+    PRead(&list, 0, buffer, list.size);
+    Close(&list);
+    free(name);
+
+    // only valid for the image as it was saved
+    pos = 0;
+    next = buffer;
+    if ((sscanf(buffer, CACHE_HEADER " %llu %llu%n", &size, &time, &pos) != 2) || (size != (iso->zip != NULL ? iso->zip->size : iso->size)) || (time != iso->time)) {
+        printf("- %scache out of date, ignored\n", label);
+        *next = '\0';
+    }
+    else {
+        next += pos;
+    }
+
+    // 'hash lba size time path' per line
+    for (line = next; *line; line = next) {
+        for (next = line; *next && (*next != '\n') && (*next != '\r'); next++);
+        while ((*next == '\n') || (*next == '\r')) *next++ = '\0';
+        if (!*line) continue;
+
+        if (cache->count == cache->max) {
+            cache->max <<= 1;
+            cache->files = (CACHED*)realloc(cache->files, cache->max * sizeof(CACHED));
+            if (cache->files == NULL) EXIT("Memory error\n");
+        }
+        known = &cache->files[cache->count];
+
+        pos = 0;
+        if (sscanf(line, "%llx %u %llu %llu %n", &known->hash, &known->lba, &known->size, &known->time, &pos) != 4) continue;
+        if (!pos || (line[pos] != '/')) continue;
+
+        known->path = Memory(StrLen(line + pos) + 1, sizeof(char));
+        strcpy(known->path, line + pos);
+        cache->count++;
+    }
+
+    free(buffer);
+
+    qsort(cache->files, cache->count, sizeof(CACHED), CompareCached);
+    cache->sorted = cache->count;
+}
+
+/*----------------------------------------------------------------------------*/
+void CacheUpdate(CACHE* cache, INDEX* index, CHANGE* changes, int count) {
+    CACHED*      known;
+    ENTRY*       entry;
+    char*        path;
+    unsigned int i, j;
+
+    // the data of the replaced files, written or with the same data
+    for (i = 0; i < (unsigned int)count; i++) {
+        path = index->paths + changes[i].path;
+
+        known = CacheFind(cache, path);
+        if (known == NULL) {
+            if (cache->count == cache->max) {
+                cache->max <<= 1;
+                cache->files = (CACHED*)realloc(cache->files, cache->max * sizeof(CACHED));
+                if (cache->files == NULL) EXIT("Memory error\n");
+            }
+            known = &cache->files[cache->count++];
+            known->path = Memory(StrLen(path) + 1, sizeof(char));
+            strcpy(known->path, path);
+        }
+
+        known->size = changes[i].new_filesize;
+        known->time = changes[i].time;
+        known->hash = changes[i].hash;
+    }
+
+    // the LBAs of all the files in the new image, as the index
+    for (i = j = 0; i < cache->count; i++) {
+        entry = Search(index, cache->files[i].path);
+        if (entry == NULL) {
+            free(cache->files[i].path);
+            continue;
+        }
+        cache->files[i].lba = entry->lba;
+        cache->files[j++] = cache->files[i];
+    }
+    cache->count = j;
+
+    qsort(cache->files, cache->count, sizeof(CACHED), CompareCached);
+    cache->sorted = cache->count;
+}
+
+/*----------------------------------------------------------------------------*/
+void CacheSave(CACHE* cache, char* isoname) {
+    IMAGE        image;
+    CACHED*      known;
+    char*        name, * buffer;
+    unsigned int length, i;
+
+    // the size and time of the image to validate the cache
+    Open(&image, isoname, IMAGE_READ);
+    Close(&image);
+
+    length = sizeof(CACHE_HEADER) + 2 * 21 + 1;
+    for (i = 0; i < cache->count; i++) length += 16 + 2 * 11 + 2 * 21 + StrLen(cache->files[i].path) + 1;
+
+    buffer = Memory(length, sizeof(char));
+    length = sprintf(buffer, CACHE_HEADER " %llu %llu\n", image.size, image.time);
+    for (i = 0; i < cache->count; i++) {
+        known = &cache->files[i];
+        length += sprintf(buffer + length, "%016llx %u %llu %llu %s\n", known->hash, known->lba, known->size, known->time, known->path);
+    }
+
+    name = Memory(StrLen(isoname) + sizeof(CACHE_SUFFIX), sizeof(char));
+    sprintf(name, "%s%s", isoname, CACHE_SUFFIX);
+    Save(name, buffer, length);
+    free(name);
+    free(buffer);
+}
+
+/*----------------------------------------------------------------------------*/
+void CacheFree(CACHE* cache) {
+    unsigned int i;
+
+    for (i = 0; i < cache->count; i++) free(cache->files[i].path);
+    free(cache->files);
+}
+
+/*----------------------------------------------------------------------------*/
+CACHED* CacheFind(CACHE* cache, char* path) {
+    CACHED       key;
+    CACHED*      known;
+    unsigned int i;
+
+    // binary search in the loaded files, linear in the new ones
+    key.path = path;
+    known = (CACHED*)bsearch(&key, cache->files, cache->sorted, sizeof(CACHED), CompareCached);
+    if (known != NULL) return(known);
+
+    for (i = cache->sorted; i < cache->count; i++) {
+        if (!strcmp(cache->files[i].path, path)) return(&cache->files[i]);
+    }
+
+    return(NULL);
+}
+
+/*----------------------------------------------------------------------------*/
+int CompareCached(const void* a, const void* b) {
+    return(strcmp(((CACHED*)a)->path, ((CACHED*)b)->path));
+}
+
+/*----------------------------------------------------------------------------*/
+void PatchInit(PATCH* patch, IMAGE* source) {
+    patch->source = source;
+    patch->relocate = 0;
+    patch->count = 0;
+    patch->max = 64;
+    patch->extents = (EXTENT*)Memory(patch->max, sizeof(EXTENT));
+}
+
+/*----------------------------------------------------------------------------*/
+void PatchFree(PATCH* patch) {
+    free(patch->extents);
+    patch->extents = NULL;
+    patch->count = 0;
+}
+
+/*----------------------------------------------------------------------------*/
+void PatchAdd(IMAGE* image, U64 position, U64 source, U64 length) {
+    PATCH*  patch;
+    EXTENT* last;
+
+    if (!length) return;
+
+    patch = image->patch;
+
+    // contiguous with the last record, as the sequential writes/copies
+    if (patch->count) {
+        last = &patch->extents[patch->count - 1];
+        if (last->position + last->length == position) {
+            if ((source == PATCH_NEW) && (last->source == PATCH_NEW)) {
+                last->length += length;
+                return;
+            }
+            if ((source != PATCH_NEW) && (last->source != PATCH_NEW) && (last->source + last->length == source)) {
+                last->length += length;
+                return;
+            }
+        }
+    }
+
+    if (patch->count == patch->max) {
+        patch->max <<= 1;
+        patch->extents = (EXTENT*)realloc(patch->extents, patch->max * sizeof(EXTENT));
+        if (patch->extents == NULL) EXIT("Memory error\n");
+    }
+    last = &patch->extents[patch->count++];
+    last->position = position;
+    last->source = source;
+    last->length = length;
+}
+
+/*----------------------------------------------------------------------------*/
+void PatchRead(IMAGE* image, U64 position, char* buffer, U64 length) {
+    PATCH*       patch;
+    EXTENT*      extent, * copy;
+    U64          count, next;
+    unsigned int i;
+
+    patch = image->patch;
+
+    // the new data is in the sparse image and wins over the copies of the
+    // old image, the rest was never written
+    while (length) {
+        copy = NULL;
+        next = position + length;
+        for (i = 0; i < patch->count; i++) {
+            extent = &patch->extents[i];
+            if ((extent->position <= position) && (position < extent->position + extent->length)) {
+                if (extent->source == PATCH_NEW) break;
+                copy = extent;
+            }
+            else if ((extent->position > position) && (extent->position < next)) {
+                next = extent->position;
+            }
+        }
+
+        if (i < patch->count) {
+            extent = &patch->extents[i];
+            count = extent->position + extent->length - position;
+            if (count > length) count = length;
+            PRead(image, position, buffer, count);
+        }
+        else if (copy != NULL) {
+            count = copy->position + copy->length - position;
+            if (count > next - position) count = next - position;
+            ReadData(patch->source, copy->source + position - copy->position, buffer, count);
+        }
+        else {
+            count = next - position;
+            memset(buffer, 0, count);
+        }
+
+        position += count; buffer += count; length -= count;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+void PatchWrite(IMAGE* image, char* patchname) {
+    PATCH*       patch;
+    IMAGE        file;
+    EXTENT*      data, * copies;
+    DIGEST       digest;
+    U64          header[9], op[4];
+    U64          offset;
+    char*        buffer;
+    unsigned int ndata, ncopies;
+    unsigned int i, j;
+
+    patch = image->patch;
+
+    // the new data and the copies of the old image without it
+    PatchSplit(patch, &data, &ndata, &copies, &ncopies);
+
+    // the old image is identified by its volume descriptor sector
+    buffer = ReadSectors(patch->source, DESCRIPTOR_LBA, 1);
+    DigestInit(&digest);
+    DigestUpdate(&digest, (unsigned char*)buffer, image->sector_size);
+    AlignedFree(buffer);
+
+    memcpy(header, PATCH_MAGIC, sizeof(U64));
+    header[1] = PATCH_VERSION;
+    header[2] = image->mode;
+    header[3] = image->sector_size;
+    header[4] = image->sector_address;
+    header[5] = patch->source->size;
+    header[6] = image->size;
+    header[7] = DigestFinal(&digest);
+
+    // and by all the data copied from it, in the order of the operations
+    DigestInit(&digest);
+    for (i = 0; i < ncopies; i++) PatchSource(&digest, patch->source, copies[i].source, copies[i].length);
+    header[8] = DigestFinal(&digest);
+
+    Open(&file, patchname, IMAGE_CREATE);
+    PWrite(&file, 0, (char*)header, sizeof(header));
+    offset = sizeof(header);
+
+    // the operations in the order of the new image, the new data after
+    // its operation
+    for (i = j = 0; (i < ncopies) || (j < ndata); ) {
+        if ((j == ndata) || ((i < ncopies) && (copies[i].position < data[j].position))) {
+            op[0] = PATCH_COPY;
+            op[1] = copies[i].position;
+            op[2] = copies[i].length;
+            op[3] = copies[i++].source;
+            PWrite(&file, offset, (char*)op, sizeof(op));
+            offset += sizeof(op);
+        }
+        else {
+            op[0] = PATCH_DATA;
+            op[1] = data[j].position;
+            op[2] = data[j].length;
+            op[3] = 0;
+            PWrite(&file, offset, (char*)op, sizeof(op));
+            offset += sizeof(op);
+
+            CopyData(image, data[j].position, &file, offset, data[j].length);
+            offset += data[j++].length;
+        }
+    }
+
+    memset(op, 0, sizeof(op));
+    op[0] = PATCH_END;
+    PWrite(&file, offset, (char*)op, sizeof(op));
+    offset += sizeof(op);
+
+    printf("- patch of %llu bytes: %u copies, %u data extents\n", offset, ncopies, ndata);
+
+    Close(&file);
+
+    free(copies);
+    free(data);
+}
+
+/*----------------------------------------------------------------------------*/
+void PatchApply(char* patchname, char* isoname) {
+    IMAGE          iso, temp, patch;
+    DIGEST         digest;
+    U64            header[9], op[4];
+    U64            offset;
+    char*          buffer, * tempname;
+
+    Phase("reading patch");
+
+    Open(&patch, patchname, IMAGE_READ);
+    if (patch.size < sizeof(header)) EXIT("Patch file error\n");
+    PRead(&patch, 0, (char*)header, sizeof(header));
+    if (memcmp(header, PATCH_MAGIC, sizeof(U64))) EXIT("Patch file error\n");
+    if (header[1] != PATCH_VERSION) EXIT("Patch version not supported\n");
+
+    // only the image the patch was made from
+    Open(&iso, isoname, IMAGE_READ);
+    Format(&iso);
+    if ((iso.mode != header[2]) || (iso.sector_size != header[3]) || (iso.sector_address != header[4]) || (iso.size != header[5])) {
+        EXIT("Patch for another image\n");
+    }
+    buffer = ReadSectors(&iso, DESCRIPTOR_LBA, 1);
+    DigestInit(&digest);
+    DigestUpdate(&digest, (unsigned char*)buffer, iso.sector_size);
+    AlignedFree(buffer);
+    if (DigestFinal(&digest) != header[7]) EXIT("Patch for another image\n");
+
+    // the data copied from the image must be the same, checked before
+    // anything is written
+    DigestInit(&digest);
+    for (offset = sizeof(header); ; ) {
+        if (offset + sizeof(op) > patch.size) EXIT("Patch file error\n");
+        PRead(&patch, offset, (char*)op, sizeof(op));
+        offset += sizeof(op);
+
+        if (op[0] == PATCH_END) break;
+
+        if (op[0] == PATCH_COPY) {
+            if ((op[3] + op[2] > iso.size) || (op[3] + op[2] < op[3])) EXIT("Patch file error\n");
+            PatchSource(&digest, &iso, op[3], op[2]);
+        }
+        else if (op[0] == PATCH_DATA) {
+            if ((offset + op[2] > patch.size) || (offset + op[2] < offset)) EXIT("Patch file error\n");
+            offset += op[2];
+        }
+        else {
+            EXIT("Patch file error\n");
+        }
+    }
+    if (DigestFinal(&digest) != header[8]) EXIT("Patch for another image\n");
+
+    Phase("applying patch");
+
+    tempname = Temporal(isoname, TMPNAME);
+    Open(&temp, tempname, IMAGE_CREATE);
+    FormatAs(&temp, &iso);
+
+    for (offset = sizeof(header); ; ) {
+        if (offset + sizeof(op) > patch.size) EXIT("Patch file error\n");
+        PRead(&patch, offset, (char*)op, sizeof(op));
+        offset += sizeof(op);
+
+        if (op[0] == PATCH_END) break;
+
+        if (op[0] == PATCH_COPY) {
+            if ((op[3] + op[2] > iso.size) || (op[3] + op[2] < op[3])) EXIT("Patch file error\n");
+            // the moved raw sectors get their new address
+            if (!(op[1] % iso.sector_size) && !(op[2] % iso.sector_size) && !(op[3] % iso.sector_size)) {
+                CopySectors(&iso, op[3] / iso.sector_size, &temp, op[1] / iso.sector_size, op[2] / iso.sector_size);
+            }
+            else {
+                CopyData(&iso, op[3], &temp, op[1], op[2]);
+            }
+        }
+        else if (op[0] == PATCH_DATA) {
+            if ((offset + op[2] > patch.size) || (offset + op[2] < offset)) EXIT("Patch file error\n");
+            CopyData(&patch, offset, &temp, op[1], op[2]);
+            offset += op[2];
+        }
+        else {
+            EXIT("Patch file error\n");
+        }
+    }
+
+    if (temp.size != header[6]) Truncate(&temp, header[6]);
+
+    Close(&temp);
+    Close(&iso);
+    Close(&patch);
+
+    // remove the old image
+    Phase("removing old image");
+
+    if (remove(isoname)) EXIT("Remove file error\n");
+
+    // rename the new image
+    Phase("renaming temporal image");
+
+    if (rename(tempname, isoname)) EXIT("Rename file error\n");
+    free(tempname);
+
+    if (stats) Stats(&iso);
+}
+
+/*----------------------------------------------------------------------------*/
+void PatchSource(DIGEST* digest, IMAGE* source, U64 position, U64 length) {
+    unsigned char* data;
+    unsigned int   count;
+
+    // a range of the old image, hashed by blocks
+    for (; length; position += count, length -= count) {
+        count = length > HASH_BLOCK ? HASH_BLOCK : (unsigned int)length;
+
+        data = (unsigned char*)Read(source, position, count);
+        DigestUpdate(digest, data, count);
+        AlignedFree((char*)data);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+void PatchSplit(PATCH* patch, EXTENT** new_data, unsigned int* new_count, EXTENT** old_data, unsigned int* old_count) {
+    EXTENT*      data, * copies;
+    U64          start, end;
+    unsigned int ndata, ncopies, max;
+    unsigned int i, j, k;
+
+    // the new data, sorted and merged
+    data = (EXTENT*)Memory(patch->count + 1, sizeof(EXTENT));
+    ndata = 0;
+    for (i = 0; i < patch->count; i++) {
+        if (patch->extents[i].source == PATCH_NEW) data[ndata++] = patch->extents[i];
+    }
+    qsort(data, ndata, sizeof(EXTENT), CompareExtent);
+    for (i = j = 0; i < ndata; i++) {
+        if (j && (data[i].position <= data[j - 1].position + data[j - 1].length)) {
+            end = data[i].position + data[i].length;
+            if (end > data[j - 1].position + data[j - 1].length) data[j - 1].length = end - data[j - 1].position;
+        }
+        else {
+            data[j++] = data[i];
+        }
+    }
+    ndata = j;
+
+    // the copies without the new data, they do not overlap
+    max = patch->count + ndata + 1;
+    copies = (EXTENT*)Memory(max, sizeof(EXTENT));
+    ncopies = 0;
+    for (i = 0; i < patch->count; i++) {
+        if (patch->extents[i].source == PATCH_NEW) continue;
+
+        start = patch->extents[i].position;
+        end = start + patch->extents[i].length;
+        for (k = 0; (k < ndata) && (start < end); k++) {
+            if (data[k].position + data[k].length <= start) continue;
+            if (data[k].position >= end) break;
+            if (data[k].position > start) {
+                if (ncopies == max) {
+                    max <<= 1;
+                    copies = (EXTENT*)realloc(copies, max * sizeof(EXTENT));
+                    if (copies == NULL) EXIT("Memory error\n");
+                }
+                copies[ncopies].position = start;
+                copies[ncopies].source = patch->extents[i].source + start - patch->extents[i].position;
+                copies[ncopies++].length = data[k].position - start;
+            }
+            start = data[k].position + data[k].length;
+        }
+        if (start < end) {
+            if (ncopies == max) {
+                max <<= 1;
+                copies = (EXTENT*)realloc(copies, max * sizeof(EXTENT));
+                if (copies == NULL) EXIT("Memory error\n");
+            }
+            copies[ncopies].position = start;
+            copies[ncopies].source = patch->extents[i].source + start - patch->extents[i].position;
+            copies[ncopies++].length = end - start;
+        }
+    }
+    qsort(copies, ncopies, sizeof(EXTENT), CompareExtent);
+
+    *new_data = data;
+    *new_count = ndata;
+    *old_data = copies;
+    *old_count = ncopies;
+}
+
+/*----------------------------------------------------------------------------*/
+int CompareExtent(const void* a, const void* b) {
+    EXTENT* x = (EXTENT*)a;
+    EXTENT* y = (EXTENT*)b;
+
+    if (x->position != y->position) return(x->position < y->position ? -1 : 1);
+    return(0);
+}
+
+/*----------------------------------------------------------------------------*/
+void ZipOpen(IMAGE* image) {
+    unsigned char header[ZIP_HEADER];
+    ZIP*          zip;
+    U64           total, end;
+
+    // CSO/ZSO: magic, header size, image size, block size, version, align,
+    // then the block positions, the high bit for the blocks not compressed
+    if (image->size < ZIP_HEADER) return;
+    PRead(image, 0, (char*)header, ZIP_HEADER);
+    if (memcmp(header, "CISO", 4) && memcmp(header, "ZISO", 4)) return;
+
+    zip = (ZIP*)Memory(1, sizeof(ZIP));
+    zip->format = header[0] == 'Z' ? ZIP_ZSO : ZIP_CSO;
+    zip->block = *(unsigned int*)(header + 0x10);
+    zip->align = header[0x15];
+    zip->size = image->size;
+    total = *(U64*)(header + 0x08);
+
+#ifndef HAVE_ZLIB
+    if (zip->format == ZIP_CSO) EXIT("CSO images need a build with zlib (-DHAVE_ZLIB)\n");
+#endif
+    if ((header[0x14] > 1) || (zip->block < 0x200) || (zip->block > 0x100000) || (zip->align > 31)) {
+        EXIT("Compressed image not supported\n");
+    }
+    if ((total + zip->block - 1) / zip->block >= ZIP_PLAIN) EXIT("Compressed image error\n");
+
+    zip->blocks = (total + zip->block - 1) / zip->block;
+    if (ZIP_HEADER + ((U64)zip->blocks + 1) * 4 > image->size) EXIT("Compressed image error\n");
+    zip->index = (unsigned int*)Memory(zip->blocks + 1, sizeof(unsigned int));
+    PRead(image, ZIP_HEADER, (char*)zip->index, ((U64)zip->blocks + 1) * 4);
+
+    end = (U64)(zip->index[zip->blocks] & ~ZIP_PLAIN) << zip->align;
+    if (end > image->size) EXIT("Compressed image error\n");
+
+    printf("- %s%s image, %u-byte blocks\n", label, zip->format == ZIP_CSO ? "CSO" : "ZSO", zip->block);
+
+    // the image is read as the uncompressed data
+    image->zip = zip;
+    image->size = total;
+}
+
+/*----------------------------------------------------------------------------*/
+void ZipClose(IMAGE* image) {
+    if (image->zip == NULL) return;
+
+    free(image->zip->index);
+    free(image->zip);
+    image->zip = NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+void ZipRead(IMAGE* image, U64 position, char* buffer, U64 length) {
+    ZIP*           zip;
+    unsigned char* packed, * block, * data;
+    U64            start, end, offset, size, from, low, high;
+    unsigned int   first, last, count, done, b;
+
+    if (!length) return;
+    if (position + length > image->size) EXIT("Read past the end\n");
+
+    zip = image->zip;
+
+    // the compressed blocks are read at once
+    first = position / zip->block;
+    last = (position + length - 1) / zip->block;
+    start = (U64)(zip->index[first] & ~ZIP_PLAIN) << zip->align;
+    end = (U64)(zip->index[last + 1] & ~ZIP_PLAIN) << zip->align;
+    if ((end < start) || (end > zip->size)) EXIT("Compressed image error\n");
+
+    packed = (unsigned char*)Memory(end - start + 1, sizeof(char));
+    PRead(image, start, (char*)packed, end - start);
+    block = (unsigned char*)Memory(zip->block, sizeof(char));
+
+#ifdef HAVE_ZLIB
+    z_stream z;
+    int      result;
+
+    memset(&z, 0, sizeof(z));
+    if ((zip->format == ZIP_CSO) && (inflateInit2(&z, -15) != Z_OK)) EXIT("Memory error\n");
+#endif
+
+    for (b = first; b <= last; b++) {
+        offset = ((U64)(zip->index[b] & ~ZIP_PLAIN) << zip->align) - start;
+        size = ((U64)(zip->index[b + 1] & ~ZIP_PLAIN) << zip->align) - start;
+        if (size < offset) EXIT("Compressed image error\n");
+        size -= offset;
+
+        // the last block can be shorter, the padding after the data is
+        // not decoded
+        from = (U64)b * zip->block;
+        count = image->size - from > zip->block ? zip->block : image->size - from;
+
+        if (zip->index[b] & ZIP_PLAIN) {
+            done = size >= count ? count : 0;
+            data = packed + offset;
+        }
+        else if (zip->format == ZIP_ZSO) {
+            done = LZ4Decode(packed + offset, size, block, count);
+            data = block;
+        }
+        else {
+            done = 0;
+#ifdef HAVE_ZLIB
+            inflateReset(&z);
+            z.next_in = packed + offset;
+            z.avail_in = size;
+            z.next_out = block;
+            z.avail_out = count;
+            result = inflate(&z, Z_FINISH);
+            if ((result >= 0) || (result == Z_BUF_ERROR)) done = count - z.avail_out;
+#endif
+            data = block;
+        }
+        if (done != count) EXIT("Compressed image error\n");
+
+        low = position > from ? position : from;
+        high = position + length < from + count ? position + length : from + count;
+        memcpy(buffer + (low - position), data + (low - from), high - low);
+    }
+
+#ifdef HAVE_ZLIB
+    if (zip->format == ZIP_CSO) inflateEnd(&z);
+#endif
+
+    free(block);
+    free(packed);
+}
+
+/*----------------------------------------------------------------------------*/
+void ZipWrite(IMAGE* image, char* filename) {
+    PATCH*         patch;
+    ZIP*           zip;
+    IMAGE          file, packed;
+    EXTENT*        data, * copies;
+    unsigned char  header[ZIP_HEADER];
+    unsigned char* in, * out;
+    unsigned int*  index, * sizes;
+    unsigned int   ndata, ncopies, blocks, bound, batch, last, old, next, copied, encoded;
+    unsigned int   b, c, i, k;
+    U64            offset, start, end, mask;
+
+    patch = image->patch;
+    zip = patch->source->zip;
+
+    // the copies of the old image, without the new data
+    PatchSplit(patch, &data, &ndata, &copies, &ncopies);
+    free(data);
+
+    blocks = (image->size + zip->block - 1) / zip->block;
+    index = (unsigned int*)Memory(blocks + 1, sizeof(unsigned int));
+    bound = ZipBound(zip);
+    mask = ((U64)1 << zip->align) - 1;
+
+    // the compressed file of the old image, its blocks are copied as they are
+    packed = *patch->source;
+    packed.zip = NULL;
+    packed.size = zip->size;
+
+    // the same header with the new size
+    PRead(&packed, 0, (char*)header, ZIP_HEADER);
+    *(U64*)(header + 0x08) = image->size;
+
+    Open(&file, filename, IMAGE_CREATE);
+    PWrite(&file, 0, (char*)header, ZIP_HEADER);
+    offset = (ZIP_HEADER + ((U64)blocks + 1) * 4 + mask) & ~mask;
+
+    // the changed blocks are compressed in batches of the same bytes for
+    // any block size, at least a block
+    batch = ZIP_BATCH / zip->block;
+    if (batch < 1) batch = 1;
+    in = (unsigned char*)calloc((size_t)batch * zip->block, sizeof(char));
+    out = (unsigned char*)calloc((size_t)batch * bound, sizeof(char));
+    sizes = (unsigned int*)calloc(batch, sizeof(unsigned int));
+    if ((in == NULL) || (out == NULL) || (sizes == NULL)) EXIT("Memory error\n");
+
+    copied = encoded = 0;
+    k = 0;
+    for (b = 0; b < blocks; b = c) {
+        old = ZipCopied(zip, copies, ncopies, &k, b, image->size, patch->source->size);
+
+        if (old != NONE) {
+            // the next old blocks in a single copy, their positions are
+            // moved as a whole
+            for (c = b + 1, next = old + 1; c < blocks; c++, next++) {
+                if (ZipCopied(zip, copies, ncopies, &k, c, image->size, patch->source->size) != next) break;
+            }
+
+            start = (U64)(zip->index[old] & ~ZIP_PLAIN) << zip->align;
+            end = (U64)(zip->index[next] & ~ZIP_PLAIN) << zip->align;
+            for (i = 0; i < c - b; i++) {
+                index[b + i] = ((((U64)(zip->index[old + i] & ~ZIP_PLAIN) << zip->align) - start + offset) >> zip->align) | (zip->index[old + i] & ZIP_PLAIN);
+            }
+            CopyData(&packed, start, &file, offset, end - start);
+            offset += end - start;
+            copied += c - b;
+        }
+        else {
+            // the changed blocks, compressed by all the cores
+            for (c = b + 1; (c < blocks) && (c - b < batch); c++) {
+                if (ZipCopied(zip, copies, ncopies, &k, c, image->size, patch->source->size) != NONE) break;
+            }
+
+            last = image->size - (U64)(c - 1) * zip->block > zip->block ? zip->block : image->size - (U64)(c - 1) * zip->block;
+            ReadData(image, (U64)b * zip->block, (char*)in, (U64)(c - b - 1) * zip->block + last);
+            ZipEncode(zip, in, c - b, last, out, sizes);
+
+            for (i = 0; i < c - b; i++) {
+                index[b + i] = (offset >> zip->align) | (sizes[i] & ZIP_PLAIN);
+                PWrite(&file, offset, (char*)out + (U64)i * bound, sizes[i] & ~ZIP_PLAIN);
+                offset = (offset + (sizes[i] & ~ZIP_PLAIN) + mask) & ~mask;
+            }
+            encoded += c - b;
+        }
+
+        if ((offset >> zip->align) >= ZIP_PLAIN) EXIT("Compressed image too large\n");
+    }
+    index[blocks] = offset >> zip->align;
+
+    PWrite(&file, ZIP_HEADER, (char*)index, ((U64)blocks + 1) * 4);
+    if (file.size < offset) Truncate(&file, offset);
+    Close(&file);
+
+    printf("- %s%u block%s copied, %u compressed\n", label, copied, copied == 1 ? "" : "s", encoded);
+
+    free(sizes);
+    free(out);
+    free(in);
+    free(index);
+    free(copies);
+}
+
+/*----------------------------------------------------------------------------*/
+unsigned int ZipCopied(ZIP* zip, EXTENT* copies, unsigned int ncopies, unsigned int* k, unsigned int block, U64 size, U64 old_size) {
+    EXTENT* copy;
+    U64     position, length, source;
+
+    position = (U64)block * zip->block;
+    length = size - position > zip->block ? zip->block : size - position;
+
+    // the copy with the block, the blocks are checked in order
+    while ((*k < ncopies) && (copies[*k].position + copies[*k].length <= position)) (*k)++;
+    if (*k == ncopies) return(NONE);
+
+    copy = &copies[*k];
+    if ((copy->position > position) || (copy->position + copy->length < position + length)) return(NONE);
+
+    // a whole old block, with the same length
+    source = copy->source + position - copy->position;
+    if (source % zip->block) return(NONE);
+    if ((old_size - source > zip->block ? zip->block : old_size - source) != length) return(NONE);
+
+    return(source / zip->block);
+}
+
+/*----------------------------------------------------------------------------*/
+void ZipEncode(ZIP* zip, unsigned char* data, unsigned int blocks, unsigned int last, unsigned char* out, unsigned int* sizes) {
+    std::thread* threads;
+    unsigned int count, step, i;
+
+    // the blocks are split between the cores
+    count = std::thread::hardware_concurrency();
+    if (count > blocks / ZIP_BLOCKS) count = blocks / ZIP_BLOCKS;
+    if (count <= 1) {
+        ZipEncodeBlocks(zip, data, blocks, last, out, sizes);
+        return;
+    }
+
+    step = (blocks + count - 1) / count;
+
+    threads = new std::thread[count];
+    for (i = 0; i < count; i++) {
+        threads[i] = std::thread(
+            ZipEncodeBlocks, zip, data + (U64)i * step * zip->block,
+            (i + 1) * step > blocks ? blocks - i * step : step,
+            (i + 1) * step >= blocks ? last : zip->block,
+            out + (U64)i * step * ZipBound(zip), sizes + i * step
+        );
+    }
+    for (i = 0; i < count; i++) threads[i].join();
+    delete[] threads;
+}
+
+/*----------------------------------------------------------------------------*/
+void ZipEncodeBlocks(ZIP* zip, unsigned char* data, unsigned int blocks, unsigned int last, unsigned char* out, unsigned int* sizes) {
+    unsigned char* src, * dst;
+    unsigned int   bound, length, size, i;
+
+    bound = ZipBound(zip);
+
+#ifdef HAVE_ZLIB
+    z_stream z;
+    int      ready;
+
+    // raw deflate, the best level as the images are archived
+    memset(&z, 0, sizeof(z));
+    ready = (zip->format == ZIP_CSO) && (deflateInit2(&z, 9, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+#endif
+
+    for (i = 0; i < blocks; i++) {
+        length = i + 1 < blocks ? zip->block : last;
+        src = data + (U64)i * zip->block;
+        dst = out + (U64)i * bound;
+
+        size = 0;
+        if (zip->format == ZIP_ZSO) {
+            size = LZ4Encode(src, length, dst, bound);
+        }
+#ifdef HAVE_ZLIB
+        else if (ready) {
+            deflateReset(&z);
+            z.next_in = src;
+            z.avail_in = length;
+            z.next_out = dst;
+            z.avail_out = bound;
+            if (deflate(&z, Z_FINISH) == Z_STREAM_END) size = bound - z.avail_out;
+        }
+#endif
+
+        // stored if it does not get smaller
+        if (!size || (size >= length)) {
+            memcpy(dst, src, length);
+            size = length | ZIP_PLAIN;
+        }
+        sizes[i] = size;
+    }
+
+#ifdef HAVE_ZLIB
+    if (ready) deflateEnd(&z);
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+unsigned int ZipBound(ZIP* zip) {
+    // worst case of deflate and LZ4 for a block
+    return(zip->block + (zip->block >> 3) + 64);
+}
+
+/*----------------------------------------------------------------------------*/
+unsigned int LZ4Encode(unsigned char* src, unsigned int length, unsigned char* dst, unsigned int size) {
+    unsigned int   table[4096];
+    unsigned char* ip, * anchor, * end, * limit, * ref, * op, * token;
+    unsigned int   sequence, literals, match, distance, h, n;
+
+    // LZ4 block: the matches start 12 bytes before the end at most and the
+    // last 5 bytes are literals
+    memset(table, 0, sizeof(table));
+    ip = anchor = src;
+    end = src + length;
+    limit = length > 12 ? end - 12 : src;
+    op = dst;
+
+    while (ip < limit) {
+        memcpy(&sequence, ip, 4);
+        h = (sequence * 2654435761U) >> 20;
+        ref = src + table[h];
+        table[h] = ip - src;
+
+        if ((ref >= ip) || (ip - ref > 0xFFFF) || memcmp(ref, ip, 4)) {
+            ip++;
+            continue;
+        }
+
+        for (match = 4; (ip + match < end - 5) && (ip[match] == ref[match]); match++);
+
+        literals = ip - anchor;
+        if (op + 1 + literals / 255 + 1 + literals + 2 + (match - 4) / 255 + 1 > dst + size) return(0);
+
+        token = op++;
+        if (literals >= 15) {
+            *token = 15 << 4;
+            for (n = literals - 15; n >= 255; n -= 255) *op++ = 255;
+            *op++ = n;
+        }
+        else {
+            *token = literals << 4;
+        }
+        memcpy(op, anchor, literals);
+        op += literals;
+
+        distance = ip - ref;
+        *op++ = distance;
+        *op++ = distance >> 8;
+
+        if (match - 4 >= 15) {
+            *token |= 15;
+            for (n = match - 4 - 15; n >= 255; n -= 255) *op++ = 255;
+            *op++ = n;
+        }
+        else {
+            *token |= match - 4;
+        }
+
+        ip += match;
+        anchor = ip;
+    }
+
+    // the last literals
+    literals = end - anchor;
+    if (op + 1 + literals / 255 + 1 + literals > dst + size) return(0);
+
+    token = op++;
+    if (literals >= 15) {
+        *token = 15 << 4;
+        for (n = literals - 15; n >= 255; n -= 255) *op++ = 255;
+        *op++ = n;
+    }
+    else {
+        *token = literals << 4;
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+
+    return(op - dst);
+}
+
+/*----------------------------------------------------------------------------*/
+unsigned int LZ4Decode(unsigned char* src, unsigned int length, unsigned char* dst, unsigned int size) {
+    unsigned char* ip, * end, * op, * ref;
+    unsigned int   token, literals, match, distance, n;
+
+    ip = src;
+    end = src + length;
+    op = dst;
+
+    while (ip < end) {
+        token = *ip++;
+
+        literals = token >> 4;
+        if (literals == 15) {
+            do {
+                if (ip >= end) return(0);
+                n = *ip++;
+                literals += n;
+            } while (n == 255);
+        }
+        if ((literals > (unsigned int)(end - ip)) || (literals > size - (unsigned int)(op - dst))) return(0);
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+
+        // the block is full after the last literals, the rest is padding
+        if ((op == dst + size) || (ip >= end)) break;
+
+        if (end - ip < 2) return(0);
+        distance = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (!distance || (distance > (unsigned int)(op - dst))) return(0);
+
+        match = token & 15;
+        if (match == 15) {
+            do {
+                if (ip >= end) return(0);
+                n = *ip++;
+                match += n;
+            } while (n == 255);
+        }
+        match += 4;
+        if (match > size - (unsigned int)(op - dst)) return(0);
+
+        // byte by byte, the match can overlap its copy
+        for (ref = op - distance; match--; ) *op++ = *ref++;
+    }
+
+    return(op - dst);
+}
+
+/*----------------------------------------------------------------------------*/
+void List(char* isoname, char* pattern) {
+    VOLUME       volume;
+    ENTRY*       entry;
+    char*        path, * glob;
+    unsigned int files, folders, i;
+
+    VolumeOpen(&volume, isoname, IMAGE_READ);
+
+    glob = pattern != NULL ? Normalize(pattern) : NULL;
+
+    // 'lba size path' per record, in the order of the folders, a
+    // multi-extent file once with the size of all its extents
+    files = folders = 0;
+    for (i = 0; i < volume.index.count; i++) {
+        entry = &volume.index.entries[i];
+        if ((entry->path == NONE) || !entry->extents) continue;
+
+        path = volume.index.paths + entry->path;
+        if ((glob != NULL) && !Selected(glob, path)) continue;
+
+        printf("%10u %10llu %s%s\n", entry->lba, Length(entry), path, entry->flags & 0x02 ? "/" : "");
+        if (entry->flags & 0x02) folders++; else files++;
+    }
+
+    printf("- %u file%s, %u folder%s\n", files, files == 1 ? "" : "s", folders, folders == 1 ? "" : "s");
+
+    free(glob);
+
+    if (stats) Stats(&volume.iso);
+
+    VolumeClose(&volume);
+}
+
+/*----------------------------------------------------------------------------*/
+void Extract(char* isoname, char* folder, char* pattern) {
+    VOLUME       volume;
+    IMAGE*       iso;
+    EXTRACT      work;
+    OUTPUT*      outputs, * output, ** order;
+    BLOCK*       block;
+    PIECE        piece;
+    ENTRY*       entry;
+    std::thread* threads;
+    char*        path, * glob, * name, * last;
+    unsigned int count, sectors, need, end, lba, blba, bcount, n;
+    unsigned int i, j, k, s;
+    U64          total_sectors, bytes;
+
+    VolumeOpen(&volume, isoname, IMAGE_READ);
+    iso = &volume.iso;
+    total_sectors = iso->size / iso->sector_size;
+
+    glob = pattern != NULL ? Normalize(pattern) : NULL;
+
+    // the selected files, once per path
+    outputs = new OUTPUT[volume.index.count + 1];
+    count = 0;
+    for (i = 0; i < volume.index.count; i++) {
+        entry = &volume.index.entries[i];
+        if ((entry->path == NONE) || (entry->flags & 0x02)) continue;
+
+        path = volume.index.paths + entry->path;
+        if ((glob != NULL) && !Selected(glob, path)) continue;
+        if (Search(&volume.index, path) != entry) continue;
+
+        // nothing is written out of the folder
+        if (!Contained(path)) {
+            printf("- %s: name out of the folder, skipped\n", path);
+            continue;
+        }
+
+        // the extents of a file are read as a single one
+        if (!Contiguous(iso, entry)) {
+            printf("- %s: extents not contiguous, skipped\n", path);
+            continue;
+        }
+        sectors = (Length(entry) + iso->sector_data - 1) / iso->sector_data;
+        if ((U64)entry->lba + sectors > total_sectors) {
+            printf("- %s: data after the end of the image, skipped\n", path);
+            continue;
+        }
+
+        output = &outputs[count++];
+        output->entry = entry;
+        output->size = Length(entry);
+        output->name = Memory(StrLen(folder) + StrLen(path) + 1, sizeof(char));
+        sprintf(output->name, "%s%s", folder, path);
+        output->pending = 0;
+    }
+
+    // the folders of the files, in the order of the folder tree
+    Phase("creating folders");
+
+    Folder(folder);
+    last = Memory(StrLen(folder) + MAX_PATH + 1, sizeof(char));
+    for (i = 0; i < count; i++) {
+        name = outputs[i].name;
+        k = StrLen(name);
+        while (name[k] != '/') k--;
+        if (!strncmp(last, name, k) && (last[k] == '\0')) continue;
+
+        // every level, the previous ones can exist
+        for (j = StrLen(folder) + 1; j <= k; j++) {
+            if (name[j] != '/') continue;
+            name[j] = '\0';
+            Folder(name);
+            name[j] = '/';
+        }
+        memcpy(last, name, k);
+        last[k] = '\0';
+    }
+    free(last);
+
+    // the data in the order of the image, read in large blocks and written
+    // by the workers
+    Phase("extracting %u file%s", count, count == 1 ? "" : "s");
+
+    order = (OUTPUT**)Memory(count + 1, sizeof(OUTPUT*));
+    for (i = 0; i < count; i++) order[i] = &outputs[i];
+    qsort(order, count, sizeof(OUTPUT*), CompareOutput);
+
+    work.iso = iso;
+    work.first = work.count = 0;
+    work.max = 1024;
+    work.queue = (PIECE*)Memory(work.max, sizeof(PIECE));
+    work.blocks = 0;
+    work.done = 0;
+    work.failed = 0;
+
+    threads = new std::thread[queue_depth];
+    for (i = 0; i < queue_depth; i++) threads[i] = std::thread(ExtractWorker, &work);
+
+    block = NULL;
+    blba = bcount = 0;
+    bytes = 0;
+    try {
+        for (i = 0; (i < count) && !work.failed; i++) {
+            output = order[i];
+            entry = output->entry;
+            sectors = (output->size + iso->sector_data - 1) / iso->sector_data;
+
+            // the reader keeps the file open until all its pieces are queued
+            Open(&output->file, output->name, IMAGE_CREATE);
+            output->pending = 1;
+
+            // the final size, the writers of the pieces only read it
+            output->file.size = output->size;
+
+            for (s = 0; (s < sectors) && !work.failed; s += n) {
+                lba = entry->lba + s;
+
+                if ((block == NULL) || (lba < blba) || (lba >= blba + bcount)) {
+                    if (block != NULL) ExtractBlock(&work, block);
+
+                    // the blocks in memory are limited as the copy engine
+                    {
+                        std::unique_lock<std::mutex> lock(work.lock);
+                        while ((work.blocks >= queue_depth) && !work.failed) work.space.wait(lock);
+                        work.blocks++;
+                    }
+
+                    // up to the end of the last file starting in the block,
+                    // the small gaps between files are read through
+                    end = total_sectors - lba > block_sectors ? lba + block_sectors : total_sectors;
+                    need = lba + sectors - s;
+                    for (j = i + 1; (j < count) && (order[j]->entry->lba < end); j++) {
+                        k = order[j]->entry->lba + (order[j]->size + iso->sector_data - 1) / iso->sector_data;
+                        if (k > need) need = k;
+                    }
+                    if (need < end) end = need;
+
+                    blba = lba;
+                    bcount = end - lba;
+                    block = new BLOCK;
+                    block->users = 1;
+                    block->buffer = NULL;
+                    block->buffer = Aligned((U64)bcount * iso->sector_size);
+                    ReadData(iso, (U64)blba * iso->sector_size, block->buffer, (U64)bcount * iso->sector_size);
+                }
+
+                n = blba + bcount - lba;
+                if (n > sectors - s) n = sectors - s;
+
+                piece.output = output;
+                piece.block = block;
+                piece.offset = (U64)s * iso->sector_data;
+                piece.sector = lba - blba;
+                piece.length = output->size - piece.offset > (U64)n * iso->sector_data ? n * iso->sector_data : output->size - piece.offset;
+                block->users++;
+                output->pending++;
+                ExtractQueue(&work, &piece);
+            }
+
+            bytes += output->size;
+            ExtractOutput(output);
+        }
+    }
+    catch (...) {
+        ExtractFail(&work);
+    }
+
+    if (block != NULL) ExtractBlock(&work, block);
+
+    {
+        std::unique_lock<std::mutex> lock(work.lock);
+        work.done = 1;
+        work.ready.notify_all();
+    }
+    for (i = 0; i < queue_depth; i++) threads[i].join();
+    delete[] threads;
+
+    free(work.queue);
+    for (i = 0; i < count; i++) free(outputs[i].name);
+    delete[] outputs;
+    free(order);
+    free(glob);
+
+    // the library errors are exceptions, thrown again in this thread
+    if (work.failed) std::rethrow_exception(work.error);
+
+    printf("- %llu bytes extracted\n", bytes);
+
+    if (stats) Stats(iso);
+
+    VolumeClose(&volume);
+}
+
+/*----------------------------------------------------------------------------*/
+void ExtractQueue(EXTRACT* work, PIECE* piece) {
+    std::unique_lock<std::mutex> lock(work->lock);
+    PIECE*       queue;
+    unsigned int i;
+
+    if (work->count == work->max) {
+        queue = (PIECE*)malloc(2 * work->max * sizeof(PIECE));
+        if (queue == NULL) EXIT("Memory error\n");
+        for (i = 0; i < work->count; i++) queue[i] = work->queue[(work->first + i) % work->max];
+        free(work->queue);
+        work->queue = queue;
+        work->first = 0;
+        work->max <<= 1;
+    }
+
+    work->queue[(work->first + work->count++) % work->max] = *piece;
+    work->ready.notify_one();
+}
+
+/*----------------------------------------------------------------------------*/
+void ExtractWorker(EXTRACT* work) {
+    PIECE        piece;
+    IMAGE*       iso;
+    char*        data;
+    unsigned int i, length;
+
+    iso = work->iso;
+    data = Memory(block_sectors * iso->sector_data, sizeof(char));
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(work->lock);
+            while (!work->count && !work->done) work->ready.wait(lock);
+            if (!work->count) break;
+            piece = work->queue[work->first];
+            work->first = (work->first + 1) % work->max;
+            work->count--;
+        }
+
+        // the user data of the raw sectors is joined before written, after
+        // an error the pieces are only released
+        try {
+            if (!work->failed) {
+                if (iso->sector_size == iso->sector_data) {
+                    PWrite(&piece.output->file, piece.offset, piece.block->buffer + (U64)piece.sector * iso->sector_size, piece.length);
+                }
+                else {
+                    for (i = 0; i * iso->sector_data < piece.length; i++) {
+                        length = piece.length - i * iso->sector_data;
+                        if (length > iso->sector_data) length = iso->sector_data;
+                        memcpy(data + i * iso->sector_data, piece.block->buffer + (U64)(piece.sector + i) * iso->sector_size + iso->data_offset, length);
+                    }
+                    PWrite(&piece.output->file, piece.offset, data, piece.length);
+                }
+            }
+            ExtractOutput(piece.output);
+        }
+        catch (...) {
+            ExtractFail(work);
+        }
+
+        ExtractBlock(work, piece.block);
+    }
+
+    free(data);
+}
+
+/*----------------------------------------------------------------------------*/
+void ExtractBlock(EXTRACT* work, BLOCK* block) {
+    // the last piece of the block releases it
+    if (--block->users) return;
+
+    AlignedFree(block->buffer);
+    delete block;
+
+    std::unique_lock<std::mutex> lock(work->lock);
+    work->blocks--;
+    work->space.notify_one();
+}
+
+/*----------------------------------------------------------------------------*/
+void ExtractOutput(OUTPUT* output) {
+    // the last piece of the file closes it
+    if (--output->pending) return;
+
+    Close(&output->file);
+}
+
+/*----------------------------------------------------------------------------*/
+void ExtractFail(EXTRACT* work) {
+    std::unique_lock<std::mutex> lock(work->lock);
+
+    // the first error is kept, the reader stops at the next piece
+    if (!work->failed.exchange(1)) work->error = std::current_exception();
+    work->space.notify_all();
+}
+
+/*----------------------------------------------------------------------------*/
+int Selected(char* pattern, char* path) {
+    char buffer[MAX_PATH];
+    int  i;
+
+    // the path or any of its folders
+    strcpy(buffer, path);
+    for (i = StrLen(buffer); i > 0; i--) {
+        if ((buffer[i] != '\0') && (buffer[i] != '/')) continue;
+        buffer[i] = '\0';
+        if (Match(pattern, buffer)) return(1);
+    }
+
+    return(0);
+}
+
+/*----------------------------------------------------------------------------*/
+int Contained(char* path) {
+    char* next;
+
+    // every name of the path after a '/', none goes up or out
+    if (*path != '/') return(0);
+    do {
+        next = strchr(++path, '/');
+        if (!ValidName(path, next != NULL ? next - path : StrLen(path))) return(0);
+        path = next;
+    } while (path != NULL);
+
+    return(1);
+}
+
+/*----------------------------------------------------------------------------*/
+int Match(char* pattern, char* text) {
+    char* star, * back;
+
+    // '*' any characters, '?' one character, case insensitive as the
+    // ISO9660 names are uppercase
+    star = back = NULL;
+    while (*text) {
+        if ((*pattern == '?') || ((*pattern != '*') && (toupper((unsigned char)*pattern) == toupper((unsigned char)*text)))) {
+            pattern++; text++;
+        }
+        else if (*pattern == '*') {
+            star = ++pattern; back = text;
+        }
+        else if (star != NULL) {
+            pattern = star; text = ++back;
+        }
+        else {
+            return(0);
+        }
+    }
+    while (*pattern == '*') pattern++;
+
+    return(!*pattern);
+}
+
+/*----------------------------------------------------------------------------*/
+void Folder(char* name) {
+#ifdef _WIN32
+    if (!CreateDirectoryA(name, NULL) && (GetLastError() != ERROR_ALREADY_EXISTS)) EXIT("Folder create error\n");
+#else
+    if (mkdir(name, 0755) && (errno != EEXIST)) EXIT("Folder create error\n");
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+int CompareOutput(const void* a, const void* b) {
+    ENTRY* x = (*(OUTPUT**)a)->entry;
+    ENTRY* y = (*(OUTPUT**)b)->entry;
+
+    if (x->lba != y->lba) return(x->lba < y->lba ? -1 : 1);
+    if (x->position != y->position) return(x->position < y->position ? -1 : 1);
+    return(0);
+}
+
+/*----------------------------------------------------------------------------*/
+CHANGE* Manifest(char* filename, int* count) {
+    IMAGE   list;
+    CHANGE* changes;
+    char*   buffer, * line, * next;
+    int     max;
+
+    // load the list as a text
+    Open(&list, filename, IMAGE_READ);
+    buffer = Memory(list.size + 1, sizeof(char));
+    PRead(&list, 0, buffer, list.size);
+    Close(&list);
+
+    *count = 0;
+    max = 64;
+    changes = (CHANGE*)Memory(max, sizeof(CHANGE));
+
+    for (line = buffer; *line; line = next) {
+        // split the lines
+        for (next = line; *next && (*next != '\n') && (*next != '\r'); next++);
+        while ((*next == '\n') || (*next == '\r')) *next++ = '\0';
+
+        // skip blank lines and comments
+        while ((*line == ' ') || (*line == '\t')) line++;
+        if (!*line || (*line == '#') || (*line == ';')) continue;
+
+        if (*count == max) {
+            max <<= 1;
+            changes = (CHANGE*)realloc(changes, max * sizeof(CHANGE));
+            if (changes == NULL) EXIT("Memory error\n");
+        }
+
+        // 'filename' has no spaces, 'newfile' is the rest of the line
+        memset(&changes[*count], 0, sizeof(CHANGE));
+        changes[*count].oldname = line;
+        while (*line && (*line != ' ') && (*line != '\t')) line++;
+        while ((*line == ' ') || (*line == '\t')) *line++ = '\0';
+        if (!*line) EXIT("Manifest line without new file\n");
+        changes[*count].newname = line;
+        for (line += StrLen(line); (line[-1] == ' ') || (line[-1] == '\t'); line--) line[-1] = '\0';
+
+        (*count)++;
+    }
+
+    if (!*count) EXIT("Empty manifest\n");
+
+    // 'buffer' holds the names until the end
+    return(changes);
+}
+
+/*----------------------------------------------------------------------------*/
+int Compare(const void* a, const void* b) {
+    CHANGE* x = (CHANGE*)a;
+    CHANGE* y = (CHANGE*)b;
+
+    if (x->file_lba != y->file_lba) return(x->file_lba < y->file_lba ? -1 : 1);
+    if (x->position != y->position) return(x->position < y->position ? -1 : 1);
+    return(0);
+}
+
+/*----------------------------------------------------------------------------*/
+int ShiftLBA(CHANGE* changes, int count, unsigned int lba, U64 position) {
+    int lo, hi, mid;
+
+    // a record is moved by every replaced file before it, a 0-bytes file
+    // with the same LBA is before it if its record is before
+    lo = 0; hi = count;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if ((changes[mid].file_lba < lba) || ((changes[mid].file_lba == lba) && (changes[mid].position < position))) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return(lo ? changes[lo - 1].shift + changes[lo - 1].diff : 0);
+}
+
+/*----------------------------------------------------------------------------*/
+int ShiftSector(CHANGE* changes, int count, U64 lba) {
+    int lo, hi, mid;
+
+    // a sector is moved by every replaced file ending before it
+    lo = 0; hi = count;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (changes[mid].file_lba + changes[mid].old_sectors <= lba) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return(lo ? changes[lo - 1].shift + changes[lo - 1].diff : 0);
+}
+
+/*----------------------------------------------------------------------------*/
+unsigned int Place(IMAGE* iso, IMAGE* out, INDEX* index, CHANGE* changes, int count, unsigned int* tables, unsigned int tbl_len, unsigned int total_sectors) {
+    GAP*          gaps;
+    ENTRY*        entry;
+    CHANGE*       change;
+    unsigned int  start, end, lba, sectors, best;
+    unsigned int  i;
+    int           ngaps, max, shared;
+    int           j, k;
+
+    // the used sectors: path tables and file/folder data
+    max = index->count + 4 + 1;
+    gaps = (GAP*)Memory(max, sizeof(GAP));
+    ngaps = 0;
+    for (i = 0; i < 4; i++) {
+        if (!tables[i]) continue;
+        gaps[ngaps].lba = tables[i];
+        gaps[ngaps++].sectors = (tbl_len + iso->sector_data - 1) / iso->sector_data;
+    }
+    for (i = 0; i < index->count; i++) {
+        entry = &index->entries[i];
+        if (!entry->size) continue;
+        gaps[ngaps].lba = entry->lba;
+        gaps[ngaps++].sectors = (entry->size + iso->sector_data - 1) / iso->sector_data;
+    }
+    qsort(gaps, ngaps, sizeof(GAP), CompareGap);
+
+    // the free sectors between them, nothing before the first path table or
+    // folder (system area, volume descriptors, UDF anchor)
+    end = ngaps ? gaps[0].lba : total_sectors;
+    k = 0;
+    for (j = 0; j < ngaps; j++) {
+        start = end;
+        if (gaps[j].lba > start) {
+            lba = gaps[j].lba;
+            sectors = gaps[j].sectors;
+            gaps[k].lba = start;
+            gaps[k++].sectors = lba - start;
+            end = lba + sectors;
+        }
+        else if (gaps[j].lba + gaps[j].sectors > end) {
+            end = gaps[j].lba + gaps[j].sectors;
+        }
+    }
+    if (end < total_sectors) {
+        gaps[k].lba = end;
+        gaps[k++].sectors = total_sectors - end;
+    }
+    ngaps = k;
+
+    // new data after the image
+    end = total_sectors > end ? total_sectors : end;
+
+    for (j = 0; j < count; j++) {
+        change = &changes[j];
+        change->new_lba = change->file_lba;
+
+        // old data shared by other records is not released
+        shared = 0;
+        for (i = 0; i < index->count; i++) {
+            entry = &index->entries[i];
+            if (entry->size && (entry->lba == change->file_lba) && (entry->position != change->position)) shared = 1;
+        }
+
+        // own sectors plus the free ones after them
+        sectors = change->old_sectors;
+        for (k = 0; k < ngaps; k++) {
+            if (gaps[k].lba == change->file_lba + change->old_sectors) break;
+        }
+        if (!shared && (change->new_sectors > sectors) && (k < ngaps)) {
+            if (Zeroed(out, gaps[k].lba, change->new_sectors - sectors > gaps[k].sectors ? gaps[k].sectors : change->new_sectors - sectors)) {
+                sectors += gaps[k].sectors;
+            }
+        }
+
+        if (!shared && (change->new_sectors <= sectors)) {
+            // keep the LBA, take the free sectors needed
+            if (change->new_sectors > change->old_sectors) {
+                gaps[k].lba += change->new_sectors - change->old_sectors;
+                gaps[k].sectors -= change->new_sectors - change->old_sectors;
+            }
+            else if (change->new_sectors < change->old_sectors) {
+                Zero(out, change->file_lba + change->new_sectors, change->old_sectors - change->new_sectors);
+                Release(&gaps, &ngaps, &max, change->file_lba + change->new_sectors, change->old_sectors - change->new_sectors);
+            }
+            continue;
+        }
+
+        if (!change->new_sectors) {
+            // an empty file keeps the LBA, without data
+            lba = change->file_lba;
+        }
+        else {
+            // the smallest free gap with room for the new data
+            best = ngaps;
+            if (place == PLACE_GAP) {
+                for (k = 0; k < ngaps; k++) {
+                    if (gaps[k].sectors < change->new_sectors) continue;
+                    if ((best != (unsigned int)ngaps) && (gaps[k].sectors >= gaps[best].sectors)) continue;
+                    if (!Zeroed(out, gaps[k].lba, change->new_sectors)) continue;
+                    best = k;
+                }
+            }
+
+            if (best != (unsigned int)ngaps) {
+                lba = gaps[best].lba;
+                gaps[best].lba += change->new_sectors;
+                gaps[best].sectors -= change->new_sectors;
+            }
+            else {
+                lba = end;
+                end += change->new_sectors;
+            }
+        }
+        change->new_lba = lba;
+
+        // the old data is free now
+        if (!shared && change->old_sectors) {
+            Zero(out, change->file_lba, change->old_sectors);
+            Release(&gaps, &ngaps, &max, change->file_lba, change->old_sectors);
+        }
+
+        // keep the index in sync with the image
+        for (i = 0; i < index->count; i++) {
+            if (index->entries[i].position == change->position) index->entries[i].lba = lba;
+        }
+    }
+
+    free(gaps);
+
+    return(end);
+}
+
+/*----------------------------------------------------------------------------*/
+int CompareGap(const void* a, const void* b) {
+    GAP* x = (GAP*)a;
+    GAP* y = (GAP*)b;
+
+    if (x->lba != y->lba) return(x->lba < y->lba ? -1 : 1);
+    return(0);
+}
+
+/*----------------------------------------------------------------------------*/
+void Release(GAP** gaps, int* count, int* max, unsigned int lba, unsigned int sectors) {
+    GAP* gap;
+    int  i;
+
+    if (*count == *max) {
+        *max <<= 1;
+        *gaps = (GAP*)realloc(*gaps, *max * sizeof(GAP));
+        if (*gaps == NULL) EXIT("Memory error\n");
+    }
+    gap = *gaps;
+
+    // sorted insert, joined to the previous/next gaps
+    for (i = *count; i && (gap[i - 1].lba > lba); i--) gap[i] = gap[i - 1];
+    gap[i].lba = lba;
+    gap[i].sectors = sectors;
+    (*count)++;
+
+    if ((i + 1 < *count) && (gap[i].lba + gap[i].sectors == gap[i + 1].lba)) {
+        gap[i].sectors += gap[i + 1].sectors;
+        memmove(&gap[i + 1], &gap[i + 2], (*count - i - 2) * sizeof(GAP));
+        (*count)--;
+    }
+    if (i && (gap[i - 1].lba + gap[i - 1].sectors == gap[i].lba)) {
+        gap[i - 1].sectors += gap[i].sectors;
+        memmove(&gap[i], &gap[i + 1], (*count - i - 1) * sizeof(GAP));
+        (*count)--;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+int Zeroed(IMAGE* iso, U64 lba, U64 sectors) {
+    unsigned char* buffer, * sector;
+    unsigned int   count, i, j;
+
+    // unused sectors must be zero-filled, to not overwrite data unknown for
+    // the ISO9660 folders (UDF bridge, hidden data)
+    while (sectors) {
+        count = sectors >= BLOCKSIZE ? BLOCKSIZE : sectors;
+        if ((lba + count) * iso->sector_size > iso->size) return(0);
+
+        // only the user data of the raw sectors, a Form 2 sector is in use
+        buffer = (unsigned char*)ReadSectors(iso, lba, count);
+        for (j = 0; j < count; j++) {
+            sector = buffer + j * iso->sector_size;
+            if ((iso->mode == MODE_M2) && (sector[0x012] & 0x20)) break;
+            for (i = 0; (i < iso->sector_data) && !sector[iso->data_offset + i]; i++);
+            if (i != iso->sector_data) break;
+        }
+        AlignedFree((char*)buffer);
+        if (j != count) return(0);
+
+        lba += count; sectors -= count;
+    }
+
+    return(1);
+}
+
+/*----------------------------------------------------------------------------*/
+void Zero(IMAGE* iso, U64 lba, U64 sectors) {
+    unsigned char* buffer;
+    unsigned int   count;
+
+    count = sectors >= BLOCKSIZE ? BLOCKSIZE : sectors;
+    buffer = (unsigned char*)Aligned((U64)count * iso->sector_size);
+    memset(buffer, 0, (U64)count * iso->sector_size);
+    while (sectors) {
+        count = sectors >= BLOCKSIZE ? BLOCKSIZE : sectors;
+        Encode(iso, (char*)buffer, lba, count);
+        WriteSectors(iso, lba, (char*)buffer, count);
+        lba += count; sectors -= count;
+    }
+    AlignedFree((char*)buffer);
+}
+
+/*----------------------------------------------------------------------------*/
+void CopySectors(IMAGE* src, U64 lba, IMAGE* dst, U64 newlba, U64 sectors) {
+    char* buffer;
+    U64   count;
+
+    // the raw sectors have their address in the header, the moved ones are
+    // updated in userspace, or when a patch is applied
+    if ((src->mode != MODE_M0) && (lba != newlba) && ((dst->patch == NULL) || !dst->patch->relocate)) {
+        while (sectors) {
+            count = sectors >= BLOCKSIZE ? BLOCKSIZE : sectors;
+
+            buffer = ReadSectors(src, lba, count);
+            Relocate(dst, buffer, newlba, count);
+            WriteSectors(dst, newlba, buffer, count);
+            AlignedFree(buffer);
+
+            lba += count; newlba += count; sectors -= count;
+        }
+        return;
+    }
+
+    CopyData(src, lba * src->sector_size, dst, newlba * src->sector_size, sectors * src->sector_size);
+}
+
+/*----------------------------------------------------------------------------*/
+void CopyData(IMAGE* src, U64 position, IMAGE* dst, U64 newposition, U64 length) {
+    if (!length) return;
+
+    // a patch only records the copies of the old image, the new data is
+    // written to the sparse image
+    if (dst->patch != NULL) {
+        if (src == dst->patch->source) {
+            if (position + length > src->size) EXIT("Read past the end\n");
+            PatchAdd(dst, newposition, position, length);
+            if (newposition + length > dst->size) dst->size = newposition + length;
+            return;
+        }
+        PatchAdd(dst, newposition, PATCH_NEW, length);
+    }
+    if (dst->sectors != NULL) SectorDrop(dst, newposition, length);
+
+    // the holes of the source are not read, they are holes in the copy; a
+    // recorded image has holes in the copied ranges
+    if (sparse && (src->zip == NULL) && (src->patch == NULL)) {
+        U64 end, next;
+
+        if (position + length > src->size) EXIT("Read past the end\n");
+
+        for (end = position + length; position < end; position = next) {
+            next = SeekData(src, position, end);
+            if (next > position) {
+                Hole(dst, newposition, next - position);
+            }
+            else {
+                next = SeekHole(src, position, end);
+                CopyRange(src, position, dst, newposition, next - position);
+            }
+            newposition += next - position;
+        }
+        return;
+    }
+
+    CopyRange(src, position, dst, newposition, length);
+}
+
+/*----------------------------------------------------------------------------*/
+void CopyRange(IMAGE* src, U64 position, IMAGE* dst, U64 newposition, U64 length) {
+    char* buffer;
+    U64   count, done;
+
+    if (!length) return;
+
+    // read/write copy, also to decompress
+    if ((engine == ENGINE_SERIAL) || (src->zip != NULL)) {
+        while (length) {
+            count = length >= BLOCKSIZE * dst->sector_size ? BLOCKSIZE * dst->sector_size : length;
+
+            buffer = Read(src, position, count);
+            PWrite(dst, newposition, buffer, count);
+            AlignedFree(buffer);
+
+            position += count; newposition += count; length -= count;
+        }
+        return;
+    }
+
+    if (engine == ENGINE_AUTO) {
+        // share the filesystem blocks when both positions have the same
+        // alignment, the unaligned head and tail are copied
+        if ((dst->copy == COPY_CLONE) && (position % dst->block == newposition % dst->block)) {
+            U64 head, body;
+
+            head = (dst->block - position % dst->block) % dst->block;
+            if (head > length) head = length;
+            body = (length - head) / dst->block * dst->block;
+
+            if (body && CopyClone(src, position + head, dst, newposition + head, body)) {
+                CopyRange(src, position, dst, newposition, head);
+                position += head + body; newposition += head + body; length -= head + body;
+            }
+        }
+
+        // copy in the kernel, without going through userspace buffers, but
+        // the zero blocks of the data are only seen by the pipelined copy,
+        // and the kernel copy goes through the page cache
+        if ((dst->copy >= COPY_KERNEL) && !sparse && !direct) {
+            done = CopyKernel(src, position, dst, newposition, length);
+            position += done; newposition += done; length -= done;
+        }
+    }
+
+    // pipelined copy
+    CopyEngine(src, position, dst, newposition, length);
+}
+
+/*----------------------------------------------------------------------------*/
+U64 CopyClone(IMAGE* src, U64 position, IMAGE* dst, U64 newposition, U64 length) {
+#if defined(__linux__) && defined(FICLONERANGE)
+    struct file_clone_range range;
+
+    if (position + length > src->size) EXIT("Read past the end\n");
+
+    range.src_fd = src->fd;
+    range.src_offset = position;
+    range.src_length = length;
+    range.dest_offset = newposition;
+
+    if (!ioctl(dst->fd, FICLONERANGE, &range)) {
+        reads++; writes++;
+        read_bytes += length; write_bytes += length;
+        if (newposition + length > dst->size) dst->size = newposition + length;
+        return(length);
+    }
+
+    // not a CoW filesystem, or different filesystems: don't try it again
+    dst->copy = COPY_KERNEL;
+#else
+    dst->copy = COPY_KERNEL;
+#endif
+
+    return(0);
+}
+
+/*----------------------------------------------------------------------------*/
+U64 CopyKernel(IMAGE* src, U64 position, IMAGE* dst, U64 newposition, U64 length) {
+#ifdef __linux__
+    loff_t  in, out;
+    ssize_t count;
+    U64     done;
+
+    if (position + length > src->size) EXIT("Read past the end\n");
+
+    in = position;
+    out = newposition;
+    for (done = 0; done < length; done += count) {
+        count = copy_file_range(src->fd, &in, dst->fd, &out, length - done > IO_CHUNK ? IO_CHUNK : length - done, 0);
+        if (count <= 0) {
+            // not supported for these files, the rest with read/write
+            if ((count < 0) && (errno != ENOSYS) && (errno != EXDEV) && (errno != EINVAL) && (errno != EOPNOTSUPP)) {
+                EXIT("File copy error\n");
+            }
+            dst->copy = COPY_PLAIN;
+            break;
+        }
+
+        // a kernel copy is a read and a write
+        reads++; writes++;
+        read_bytes += count; write_bytes += count;
+    }
+
+    if (newposition + done > dst->size) dst->size = newposition + done;
+
+    return(done);
+#else
+    dst->copy = COPY_PLAIN;
+
+    return(0);
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+void CopyEngine(IMAGE* src, U64 position, IMAGE* dst, U64 newposition, U64 length) {
+    if (!length) return;
+
+    if (position + length > src->size) EXIT("Read past the end\n");
+
+    // set the new size now, the blocks are written in any order
+    if (newposition + length > dst->size) dst->size = newposition + length;
+
+    if (direct) {
+        // out of the page cache, the buffered copy drops its pages
+        if (CopyDirect(src, position, dst, newposition, length)) return;
+    }
+    else if ((engine != ENGINE_THREADS) && CopyUring(src, position, dst, newposition, length)) return;
+
+    CopyThreads(src, position, dst, newposition, length);
+}
+
+/*----------------------------------------------------------------------------*/
+int CopyDirect(IMAGE* src, U64 position, IMAGE* dst, U64 newposition, U64 length) {
+    char* buffer;
+    U64   head, body;
+
+    if ((src->direct < 0) || (dst->direct < 0)) return(0);
+
+    // the writes must be aligned, the unaligned head and tail are buffered
+    head = (ALIGNMENT - newposition % ALIGNMENT) % ALIGNMENT;
+    if (head > length) head = length;
+    body = (length - head) / ALIGNMENT * ALIGNMENT;
+    if (!body) return(0);
+
+    if (head) {
+        buffer = Read(src, position, head);
+        PWrite(dst, newposition, buffer, head);
+        AlignedFree(buffer);
+    }
+
+    CopyThreads(src, position + head, dst, newposition + head, body);
+
+    position += head + body; newposition += head + body; length -= head + body;
+    if (length) {
+        buffer = Read(src, position, length);
+        PWrite(dst, newposition, buffer, length);
+        AlignedFree(buffer);
+    }
+
+    return(1);
+}
+
+/*----------------------------------------------------------------------------*/
+int CopyUring(IMAGE* src, U64 position, IMAGE* dst, U64 newposition, U64 length) {
+#ifdef HAVE_URING
+    URING                ring;
+    struct io_uring_cqe* cqe;
+    struct iovec*        iov;
+    char**               buffers;
+    U64*                 sizes;
+    U64                  block, blocks, next, done, count;
+    unsigned int         free_count, head, tail;
+    unsigned int         i;
+    int*                 free_list;
+
+    // no io_uring in this kernel, or not allowed
+    if (!UringOpen(&ring, 2 * queue_depth)) return(0);
+
+    block = (U64)block_sectors * dst->sector_size;
+    blocks = (length + block - 1) / block;
+
+    // a ring of reusable buffers, each one read and then written
+    buffers = (char**)Memory(queue_depth, sizeof(char*));
+    sizes = (U64*)Memory(queue_depth, sizeof(U64));
+    iov = (struct iovec*)Memory(queue_depth, sizeof(struct iovec));
+    free_list = (int*)Memory(queue_depth, sizeof(int));
+    for (i = 0; i < queue_depth; i++) {
+        buffers[i] = Aligned(block);
+        free_list[i] = i;
+    }
+    free_count = queue_depth;
+
+    // user data: block number, buffer number and a write flag, as the blocks
+    // are completed in any order
+    for (next = done = 0; done < blocks; ) {
+        // read the next blocks in the free buffers
+        while (free_count && (next < blocks)) {
+            i = free_list[--free_count];
+            count = length - next * block > block ? block : length - next * block;
+            sizes[i] = count;
+            UringQueue(&ring, IORING_OP_READV, src->fd, buffers[i], count, position + next * block, (next << 9 | i) << 1, &iov[i]);
+            next++;
+        }
+
+        // submit the new requests and wait for one of them at least
+        UringSubmit(&ring, 1);
+
+        head = *ring.cq_head;
+        tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            cqe = &ring.cqes[head & *ring.cq_mask];
+            i = (cqe->user_data >> 1) & 0x1FF;
+            count = cqe->user_data >> 10;
+
+            if (!(cqe->user_data & 1)) {
+                // read done, write the block
+                if ((cqe->res < 0) || ((U64)cqe->res != sizes[i])) EXIT("File read error\n");
+                reads++; read_bytes += sizes[i];
+                Copied(dst, newposition + count * block, buffers[i], sizes[i]);
+                if (sparse && (sizes[i] >= dst->block) && Zeros(buffers[i], sizes[i])) {
+                    // a zero block is a hole, the buffer is free
+                    Hole(dst, newposition + count * block, sizes[i]);
+                    free_list[free_count++] = i;
+                    done++;
+                    continue;
+                }
+                UringQueue(&ring, IORING_OP_WRITEV, dst->fd, buffers[i], sizes[i], newposition + count * block, cqe->user_data | 1, &iov[i]);
+            }
+            else {
+                // write done, the buffer is free
+                if ((cqe->res < 0) || ((U64)cqe->res != sizes[i])) EXIT("File write error\n");
+                writes++; write_bytes += sizes[i];
+                free_list[free_count++] = i;
+                done++;
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    for (i = 0; i < queue_depth; i++) AlignedFree(buffers[i]);
+    free(free_list);
+    free(iov);
+    free(sizes);
+    free(buffers);
+
+    UringClose(&ring);
+
+    return(1);
+#else
+    return(0);
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+void CopyThreads(IMAGE* src, U64 position, IMAGE* dst, U64 newposition, U64 length) {
+    std::thread* threads;
+    JOB          job;
+    unsigned int i;
+
+    job.src = src;
+    job.dst = dst;
+    job.position = position;
+    job.newposition = newposition;
+    job.length = length;
+    job.block = (U64)block_sectors * dst->sector_size;
+    job.direct = direct && (src->direct >= 0) && (dst->direct >= 0) && !(newposition % ALIGNMENT);
+    job.stream = direct && !job.direct;
+    job.next = 0;
+    job.failed = 0;
+
+    // the direct blocks are aligned, with an aligned block more to read the
+    // unaligned source
+    if (job.direct) job.block = (job.block + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+
+    // every thread reads and writes its own buffer, so the reads of some
+    // blocks are overlapped with the writes of others
+    threads = new std::thread[queue_depth];
+    for (i = 0; i < queue_depth; i++) threads[i] = std::thread(CopyWorker, &job);
+    for (i = 0; i < queue_depth; i++) threads[i].join();
+    delete[] threads;
+
+    // the library errors are exceptions, thrown again in this thread
+    if (job.failed) std::rethrow_exception(job.error);
+}
+
+/*----------------------------------------------------------------------------*/
+void CopyWorker(JOB* job) {
+    char* buffer;
+    U64   block, count;
+
+    buffer = Aligned(job->block + ALIGNMENT);
+
+    try {
+        for (;;) {
+            block = job->next++;
+            if (block * job->block >= job->length) break;
+
+            count = job->length - block * job->block;
+            if (count > job->block) count = job->block;
+
+            if (job->direct) {
+                CopyBlock(job, buffer, block * job->block, count);
+                continue;
+            }
+
+            PRead(job->src, job->position + block * job->block, buffer, count);
+            Copied(job->dst, job->newposition + block * job->block, buffer, count);
+            PWrite(job->dst, job->newposition + block * job->block, buffer, count);
+            if (job->stream) Stream(job->src, job->position + block * job->block, job->dst, job->newposition + block * job->block, count);
+        }
+    }
+    catch (...) {
+        // the first error is kept, the other workers stop at the next block
+        if (!job->failed.exchange(1)) job->error = std::current_exception();
+        job->next = job->length;
+    }
+
+    AlignedFree(buffer);
+}
+
+/*----------------------------------------------------------------------------*/
+void CopyBlock(JOB* job, char* buffer, U64 offset, U64 count) {
+#ifndef _WIN32
+    ssize_t done;
+    U64     start, skip, length, got;
+
+    // the source from the aligned position before it, the file can end
+    // before the aligned length
+    start = (job->position + offset) / ALIGNMENT * ALIGNMENT;
+    skip = job->position + offset - start;
+    length = (skip + count + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    for (got = 0; got < skip + count; got += done) {
+        done = pread(job->src->direct, buffer + got, length - got, start + got);
+        if (done <= 0) EXIT("File read error\n");
+        reads++; read_bytes += done;
+    }
+    if (skip) memmove(buffer, buffer + skip, count);
+    Copied(job->dst, job->newposition + offset, buffer, count);
+
+    if (sparse && Zeros(buffer, count)) {
+        Hole(job->dst, job->newposition + offset, count);
+        return;
+    }
+
+    // the destination is aligned, but a block at the end of the copy can be
+    // a partial one, written from the page cache
+    length = count / ALIGNMENT * ALIGNMENT;
+    for (got = 0; got < length; got += done) {
+        done = pwrite(job->dst->direct, buffer + got, length - got, job->newposition + offset + got);
+        if (done <= 0) EXIT("File write error\n");
+        writes++; write_bytes += done;
+    }
+    if (count > length) PWrite(job->dst, job->newposition + offset + length, buffer + length, count - length);
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+void Stream(IMAGE* src, U64 position, IMAGE* dst, U64 newposition, U64 length) {
+#ifdef __linux__
+    // the block is written now and its pages are dropped, so the writeback
+    // is steady and the other files are kept in the page cache
+    sync_file_range(dst->fd, newposition, length, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(dst->fd, newposition, length, POSIX_FADV_DONTNEED);
+    posix_fadvise(src->fd, position, length, POSIX_FADV_DONTNEED);
+#endif
+}
+
+#ifdef HAVE_URING
+/*----------------------------------------------------------------------------*/
+int UringOpen(URING* ring, unsigned int entries) {
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0) return(0);
+
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_len > ring->sq_len) ring->sq_len = ring->cq_len;
+        ring->cq_len = ring->sq_len;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) EXIT("io_uring error\n");
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    }
+    else {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) EXIT("io_uring error\n");
+    }
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) EXIT("io_uring error\n");
+
+    ring->sq_head = (unsigned int*)((char*)ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned int*)((char*)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned int*)((char*)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned int*)((char*)ring->sq_ptr + p.sq_off.array);
+    ring->cq_head = (unsigned int*)((char*)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned int*)((char*)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned int*)((char*)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ptr + p.cq_off.cqes);
+    ring->pending = 0;
+
+    return(1);
+}
+
+/*----------------------------------------------------------------------------*/
+void UringClose(URING* ring) {
+    munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_len);
+    munmap(ring->sq_ptr, ring->sq_len);
+    close(ring->fd);
+}
+
+/*----------------------------------------------------------------------------*/
+void UringQueue(URING* ring, int opcode, int fd, char* buffer, U64 length, U64 position, U64 data, struct iovec* iov) {
+    struct io_uring_sqe* sqe;
+    unsigned int         tail, index;
+
+    // READV/WRITEV with a single vector work on every io_uring kernel
+    iov->iov_base = buffer;
+    iov->iov_len = length;
+
+    tail = *ring->sq_tail;
+    index = tail & *ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (U64)(size_t)iov;
+    sqe->len = 1;
+    sqe->off = position;
+    sqe->user_data = data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    ring->pending++;
+}
+
+/*----------------------------------------------------------------------------*/
+void UringSubmit(URING* ring, unsigned int wait) {
+    int count;
+
+    do {
+        count = syscall(__NR_io_uring_enter, ring->fd, ring->pending, wait, IORING_ENTER_GETEVENTS, NULL, 0);
+        if ((count < 0) && (errno != EINTR)) EXIT("io_uring error\n");
+        if (count > 0) ring->pending -= count;
+    } while (count < 0);
+}
+#endif
+
+/*----------------------------------------------------------------------------*/
+char* Aligned(U64 length) {
+    char*        fb;
+    U64          align;
+    unsigned int k;
+
+    // a free buffer of the same power of 2, not zero-filled
+    for (k = POOL_MIN; ((U64)1 << k) < length; k++);
+    if (k >= POOL_CLASSES) EXIT("Memory error\n");
+    {
+        std::lock_guard<std::mutex> lock(pool_lock);
+
+        fb = pool[k];
+        if (fb != NULL) {
+            pool[k] = *(char**)fb;
+            pool_bytes -= (U64)1 << k;
+            return(fb);
+        }
+    }
+
+    // the size is kept in the alignment before the buffer
+    align = ((U64)1 << k) >= HUGE_PAGE ? HUGE_PAGE : ALIGNMENT;
+#ifdef _WIN32
+    fb = (char*)_aligned_malloc(align + ((U64)1 << k), align);
+#else
+    if (posix_memalign((void**)&fb, align, align + ((U64)1 << k))) fb = NULL;
+#endif
+    if (fb == NULL) EXIT("Memory error\n");
+    fb += align;
+    *(unsigned int*)(fb - sizeof(unsigned int)) = k;
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    // fewer TLB misses in the big copy/encode buffers
+    if (align == HUGE_PAGE) madvise(fb, (U64)1 << k, MADV_HUGEPAGE);
+#endif
+
+    return(fb);
+}
+
+/*----------------------------------------------------------------------------*/
+void AlignedFree(char* buffer) {
+    unsigned int k;
+
+    if (buffer == NULL) return;
+
+    // kept for the next buffer of the same size, up to POOL_BYTES
+    k = *(unsigned int*)(buffer - sizeof(unsigned int));
+    {
+        std::lock_guard<std::mutex> lock(pool_lock);
+
+        if (pool_bytes + ((U64)1 << k) <= POOL_BYTES) {
+            *(char**)buffer = pool[k];
+            pool[k] = buffer;
+            pool_bytes += (U64)1 << k;
+            return;
+        }
+    }
+
+    buffer -= ((U64)1 << k) >= HUGE_PAGE ? HUGE_PAGE : ALIGNMENT;
+#ifdef _WIN32
+    _aligned_free(buffer);
+#else
+    free(buffer);
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+void MoveImage(IMAGE* iso, CHANGE* changes, int count, U64 total_sectors) {
+    U64 start, end;
+    int i;
+
+    // the filesystem can insert/remove the blocks
+    if (!MoveBlocks(iso, changes, count, total_sectors)) {
+        // the sectors between files and after the last one are moved as a
+        // whole: first the ones moving back in ascending order, then the ones
+        // moving forward in descending order, so no data is overwritten
+        for (i = 0; i < count; i++) {
+            if (changes[i].shift + changes[i].diff >= 0) continue;
+
+            start = changes[i].file_lba + changes[i].old_sectors;
+            end = i + 1 < count ? changes[i + 1].file_lba : total_sectors;
+            MoveSectors(iso, start, start + changes[i].shift + changes[i].diff, end - start);
+        }
+        for (i = count - 1; i >= 0; i--) {
+            if (changes[i].shift + changes[i].diff <= 0) continue;
+
+            start = changes[i].file_lba + changes[i].old_sectors;
+            end = i + 1 < count ? changes[i + 1].file_lba : total_sectors;
+            MoveSectors(iso, start, start + changes[i].shift + changes[i].diff, end - start);
+        }
+    }
+
+    // remove the sectors after the new end
+    i = changes[count - 1].shift + changes[count - 1].diff;
+    if (i < 0) Truncate(iso, (total_sectors + i) * iso->sector_size);
+}
+
+/*----------------------------------------------------------------------------*/
+int MoveBlocks(IMAGE* iso, CHANGE* changes, int count, U64 total_sectors) {
+#if defined(__linux__) && defined(FALLOC_FL_INSERT_RANGE) && defined(FALLOC_FL_COLLAPSE_RANGE)
+    U64 *lba, step, length;
+    int i, first;
+
+    // only whole blocks can be inserted/removed
+    if (iso->block % iso->sector_size) return(0);
+    step = iso->block / iso->sector_size;
+
+    // the old data is replaced, so the blocks can be inserted/removed at any
+    // aligned position inside it, but never at the end of the file
+    lba = (U64*)Memory(count, sizeof(U64));
+    for (i = 0; i < count; i++) {
+        if (!changes[i].diff) continue;
+
+        length = changes[i].diff > 0 ? changes[i].diff : -changes[i].diff;
+        lba[i] = (changes[i].file_lba + step - 1) / step * step;
+
+        if ((length % step) ||
+            (lba[i] + (changes[i].diff > 0 ? 0 : length) > changes[i].file_lba + changes[i].old_sectors) ||
+            (lba[i] + (changes[i].diff > 0 ? 0 : length) >= total_sectors)) {
+            free(lba);
+            return(0);
+        }
+    }
+
+    // from the last file to the first one, so the positions are not moved
+    first = 1;
+    for (i = count - 1; i >= 0; i--) {
+        if (!changes[i].diff) continue;
+
+        length = (U64)(changes[i].diff > 0 ? changes[i].diff : -changes[i].diff) * iso->sector_size;
+
+        if (fallocate(iso->fd, changes[i].diff > 0 ? FALLOC_FL_INSERT_RANGE : FALLOC_FL_COLLAPSE_RANGE, lba[i] * iso->sector_size, length)) {
+            // not supported by the filesystem
+            if (first && ((errno == EOPNOTSUPP) || (errno == EINVAL) || (errno == ENOSYS))) {
+                free(lba);
+                return(0);
+            }
+            EXIT("File shift error\n");
+        }
+        first = 0;
+
+        iso->size += changes[i].diff > 0 ? length : -length;
+    }
+
+    free(lba);
+
+    return(1);
+#else
+    return(0);
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+void MoveSectors(IMAGE* iso, U64 lba, U64 newlba, U64 sectors) {
+    unsigned char* buffer;
+    unsigned int   count;
+    U64            distance, from, i;
+
+    distance = newlba > lba ? newlba - lba : lba - newlba;
+
+    // forward from the end, back from the start
+    for (i = 0; i < sectors; i += count) {
+        count = sectors - i >= BLOCKSIZE ? BLOCKSIZE : sectors - i;
+
+        from = newlba > lba ? lba + sectors - i - count : lba + i;
+
+        // not overlapped blocks can be copied by the kernel
+        if (distance >= count) {
+            CopySectors(iso, from, iso, from + newlba - lba, count);
+        }
+        else {
+            buffer = (unsigned char*)ReadSectors(iso, from, count);
+            Relocate(iso, (char*)buffer, from + newlba - lba, count);
+            WriteSectors(iso, from + newlba - lba, (char*)buffer, count);
+            AlignedFree((char*)buffer);
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+void Truncate(IMAGE* image, U64 size) {
+#ifdef _WIN32
+    FILE_END_OF_FILE_INFO eof;
+
+    eof.EndOfFile.QuadPart = size;
+    if (!SetFileInformationByHandle(image->fd, FileEndOfFileInfo, &eof, sizeof(eof))) EXIT("File truncate error\n");
+#else
+    if (ftruncate(image->fd, size)) EXIT("File truncate error\n");
+#endif
+
+    image->size = size;
+}
+
+/*----------------------------------------------------------------------------*/
+void WriteData(IMAGE* out, U64 lba, IMAGE* file) {
+    unsigned char* buffer, * data, * sector;
+    unsigned int   new_sectors, new_length;
+    unsigned int   count, maxim;
+    unsigned int   i, j;
+
+    new_sectors = (file->size + out->sector_data - 1) / out->sector_data;
+    if (!new_sectors) return;
+
+    // user data only, the full sectors are copied as they are
+    i = 0;
+    if (out->sector_size == out->sector_data) {
+        i = new_sectors - 1;
+        CopyData(file, 0, out, lba * out->sector_size, (U64)i * out->sector_size);
+        lba += i;
+    }
+
+    // read and update all data sectors except the latest one (maybe incomplete)
+    maxim = --new_sectors - i;
+    for ( ; i < new_sectors; ) {
+        count = maxim >= BLOCKSIZE ? BLOCKSIZE : maxim; maxim -= count;
+
+        // the user data is read at the end of the buffer and spread to the
+        // sectors from the first one, a sector never reaches the next data
+        buffer = (unsigned char*)Aligned((U64)count * out->sector_size);
+        data = buffer + count * (out->sector_size - out->sector_data);
+        ReadData(file, (U64)i * out->sector_data, (char*)data, count * out->sector_data);
+        for (j = 0; j < count; j++) {
+            sector = buffer + j * out->sector_size;
+            memmove(sector + out->data_offset, data + j * out->sector_data, out->sector_data);
+            memset(sector, 0, out->data_offset);
+            memset(sector + out->data_offset + out->sector_data, 0, out->sector_size - out->data_offset - out->sector_data);
+            // data submode in the Mode 2 subheader
+            if (out->mode == MODE_M2) sector[0x012] = sector[0x016] = 0x08;
+        }
+        Encode(out, (char*)buffer, lba, count);
+        WriteSectors(out, lba, (char*)buffer, count); lba += count;
+        AlignedFree((char*)buffer);
+
+        i += count;
+    }
+
+    // read and update the remaining data sector
+    new_length = file->size - (U64)i * out->sector_data;
+
+    buffer = (unsigned char*)Aligned(out->sector_size);
+    memset(buffer, 0, out->sector_size);
+    ReadData(file, (U64)i * out->sector_data, (char*)buffer + out->data_offset, new_length);
+    // data, end of record and end of file submode in the Mode 2 subheader
+    if (out->mode == MODE_M2) buffer[0x012] = buffer[0x016] = 0x89;
+    Encode(out, (char*)buffer, lba, 1);
+    WriteSectors(out, lba, (char*)buffer, 1);
+    AlignedFree((char*)buffer);
+}
+
+/*----------------------------------------------------------------------------*/
+void Format(IMAGE* iso) {
+    static const unsigned char sync[12] = { 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00 };
+    static std::once_flag tables;
+    unsigned char* buffer;
+    unsigned int   found, address;
+
+    // raw sectors if the primary volume descriptor is found after a sync
+    // pattern with the right mode, else user data only as opened
+    if ((DESCRIPTOR_LBA + 1) * LEN_SECTOR_M1 > iso->size) return;
+
+    buffer = (unsigned char*)Read(iso, DESCRIPTOR_LBA * LEN_SECTOR_M1, LEN_SECTOR_M1);
+
+    found = 0;
+    if (!memcmp(buffer, sync, sizeof(sync))) {
+        if ((buffer[0x00F] == MODE_M1) && (*(U64*)(buffer + POS_DATA_M1) == DESCRIPTOR_SIG_1)) {
+            iso->sector_size = LEN_SECTOR_M1;
+            iso->data_offset = POS_DATA_M1;
+            iso->sector_data = LEN_DATA_M1;
+            found = MODE_M1;
+        }
+        if ((buffer[0x00F] == MODE_M2) && (*(U64*)(buffer + POS_DATA_M2) == DESCRIPTOR_SIG_1)) {
+            iso->sector_size = LEN_SECTOR_M2;
+            iso->data_offset = POS_DATA_M2;
+            iso->sector_data = LEN_DATA_M2;
+            found = MODE_M2;
+        }
+    }
+
+    if (found) {
+        iso->mode = found;
+        printf("- %sraw %s sectors\n", label, iso->mode == MODE_M1 ? "Mode 1" : "Mode 2 Form 1");
+
+        // the image can start at any address, the headers of the new and
+        // moved sectors follow the one of the volume descriptor
+        address  = ((buffer[0x00C] >> 4) * 10 + (buffer[0x00C] & 0xF)) * 60 * 75;
+        address += ((buffer[0x00D] >> 4) * 10 + (buffer[0x00D] & 0xF)) * 75;
+        address += ((buffer[0x00E] >> 4) * 10 + (buffer[0x00E] & 0xF));
+        if (address >= DESCRIPTOR_LBA) iso->sector_address = address - DESCRIPTOR_LBA;
+
+        // the tables are shared by all the images
+        std::call_once(tables, Tables);
+    }
+
+    AlignedFree((char*)buffer);
+}
+
+/*----------------------------------------------------------------------------*/
+void FormatAs(IMAGE* image, IMAGE* model) {
+    image->mode = model->mode;
+    image->sector_size = model->sector_size;
+    image->data_offset = model->data_offset;
+    image->sector_data = model->sector_data;
+    image->sector_address = model->sector_address;
+}
+
+/*----------------------------------------------------------------------------*/
+void Tables(void) {
+    unsigned int i, j, k;
+
+    for (i = 0; i < 256; i++) {
+        j = (i << 1) ^ (i & 0x80 ? 0x11D : 0);
+        ecc_f[i] = j;
+        ecc_b[i ^ j] = i;
+
+        k = i;
+        for (j = 0; j < 8; j++) k = (k >> 1) ^ (k & 1 ? 0xD8018001 : 0);
+        edc_table[0][i] = k;
+    }
+
+    // the EDC of 1 to 7 more zero bytes
+    for (i = 0; i < 256; i++) {
+        for (j = 1; j < 8; j++) {
+            edc_table[j][i] = (edc_table[j - 1][i] >> 8) ^ edc_table[0][edc_table[j - 1][i] & 0xFF];
+        }
+    }
+
+    // the Q diagonals, 43 bytes each, wrapping at the end of the P area
+    for (i = 0; i < 43; i++) {
+        for (j = 0; j < 52; j++) {
+            ecc_q[i * 52 + j] = ((j >> 1) * 86 + (j & 1) + i * 88) % (43 * 52);
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+void Encode(IMAGE* image, char* buffer, U64 lba, U64 sectors) {
+    void         (*encode)(IMAGE*, unsigned char*, U64, U64);
+    std::thread* threads;
+    unsigned int count, i;
+    U64          step;
+
+    if (image->mode == MODE_M0) return;
+
+    encode = image->mode == MODE_M1 ? EncodeSectors<MODE_M1> : EncodeSectors<MODE_M2>;
+
+    // the sectors are split between the cores
+    count = std::thread::hardware_concurrency();
+    if (count > sectors / ENCODE_SECTORS) count = sectors / ENCODE_SECTORS;
+    if (count <= 1) {
+        encode(image, (unsigned char*)buffer, lba, sectors);
+        return;
+    }
+
+    step = (sectors + count - 1) / count;
+
+    threads = new std::thread[count];
+    for (i = 0; i < count; i++) {
+        threads[i] = std::thread(
+            encode, image, (unsigned char*)buffer + i * step * image->sector_size, lba + i * step,
+            (i + 1) * step > sectors ? sectors - i * step : step
+        );
+    }
+    for (i = 0; i < count; i++) threads[i].join();
+    delete[] threads;
+}
+
+/*----------------------------------------------------------------------------*/
+template <unsigned int MODE> void EncodeSectors(IMAGE* image, unsigned char* buffer, U64 lba, U64 sectors) {
+    unsigned char* sector;
+    unsigned char  header[4];
+    unsigned int   edc;
+    U64            i;
+
+    for (i = 0; i < sectors; i++) {
+        sector = buffer + i * LEN_SECTOR_M1;
+
+        Address(image, sector, lba + i);
+
+        if (MODE == MODE_M1) {
+            edc = EDC(sector, 0x810);
+            sector[0x810] = edc; sector[0x811] = edc >> 8; sector[0x812] = edc >> 16; sector[0x813] = edc >> 24;
+            memset(sector + 0x814, 0, 8);
+
+            ECC(sector);
+        }
+        else {
+            edc = EDC(sector + 0x010, 0x808);
+            sector[0x818] = edc; sector[0x819] = edc >> 8; sector[0x81A] = edc >> 16; sector[0x81B] = edc >> 24;
+
+            // the header is not protected in Mode 2
+            memcpy(header, sector + 0x00C, 4);
+            memset(sector + 0x00C, 0, 4);
+            ECC(sector);
+            memcpy(sector + 0x00C, header, 4);
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+void Relocate(IMAGE* image, char* buffer, U64 lba, U64 sectors) {
+    U64 i;
+
+    // only the header has the address, and it is not protected in Mode 2
+    if (image->mode == MODE_M2) {
+        for (i = 0; i < sectors; i++) Address(image, (unsigned char*)buffer + i * image->sector_size, lba + i);
+        return;
+    }
+
+    Encode(image, buffer, lba, sectors);
+}
+
+/*----------------------------------------------------------------------------*/
+void Address(IMAGE* image, unsigned char* sector, U64 lba) {
+    unsigned int address, minute, second, frame;
+
+    address = lba + image->sector_address;
+    minute = address / 75 / 60;
+    second = address / 75 % 60;
+    frame = address % 75;
+
+    sector[0x000] = 0x00;
+    memset(sector + 0x001, 0xFF, 10);
+    sector[0x00B] = 0x00;
+
+    sector[0x00C] = ((minute / 10) << 4) | (minute % 10);
+    sector[0x00D] = ((second / 10) << 4) | (second % 10);
+    sector[0x00E] = ((frame / 10) << 4) | (frame % 10);
+    sector[0x00F] = image->mode;
+}
+
+/*----------------------------------------------------------------------------*/
+unsigned int EDC(unsigned char* data, unsigned int length) {
+    unsigned int edc;
+
+    // 8 bytes at once
+    edc = 0;
+    for ( ; length >= 8; length -= 8, data += 8) {
+        edc ^= data[0] | (data[1] << 8) | (data[2] << 16) | ((unsigned int)data[3] << 24);
+        edc = edc_table[7][edc & 0xFF] ^ edc_table[6][(edc >> 8) & 0xFF] ^
+              edc_table[5][(edc >> 16) & 0xFF] ^ edc_table[4][edc >> 24] ^
+              edc_table[3][data[4]] ^ edc_table[2][data[5]] ^
+              edc_table[1][data[6]] ^ edc_table[0][data[7]];
+    }
+    while (length--) edc = (edc >> 8) ^ edc_table[0][(edc ^ *data++) & 0xFF];
+
+    return(edc);
+}
+
+/*----------------------------------------------------------------------------*/
+void ECC(unsigned char* sector) {
+    unsigned char q[43 * 52];
+    unsigned int  i;
+
+    // P parity, 86 columns of 24 bytes from the header to the EDC
+    ECCBlock(sector + 0x00C, 86, 24, sector + 0x81C);
+
+    // Q parity, 52 diagonals of 43 bytes from the header to the P parity
+    for (i = 0; i < 43 * 52; i++) q[i] = sector[0x00C + ecc_q[i]];
+    ECCBlock(q, 52, 43, sector + 0x8C8);
+}
+
+/*----------------------------------------------------------------------------*/
+void ECCBlock(unsigned char* data, unsigned int columns, unsigned int rows, unsigned char* parity) {
+    unsigned char a[96], b[96];
+    unsigned int  c, r, x;
+    U64           wa, wb, w;
+
+    // all the columns are independent, the multiply by 2 is a shift plus
+    // 0x1D where the top bit was set
+    c = 0;
+#ifdef HAVE_SSE2
+    for ( ; c + 16 <= columns; c += 16) {
+        __m128i va, vb, v, zero, poly;
+
+        zero = _mm_setzero_si128();
+        poly = _mm_set1_epi8(0x1D);
+        va = vb = zero;
+        for (r = 0; r < rows; r++) {
+            v = _mm_loadu_si128((__m128i*)(data + r * columns + c));
+            va = _mm_xor_si128(va, v);
+            vb = _mm_xor_si128(vb, v);
+            va = _mm_xor_si128(_mm_add_epi8(va, va), _mm_and_si128(_mm_cmplt_epi8(va, zero), poly));
+        }
+        _mm_storeu_si128((__m128i*)(a + c), va);
+        _mm_storeu_si128((__m128i*)(b + c), vb);
+    }
+#endif
+    for ( ; c + 8 <= columns; c += 8) {
+        wa = wb = 0;
+        for (r = 0; r < rows; r++) {
+            memcpy(&w, data + r * columns + c, 8);
+            wa ^= w;
+            wb ^= w;
+            w = wa & 0x8080808080808080ULL;
+            wa = ((wa & 0x7F7F7F7F7F7F7F7FULL) << 1) ^ ((w >> 7) * 0x1D);
+        }
+        memcpy(a + c, &wa, 8);
+        memcpy(b + c, &wb, 8);
+    }
+    for ( ; c < columns; c++) {
+        a[c] = b[c] = 0;
+        for (r = 0; r < rows; r++) {
+            x = data[r * columns + c];
+            a[c] ^= x;
+            b[c] ^= x;
+            a[c] = ecc_f[a[c]];
+        }
+    }
+
+    for (c = 0; c < columns; c++) {
+        x = ecc_b[ecc_f[a[c]] ^ b[c]];
+        parity[c] = x;
+        parity[c + columns] = x ^ b[c];
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+void IndexTree(VOLUME* volume) {
+    IMAGE*       iso;
+    INDEX*       index;
+    ENTRY*       entry;
+    unsigned int i, j;
+
+    iso = &volume->iso;
+    index = &volume->index;
+
+    index->count = 0;
+    index->max = 1024;
+    index->entries = (ENTRY*)Memory(index->max, sizeof(ENTRY));
+    index->paths_len = 0;
+    index->paths_max = 16384;
+    index->paths = Memory(index->paths_max, sizeof(char));
+
+    // parse the whole folder tree once, then the one of the layer 1
+    IndexFolder(iso, index, (char*)"", 0, volume->root_lba, volume->root_length, 0);
+    if (volume->layer_lba) {
+        IndexFolder(iso, index, (char*)"", volume->layer_lba, volume->layer_lba + volume->layer_root_lba, volume->layer_root_length, 0);
+    }
+
+    // hash the file paths, keeping the first one found on duplicates (the
+    // layer 0 first), and the first record of a multi-extent file
+    for (index->hash_size = 16; index->hash_size < 2 * index->count; index->hash_size <<= 1);
+    index->hash = (unsigned int*)Memory(index->hash_size, sizeof(unsigned int));
+
+    for (i = 0; i < index->count; i++) {
+        entry = &index->entries[i];
+        if ((entry->path == NONE) || (entry->flags & 0x02)) continue;
+
+        if (Search(index, index->paths + entry->path) != NULL) continue;
+
+        j = Hash(index->paths + entry->path) & (index->hash_size - 1);
+        while (index->hash[j]) j = (j + 1) & (index->hash_size - 1);
+        index->hash[j] = i + 1;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+void IndexFolder(IMAGE* iso, INDEX* index, char* path, unsigned int base, int lba, int len, int depth) {
+    unsigned char* buffer;
+    unsigned char  name[256];
+    ENTRY*         entry;
+    unsigned int   total, first, last, pos, nbytes, nchars, length, extent;
+    unsigned int   i, j;
+
+    if (depth > MAX_DEPTH) EXIT("Folder tree too deep\n");
+
+    // total sectors
+    total = (len + LEN_SECTOR_M0 - 1) / LEN_SECTOR_M0;
+
+    // all the records of this folder, before going into subfolders
+    first = index->count;
+    extent = NONE;
+
+    for (i = 0; i < total; i++) {
+        // read 1 sector
+        buffer = (unsigned char*)GetSectors(iso, lba + i, 1);
+        folder_sectors++;
+
+        // check the entries in each sector
+        pos = 0;
+        while (pos < iso->sector_data) {
+            // field size
+            nbytes = *(unsigned char*)(buffer + iso->data_offset + pos);
+            if (!nbytes) break; // no more entries in this sector
+
+            if (index->count == index->max) {
+                index->max <<= 1;
+                index->entries = (ENTRY*)realloc(index->entries, index->max * sizeof(ENTRY));
+                if (index->entries == NULL) EXIT("Memory error\n");
+            }
+            entry = &index->entries[index->count++];
+
+            entry->position = (U64)(lba + i) * iso->sector_size + iso->data_offset + pos;
+            entry->lba = base + *(unsigned int*)(buffer + iso->data_offset + pos + 0x002);
+            entry->size = *(unsigned int*)(buffer + iso->data_offset + pos + 0x00A);
+            entry->base = base;
+            entry->flags = *(unsigned char*)(buffer + iso->data_offset + pos + 0x019);
+            entry->path = NONE;
+
+            // the records after a non-final extent are counted in its first
+            // record
+            entry->extents = 1;
+            if (extent != NONE) {
+                index->entries[extent].extents++;
+                entry->extents = 0;
+            }
+            if (!(entry->flags & 0x80)) extent = NONE;
+            else if (extent == NONE)    extent = index->count - 1;
+
+            // name size
+            nchars = *(unsigned char*)(buffer + iso->data_offset + pos + 0x020);
+            for (j = 0; j < nchars; j++) {
+                name[j] = *(unsigned char*)(buffer + iso->data_offset + pos + 0x021 + j);
+            }
+            name[j] = '\0';
+
+            // discard the ";1" final
             if (nchars > 2) {
                 if (name[nchars - 2] == ';') {
                     nchars -= 2;
@@ -453,165 +5931,1164 @@ U64 Search(char* isoname, char* filename, char* path, int lba, int len) {
                 }
             }
 
-            // check the name except for '.' and '..' entries
-            if ((nchars != 1) || ((name[0] != '\0') && (name[0] != '\1'))) {
-                // new path name
-                sprintf((char*)newpath, "%s/%s", path, name);
-
-                // recursive search in folders
-                if (*(unsigned char*)(buffer + data_offset + pos + 0x019) & 0x02) {
-                    newlba = *(unsigned int*)(buffer + data_offset + pos + 0x002);
-                    newlen = *(unsigned int*)(buffer + data_offset + pos + 0x00A);
-
-                    found = Search(isoname, filename, (char*)newpath, newlba, newlen);
-                    if (found) {
-                        free(buffer);
-                        return(found);
-                    }
-                }
-                else {
-                    // compare names - case insensitive
-                    for (j = 0; filename[j] && newpath[j]; j++) {
-                        if ((filename[j] & 0xDF) != (newpath[j] & 0xDF)) break;
-                    }
+            // keep the path except for '.' and '..' entries
+            if ((nchars != 1) || ((name[0] != '\0') && (name[0] != '\1'))) {
+                // a name can't be read as another folder, in the image or
+                // when extracted
+                if (!ValidName((char*)name, nchars)) EXIT("Invalid file name in the image\n");
+
+                length = StrLen(path) + 1 + nchars + 1;
+                if (length > MAX_PATH) EXIT("Path too long in the image\n");
+
+                if (index->paths_len + length > index->paths_max) {
+                    while (index->paths_len + length > index->paths_max) index->paths_max <<= 1;
+                    index->paths = (char*)realloc(index->paths, index->paths_max);
+                    if (index->paths == NULL) EXIT("Memory error\n");
+                }
+                entry->path = index->paths_len;
+                sprintf(index->paths + index->paths_len, "%s/%s", path, name);
+                index->paths_len += length;
+            }
+
+            // point to the next entry
+            pos += nbytes;
+        }
+
+        DropSectors(iso, (char*)buffer);
+    }
+
+    // recursive search in folders, only the records of this one
+    last = index->count;
+    for (i = first; i < last; i++) {
+        entry = &index->entries[i];
+        if ((entry->path != NONE) && (entry->flags & 0x02)) {
+            // 'paths' can be moved by realloc
+            char newpath[MAX_PATH];
+
+            sprintf(newpath, "%s", index->paths + entry->path);
+            IndexFolder(iso, index, newpath, base, entry->lba, entry->size, depth + 1);
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+int ValidName(char* name, unsigned int length) {
+    unsigned int i;
+
+    // not empty, not '.' or '..', with no separator or NUL
+    if (!length) return(0);
+    if ((name[0] == '.') && ((length == 1) || ((length == 2) && (name[1] == '.')))) return(0);
+    for (i = 0; i < length; i++) {
+        if ((name[i] == '\0') || (name[i] == '/') || (name[i] == '\\')) return(0);
+    }
+
+    return(1);
+}
+
+/*----------------------------------------------------------------------------*/
+void IndexFree(INDEX* index) {
+    free(index->entries);
+    free(index->paths);
+    free(index->hash);
+    index->entries = NULL;
+    index->paths = NULL;
+    index->hash = NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+unsigned int Hash(char* path) {
+    unsigned int hash;
+
+    // FNV-1a of the case insensitive path
+    for (hash = 0x811C9DC5; *path; path++) hash = (hash ^ (*path & 0xDF)) * 0x01000193;
+
+    return(hash);
+}
+
+/*----------------------------------------------------------------------------*/
+ENTRY* Search(INDEX* index, char* filename) {
+    ENTRY*       entry;
+    char*        path;
+    unsigned int i, j;
+
+    i = Hash(filename) & (index->hash_size - 1);
+    while (index->hash[i]) {
+        entry = &index->entries[index->hash[i] - 1];
+        path = index->paths + entry->path;
+
+        // compare names - case insensitive
+        for (j = 0; filename[j] && path[j]; j++) {
+            if ((filename[j] & 0xDF) != (path[j] & 0xDF)) break;
+        }
+
+        // file found
+        if (!filename[j] && !path[j]) return(entry);
+
+        i = (i + 1) & (index->hash_size - 1);
+    }
+
+    // file not found
+    return(NULL);
+}
+
+/*----------------------------------------------------------------------------*/
+U64 Digest(IMAGE* file) {
+    DIGEST         digest;
+    unsigned char* data;
+    unsigned int   length;
+    U64            done;
+
+    DigestInit(&digest);
+    for (done = 0; done < file->size; done += length) {
+        length = file->size - done > HASH_BLOCK ? HASH_BLOCK : file->size - done;
+
+        data = (unsigned char*)Read(file, done, length);
+        DigestUpdate(&digest, data, length);
+        AlignedFree((char*)data);
+    }
+
+    return(DigestFinal(&digest));
+}
+
+/*----------------------------------------------------------------------------*/
+void DigestInit(DIGEST* digest) {
+    digest->v[0] = XXH_P1 + XXH_P2;
+    digest->v[1] = XXH_P2;
+    digest->v[2] = 0;
+    digest->v[3] = 0 - XXH_P1;
+    digest->total = 0;
+    digest->tail_len = 0;
+}
+
+/*----------------------------------------------------------------------------*/
+void DigestUpdate(DIGEST* digest, unsigned char* data, U64 length) {
+    U64          lane;
+    unsigned int count, i;
+
+    digest->total += length;
+
+    // the stripes of 32 bytes, the rest is kept for the next call
+    while (length) {
+        if (digest->tail_len || (length < 32)) {
+            count = 32 - digest->tail_len;
+            if (count > length) count = length;
+            memcpy(digest->tail + digest->tail_len, data, count);
+            digest->tail_len += count;
+            data += count; length -= count;
+            if (digest->tail_len < 32) break;
+
+            for (i = 0; i < 4; i++) {
+                memcpy(&lane, digest->tail + 8 * i, 8);
+                digest->v[i] = XXH_ROUND(digest->v[i], lane);
+            }
+            digest->tail_len = 0;
+            continue;
+        }
+
+        for ( ; length >= 32; data += 32, length -= 32) {
+            for (i = 0; i < 4; i++) {
+                memcpy(&lane, data + 8 * i, 8);
+                digest->v[i] = XXH_ROUND(digest->v[i], lane);
+            }
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+U64 DigestFinal(DIGEST* digest) {
+    unsigned char* data;
+    unsigned int   length, word, i;
+    U64            hash, lane;
+
+    if (digest->total >= 32) {
+        hash = XXH_ROTL(digest->v[0], 1) + XXH_ROTL(digest->v[1], 7) + XXH_ROTL(digest->v[2], 12) + XXH_ROTL(digest->v[3], 18);
+        for (i = 0; i < 4; i++) {
+            hash ^= XXH_ROUND(0, digest->v[i]);
+            hash = hash * XXH_P1 + XXH_P4;
+        }
+    }
+    else {
+        hash = digest->v[2] + XXH_P5;
+    }
+    hash += digest->total;
+
+    // the last bytes, 8, 4 and 1 at once
+    data = digest->tail;
+    length = digest->tail_len;
+    for ( ; length >= 8; data += 8, length -= 8) {
+        memcpy(&lane, data, 8);
+        hash ^= XXH_ROUND(0, lane);
+        hash = XXH_ROTL(hash, 27) * XXH_P1 + XXH_P4;
+    }
+    if (length >= 4) {
+        memcpy(&word, data, 4);
+        hash ^= word * XXH_P1;
+        hash = XXH_ROTL(hash, 23) * XXH_P2 + XXH_P3;
+        data += 4; length -= 4;
+    }
+    for ( ; length; data++, length--) {
+        hash ^= *data * XXH_P5;
+        hash = XXH_ROTL(hash, 11) * XXH_P1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= XXH_P2;
+    hash ^= hash >> 29;
+    hash *= XXH_P3;
+    hash ^= hash >> 32;
+
+    return(hash);
+}
+
+/*----------------------------------------------------------------------------*/
+void Checksum(IMAGE* image, WRITES* writes) {
+    HASHING        hashing;
+    SPAN*          copies, * span;
+    std::thread*   threads;
+    SHA            sha;
+    unsigned char  hash[20], * data;
+    unsigned int   ncopies, count, max, crc, length, last, low, high;
+    unsigned int   i, j;
+    U64            step, done, position, end, known;
+
+    if (verify == VERIFY_SHA1) {
+        Phase("hashing new image (SHA-1)");
+
+        // SHA-1 can't be split, the blocks in order
+        ShaInit(&sha);
+        for (done = 0; done < image->size; done += length) {
+            length = image->size - done > HASH_BLOCK ? HASH_BLOCK : image->size - done;
+
+            data = (unsigned char*)Read(image, done, length);
+            ShaUpdate(&sha, data, length);
+            AlignedFree((char*)data);
+        }
+        ShaFinal(&sha, hash);
+
+        printf("- %simage SHA-1: ", label);
+        for (i = 0; i < 20; i++) printf("%02x", hash[i]);
+        printf("\n");
+        return;
+    }
+
+    Phase("hashing new image (CRC32)");
+
+    std::call_once(crc_tables, CRCTables);
+
+    // the blocks of the copy engine are not read again, unless a metadata
+    // sector was written over them, or another copy
+    copies = writes != NULL ? writes->copies : NULL;
+    ncopies = writes != NULL ? writes->ncopies : 0;
+    if (ncopies) qsort(copies, ncopies, sizeof(SPAN), CompareSpan);
+    for (last = i = 0; i < ncopies; i++) {
+        span = &copies[i];
+        end = span->position + span->length;
+        span->known = end <= image->size;
+        if (i && (span->position < copies[last].position + copies[last].length)) span->known = copies[last].known = 0;
+        if (!i || (end > copies[last].position + copies[last].length)) last = i;
+
+        // the first written sector from the start of the block, sorted by
+        // Verify()
+        low = 0;
+        high = writes->nsectors;
+        while (low < high) {
+            j = (low + high) / 2;
+            if ((U64)(writes->sectors[j] + 1) * image->sector_size <= span->position) low = j + 1;
+            else                                                                      high = j;
+        }
+        if ((low < writes->nsectors) && ((U64)writes->sectors[low] * image->sector_size < end)) span->known = 0;
+    }
+
+    // the rest of the image is split between the cores, and the CRC32 of
+    // all the parts are combined in order
+    count = std::thread::hardware_concurrency();
+    if (count < 1) count = 1;
+    step = (image->size + count - 1) / count;
+    if (step < HASH_THREAD) step = HASH_THREAD;
+    step = (step + HASH_BLOCK - 1) / HASH_BLOCK * HASH_BLOCK;
+
+    max = 2 * ncopies + image->size / step + count + 1;
+    hashing.image = image;
+    hashing.spans = new SPAN[max];
+    hashing.count = 0;
+    hashing.next = 0;
+    hashing.failed = 0;
+    known = 0;
+    for (position = i = 0; position < image->size; ) {
+        while ((i < ncopies) && (!copies[i].known || (copies[i].position < position))) i++;
+        end = i < ncopies ? copies[i].position : image->size;
+
+        if (position < end) {
+            // read, in parts of 'step' bytes at most
+            span = &hashing.spans[hashing.count++];
+            span->position = position;
+            span->length = end - position > step ? step : end - position;
+            span->known = 0;
+            position += span->length;
+            continue;
+        }
+
+        hashing.spans[hashing.count++] = copies[i];
+        position += copies[i].length;
+        known += copies[i++].length;
+    }
+
+    count = hashing.count < count ? hashing.count : count;
+    if (count < 1) count = 1;
+    threads = new std::thread[count];
+    for (i = 0; i < count; i++) threads[i] = std::thread(CRCWorker, &hashing);
+    for (i = 0; i < count; i++) threads[i].join();
+    delete[] threads;
+
+    if (hashing.failed) {
+        delete[] hashing.spans;
+        std::rethrow_exception(hashing.error);
+    }
+
+    crc = 0;
+    for (i = 0; i < hashing.count; i++) crc = CRC32Combine(crc, hashing.spans[i].crc, hashing.spans[i].length);
+    delete[] hashing.spans;
+
+    if (known) printf("- %s%llu bytes hashed by the copy\n", label, known);
+    printf("- %simage CRC32: %08x\n", label, crc);
+}
+
+/*----------------------------------------------------------------------------*/
+void CRCTables(void) {
+    unsigned int i, j, k;
+
+    for (i = 0; i < 256; i++) {
+        k = i;
+        for (j = 0; j < 8; j++) k = (k >> 1) ^ (k & 1 ? 0xEDB88320 : 0);
+        crc_table[0][i] = k;
+    }
+
+    // the CRC32 of 1 to 7 more zero bytes
+    for (i = 0; i < 256; i++) {
+        for (j = 1; j < 8; j++) {
+            crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^ crc_table[0][crc_table[j - 1][i] & 0xFF];
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+void CRCWorker(HASHING* hashing) {
+    SPAN*          span;
+    unsigned char* data;
+    unsigned int   length, i;
+    U64            done;
+
+    // the library errors are exceptions, thrown again by Checksum()
+    try {
+        for (;;) {
+            i = hashing->next++;
+            if (i >= hashing->count) break;
+
+            span = &hashing->spans[i];
+            if (span->known) continue;
+
+            span->crc = 0;
+            for (done = 0; done < span->length; done += length) {
+                length = span->length - done > HASH_BLOCK ? HASH_BLOCK : span->length - done;
+
+                data = (unsigned char*)Read(hashing->image, span->position + done, length);
+                span->crc = CRC32(span->crc, data, length);
+                AlignedFree((char*)data);
+            }
+        }
+    }
+    catch (...) {
+        // the first error is kept, the other workers stop at the next span
+        if (!hashing->failed.exchange(1)) hashing->error = std::current_exception();
+        hashing->next = hashing->count;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+void Copied(IMAGE* dst, U64 position, char* buffer, U64 length) {
+    WRITES*      writes;
+    SPAN*        span;
+    unsigned int crc;
+
+    // the CRC32 of a block as it is written, only for the checksum of the
+    // new image, with the tables of Checksum()
+    writes = dst->writes;
+    if ((writes == NULL) || (verify != VERIFY_CRC32)) return;
+
+    std::call_once(crc_tables, CRCTables);
+    crc = CRC32(0, (unsigned char*)buffer, length);
+
+    std::lock_guard<std::mutex> lock(writes_lock);
+    if (writes->ncopies == writes->max_copies) {
+        writes->max_copies = writes->max_copies ? writes->max_copies << 1 : 64;
+        writes->copies = (SPAN*)realloc(writes->copies, writes->max_copies * sizeof(SPAN));
+        if (writes->copies == NULL) EXIT("Memory error\n");
+    }
+    span = &writes->copies[writes->ncopies++];
+    span->position = position;
+    span->length = length;
+    span->crc = crc;
+    span->known = 1;
+}
+
+/*----------------------------------------------------------------------------*/
+void Written(IMAGE* iso, U64 lba, int sectors) {
+    WRITES* writes;
+    int     i;
+
+    // the metadata sectors of an update, read again by Verify()
+    writes = iso->writes;
+    if (writes == NULL) return;
+
+    for (i = 0; i < sectors; i++) {
+        if (writes->nsectors == writes->max_sectors) {
+            writes->max_sectors = writes->max_sectors ? writes->max_sectors << 1 : 64;
+            writes->sectors = (unsigned int*)realloc(writes->sectors, writes->max_sectors * sizeof(unsigned int));
+            if (writes->sectors == NULL) EXIT("Memory error\n");
+        }
+        writes->sectors[writes->nsectors++] = lba + i;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+int CompareSpan(const void* a, const void* b) {
+    U64 x, y;
+
+    x = ((SPAN*)a)->position;
+    y = ((SPAN*)b)->position;
+
+    return(x < y ? -1 : x > y);
+}
+
+/*----------------------------------------------------------------------------*/
+unsigned int CRC32(unsigned int crc, unsigned char* data, U64 length) {
+    // 8 bytes at once, as EDC()
+    crc = ~crc;
+    for ( ; length >= 8; length -= 8, data += 8) {
+        crc ^= data[0] | (data[1] << 8) | (data[2] << 16) | ((unsigned int)data[3] << 24);
+        crc = crc_table[7][crc & 0xFF] ^ crc_table[6][(crc >> 8) & 0xFF] ^
+              crc_table[5][(crc >> 16) & 0xFF] ^ crc_table[4][crc >> 24] ^
+              crc_table[3][data[4]] ^ crc_table[2][data[5]] ^
+              crc_table[1][data[6]] ^ crc_table[0][data[7]];
+    }
+    while (length--) crc = (crc >> 8) ^ crc_table[0][(crc ^ *data++) & 0xFF];
+
+    return(~crc);
+}
 
-                    // file found
-                    if (!filename[j] && !newpath[j]) {
-                        free(buffer);
-                        return((U64)(lba + i) * sector_size + data_offset + pos);
-                    }
-                }
-            }
+/*----------------------------------------------------------------------------*/
+unsigned int CRC32Combine(unsigned int crc1, unsigned int crc2, U64 length2) {
+    unsigned int even[32], odd[32], row, i;
 
-            // point to the next entry
-            pos += nbytes;
+    if (!length2) return(crc1);
+
+    // 'crc1' is moved by 'length2' zero bytes with the operator of a zero
+    // bit squared for every bit of the length, as zlib does
+    odd[0] = 0xEDB88320;
+    row = 1;
+    for (i = 1; i < 32; i++) { odd[i] = row; row <<= 1; }
+
+    GF2Square(even, odd);
+    GF2Square(odd, even);
+    do {
+        GF2Square(even, odd);
+        if (length2 & 1) crc1 = GF2Times(even, crc1);
+        length2 >>= 1;
+        if (!length2) break;
+
+        GF2Square(odd, even);
+        if (length2 & 1) crc1 = GF2Times(odd, crc1);
+        length2 >>= 1;
+    } while (length2);
+
+    return(crc1 ^ crc2);
+}
+
+/*----------------------------------------------------------------------------*/
+unsigned int GF2Times(unsigned int* matrix, unsigned int vector) {
+    unsigned int sum;
+
+    for (sum = 0; vector; vector >>= 1, matrix++) {
+        if (vector & 1) sum ^= *matrix;
+    }
+
+    return(sum);
+}
+
+/*----------------------------------------------------------------------------*/
+void GF2Square(unsigned int* square, unsigned int* matrix) {
+    unsigned int i;
+
+    for (i = 0; i < 32; i++) square[i] = GF2Times(matrix, matrix[i]);
+}
+
+/*----------------------------------------------------------------------------*/
+void ShaInit(SHA* sha) {
+    sha->h[0] = 0x67452301;
+    sha->h[1] = 0xEFCDAB89;
+    sha->h[2] = 0x98BADCFE;
+    sha->h[3] = 0x10325476;
+    sha->h[4] = 0xC3D2E1F0;
+    sha->total = 0;
+    sha->tail_len = 0;
+}
+
+/*----------------------------------------------------------------------------*/
+void ShaUpdate(SHA* sha, unsigned char* data, U64 length) {
+    unsigned int count;
+
+    sha->total += length;
+
+    // the blocks of 64 bytes, the rest is kept for the next call
+    while (length) {
+        if (sha->tail_len || (length < 64)) {
+            count = 64 - sha->tail_len;
+            if (count > length) count = length;
+            memcpy(sha->tail + sha->tail_len, data, count);
+            sha->tail_len += count;
+            data += count; length -= count;
+            if (sha->tail_len < 64) break;
+
+            ShaBlock(sha, sha->tail);
+            sha->tail_len = 0;
+            continue;
         }
 
-        free(buffer);
+        for ( ; length >= 64; data += 64, length -= 64) ShaBlock(sha, data);
     }
+}
 
-    // file not found, return 0
-    return(0);
+/*----------------------------------------------------------------------------*/
+void ShaFinal(SHA* sha, unsigned char* hash) {
+    unsigned char pad[72];
+    unsigned int  count, i;
+    U64           bits;
+
+    // a 1 bit, zeros until 8 bytes before the end of a block, and the
+    // length in bits, big endian
+    bits = sha->total << 3;
+    count = (sha->tail_len < 56 ? 56 : 120) - sha->tail_len;
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (i = 0; i < 8; i++) pad[count + i] = bits >> (56 - 8 * i);
+    ShaUpdate(sha, pad, count + 8);
+
+    for (i = 0; i < 20; i++) hash[i] = sha->h[i >> 2] >> (24 - 8 * (i & 3));
 }
 
 /*----------------------------------------------------------------------------*/
-void PathTable(char* isoname, int lba, int len, int lba_old, int diff, int sw) {
-    unsigned char* buffer;
+void ShaBlock(SHA* sha, unsigned char* data) {
+    unsigned int w[80], a, b, c, d, e, f, k, t;
+    unsigned int i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = ((unsigned int)data[4 * i] << 24) | (data[4 * i + 1] << 16) | (data[4 * i + 2] << 8) | data[4 * i + 3];
+    }
+    for (i = 16; i < 80; i++) w[i] = SHA_ROTL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    a = sha->h[0]; b = sha->h[1]; c = sha->h[2]; d = sha->h[3]; e = sha->h[4];
+    for (i = 0; i < 80; i++) {
+        if (i < 20)      { f = (b & c) | (~b & d);          k = 0x5A827999; }
+        else if (i < 40) { f = b ^ c ^ d;                   k = 0x6ED9EBA1; }
+        else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+        else             { f = b ^ c ^ d;                   k = 0xCA62C1D6; }
+
+        t = SHA_ROTL(a, 5) + f + e + k + w[i];
+        e = d; d = c; c = SHA_ROTL(b, 30); b = a; a = t;
+    }
+    sha->h[0] += a; sha->h[1] += b; sha->h[2] += c; sha->h[3] += d; sha->h[4] += e;
+}
+
+/*----------------------------------------------------------------------------*/
+void PathTable(IMAGE* iso, INDEX* index, CHANGE* changes, int count, unsigned int base, int lba, int len, int sw) {
+    unsigned char* buffer, * table;
     unsigned int   total, change, pos, nbytes, newlba;
     unsigned int   i;
+    int            moved;
+
+    // nothing to do if no folder is after a resized file
+    for (i = 0; i < index->count; i++) {
+        if ((index->entries[i].flags & 0x02) && ShiftLBA(changes, count, index->entries[i].lba, 0)) break;
+    }
+    if (i == index->count) return;
 
     // total sectors
     total = (len + LEN_SECTOR_M0 - 1) / LEN_SECTOR_M0;
 
+    // the table is moved if it is after a resized file, and its LBAs are
+    // from the first sector of its volume, moved by the changes before it
+    lba += ShiftSector(changes, count, lba);
+    moved = ShiftSector(changes, count, base);
+
     // read all sectors
-    buffer = (unsigned char*)ReadSectors(isoname, lba, total);
+    buffer = (unsigned char*)GetSectors(iso, lba, total);
+
+    // the table is contiguous only in the user data sectors
+    table = buffer + iso->data_offset;
+    if (iso->sector_size != iso->sector_data) {
+        table = (unsigned char*)Memory(total * iso->sector_data, sizeof(char));
+        for (i = 0; i < total; i++) memcpy(table + i * iso->sector_data, buffer + i * iso->sector_size + iso->data_offset, iso->sector_data);
+    }
 
     change = 0;
     pos = 0;
-    while (pos < len) {
+    while (pos < (unsigned int)len) {
         // field size
-        nbytes = *(unsigned char*)(buffer + data_offset + pos);
+        nbytes = *(unsigned char*)(table + pos);
         if (!nbytes) break; // no more entries in this table
 
         // position
-        newlba = *(unsigned int*)(buffer + data_offset + pos + 0x002);
+        newlba = *(unsigned int*)(table + pos + 0x002);
         if (sw) newlba = ChangeEndian((char*)&newlba);
 
         // update needed?
-        if (newlba > lba_old) {
+        i = ShiftLBA(changes, count, base + newlba, 0) - moved;
+        if (i) {
             change = 1;
-            newlba += diff;
+            newlba += i;
             if (sw) newlba = ChangeEndian((char*)&newlba);
-            *(unsigned int*)(buffer + data_offset + pos + 0x002) = newlba;
+            *(unsigned int*)(table + pos + 0x002) = newlba;
         }
 
         pos += 0x08 + nbytes + (nbytes & 0x1);
     }
 
-    // update sectors if needed
-    if (change) {
-        WriteSectors(isoname, lba, (char*)buffer, total);
+    if (iso->sector_size != iso->sector_data) {
+        if (change) for (i = 0; i < total; i++) memcpy(buffer + i * iso->sector_size + iso->data_offset, table + i * iso->sector_data, iso->sector_data);
+        free(table);
     }
 
-    free(buffer);
+    // update sectors if needed
+    if (change) PutSectors(iso, lba, (char*)buffer, total);
+    else        DropSectors(iso, (char*)buffer);
 }
 
 /*----------------------------------------------------------------------------*/
-void TOC(char* isoname, int lba, int len, U64 found, int lba_old, int diff) {
+void TOC(IMAGE* iso, INDEX* index, CHANGE* changes, int count) {
     unsigned char* buffer;
-    unsigned char  name[256];
-    U64            newfound;
-    unsigned int   total, change, pos, nbytes, nchars, newlba, newlen;
+    ENTRY*         entry;
+    U64            sector, newsector;
+    unsigned int   first, last, pos, lba;
     unsigned int   i, j;
+    int            shift, moved;
 
-    // total sectors
-    total = (len + LEN_SECTOR_M0 - 1) / LEN_SECTOR_M0;
+    // the records of a folder sector are together in the index
+    for (first = 0; first < index->count; first = last) {
+        sector = index->entries[first].position / iso->sector_size;
+        for (last = first + 1; last < index->count; last++) {
+            if (index->entries[last].position / iso->sector_size != sector) break;
+        }
 
-    for (i = 0; i < total; i++) {
-        // read 1 sector
-        buffer = (unsigned char*)ReadSectors(isoname, lba + i, 1);
+        // the folder sector is moved if it is after a resized file
+        newsector = sector + ShiftSector(changes, count, sector);
 
-        change = 0;
-        pos = 0;
-        while (pos < len) {
-            // field size
-            nbytes = *(unsigned char*)(buffer + data_offset + pos);
-            if (!nbytes) break; // no more entries in this sector
+        buffer = NULL;
+        for (i = first; i < last; i++) {
+            entry = &index->entries[i];
 
-            // name size
-            nchars = *(unsigned char*)(buffer + data_offset + pos + 0x020);
-            for (j = 0; j < nchars; j++) {
-                name[j] = *(unsigned char*)(buffer + data_offset + pos + 0x021 + j);
+            // update needed? the LBAs are from the first sector of the
+            // volume, moved with the data after a resized file
+            shift = ShiftLBA(changes, count, entry->lba, entry->position);
+            moved = ShiftSector(changes, count, entry->base);
+            entry->lba += shift;
+            entry->base += moved;
+            if (shift != moved) {
+                // read 1 sector, only the first time
+                if (buffer == NULL) {
+                    buffer = (unsigned char*)GetSectors(iso, newsector, 1);
+                    folder_sectors++;
+                }
+
+                lba = entry->lba - entry->base;
+                j = ChangeEndian((char*)&lba);
+
+                pos = entry->position % iso->sector_size;
+                *(unsigned int*)(buffer + pos + 0x002) = lba;
+                *(unsigned int*)(buffer + pos + 0x006) = j;
             }
-            name[j] = '\0';
+        }
+
+        // keep the index in sync with the new image
+        for (i = first; i < last; i++) {
+            index->entries[i].position += (newsector - sector) * iso->sector_size;
+        }
+
+        // update sector if needed
+        if (buffer != NULL) PutSectors(iso, newsector, (char*)buffer, 1);
+    }
+}
 
-            // position
-            newlba = *(unsigned int*)(buffer + data_offset + pos + 0x002);
+/*----------------------------------------------------------------------------*/
+char* ReadSectors(IMAGE* iso, U64 lba, int sectors) {
+    return(Read(iso, lba * iso->sector_size, sectors * iso->sector_size));
+}
 
-            // needed to change a 0-bytes file with more 0-bytes files (same LBA)
-            newfound = (U64)(lba + i) * sector_size + data_offset + pos;
+/*----------------------------------------------------------------------------*/
+void WriteSectors(IMAGE* iso, U64 lba, char* buffer, int sectors) {
+    Write(iso, lba * iso->sector_size, sectors * iso->sector_size, buffer);
+}
 
-            // update needed?
-            if ((newlba > lba_old) || ((newlba == lba_old) && (newfound > found))) {
-                change = 1;
-                newlba += diff;
-                j = ChangeEndian((char*)&newlba);
+/*----------------------------------------------------------------------------*/
+char* GetSectors(IMAGE* iso, U64 lba, int sectors) {
+    // sectors in the mapping are patched in place
+    if ((iso->map != NULL) && ((lba + sectors) * iso->sector_size <= iso->map_size)) {
+        return(iso->map + lba * iso->sector_size);
+    }
 
-                *(unsigned int*)(buffer + data_offset + pos + 0x002) = newlba;
-                *(unsigned int*)(buffer + data_offset + pos + 0x006) = j;
-            }
+    if (iso->sectors != NULL) return(SectorGet(iso, lba, sectors));
 
-            // check the name except for '.' and '..' entries
-            if ((nchars != 1) || ((name[0] != '\0') && (name[0] != '\1'))) {
-                // recursive update in folders
-                if (*(unsigned char*)(buffer + data_offset + pos + 0x019) & 0x02) {
-                    newlen = *(unsigned int*)(buffer + data_offset + pos + 0x00A);
+    return(ReadSectors(iso, lba, sectors));
+}
 
-                    TOC(isoname, newlba, newlen, found, lba_old, diff);
-                }
-            }
+/*----------------------------------------------------------------------------*/
+void PutSectors(IMAGE* iso, U64 lba, char* buffer, int sectors) {
+    Written(iso, lba, sectors);
 
-            // point to the next entry
-            pos += nbytes;
+    if ((iso->map == NULL) && (iso->sectors != NULL)) {
+        // written and encoded by SectorFlush()
+        SectorPut(iso, lba, buffer, sectors);
+        AlignedFree(buffer);
+        return;
+    }
+
+    // the changed raw sectors are encoded again
+    Encode(iso, buffer, lba, sectors);
+
+    if ((iso->map != NULL) && (buffer >= iso->map) && (buffer < iso->map + iso->map_size)) return;
+
+    WriteSectors(iso, lba, buffer, sectors);
+    AlignedFree(buffer);
+}
+
+/*----------------------------------------------------------------------------*/
+void DropSectors(IMAGE* iso, char* buffer) {
+    if ((iso->map != NULL) && (buffer >= iso->map) && (buffer < iso->map + iso->map_size)) return;
+
+    AlignedFree(buffer);
+}
+
+/*----------------------------------------------------------------------------*/
+void SectorCache(IMAGE* iso) {
+    SECTORS* cache;
+
+    // the folder sectors read while indexing are kept for the updates, and
+    // the changed ones are written together by SectorFlush()
+    if (iso->sectors != NULL) return;
+
+    cache = (SECTORS*)Memory(1, sizeof(SECTORS));
+    cache->size = 256;
+    cache->table = (SECTOR*)Memory(cache->size, sizeof(SECTOR));
+    iso->sectors = cache;
+}
+
+/*----------------------------------------------------------------------------*/
+char* SectorGet(IMAGE* iso, U64 lba, int sectors) {
+    SECTOR* sector;
+    char*   buffer;
+    int     i, missing;
+
+    // a copy of the kept sectors, the others read at once and kept
+    buffer = Aligned((U64)sectors * iso->sector_size);
+    for (missing = i = 0; i < sectors; i++) {
+        if (SectorFind(iso->sectors, lba + i) == NULL) missing = 1;
+    }
+    if (missing) {
+        if ((lba + sectors) * iso->sector_size > iso->size) EXIT("Read past the end\n");
+        ReadData(iso, lba * iso->sector_size, buffer, (U64)sectors * iso->sector_size);
+    }
+
+    for (i = 0; i < sectors; i++) {
+        sector = SectorFind(iso->sectors, lba + i);
+        if (sector != NULL) {
+            memcpy(buffer + (U64)i * iso->sector_size, sector->data, iso->sector_size);
         }
+        else {
+            sector = SectorAdd(iso->sectors, lba + i, iso->sector_size);
+            memcpy(sector->data, buffer + (U64)i * iso->sector_size, iso->sector_size);
+        }
+    }
 
-        // update sector if needed
-        if (change) {
-            WriteSectors(isoname, lba + i, (char*)buffer, 1);
+    return(buffer);
+}
+
+/*----------------------------------------------------------------------------*/
+void SectorPut(IMAGE* iso, U64 lba, char* buffer, int sectors) {
+    SECTOR* sector;
+    int     i;
+
+    for (i = 0; i < sectors; i++) {
+        sector = SectorFind(iso->sectors, lba + i);
+        if (sector == NULL) sector = SectorAdd(iso->sectors, lba + i, iso->sector_size);
+        memcpy(sector->data, buffer + (U64)i * iso->sector_size, iso->sector_size);
+        sector->dirty = 1;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+void SectorFlush(IMAGE* iso) {
+    SECTORS*      cache;
+    SECTOR**      dirty;
+    char*         buffer;
+    unsigned int  count, runs, first, last, i;
+
+    cache = iso->sectors;
+    if (cache == NULL) return;
+
+    // the changed sectors by LBA, a write for every contiguous run
+    dirty = (SECTOR**)Memory(cache->count + 1, sizeof(SECTOR*));
+    for (count = i = 0; i < cache->size; i++) {
+        if ((cache->table[i].data != NULL) && cache->table[i].dirty) dirty[count++] = &cache->table[i];
+    }
+    qsort(dirty, count, sizeof(SECTOR*), CompareSector);
+
+    for (runs = i = 0; i < count; i++) {
+        if (!i || (dirty[i]->lba != dirty[i - 1]->lba + 1)) runs++;
+    }
+    if (count) Phase("writing %u metadata sector%s in %u write%s", count, count == 1 ? "" : "s", runs, runs == 1 ? "" : "s");
+
+    // the writes don't drop the kept sectors
+    iso->sectors = NULL;
+
+    for (first = 0; first < count; first = last) {
+        for (last = first + 1; (last < count) && (last - first < BLOCKSIZE) && (dirty[last]->lba == dirty[last - 1]->lba + 1); last++);
+
+        buffer = Aligned((U64)(last - first) * iso->sector_size);
+        for (i = first; i < last; i++) memcpy(buffer + (U64)(i - first) * iso->sector_size, dirty[i]->data, iso->sector_size);
+
+        // the changed raw sectors are encoded again
+        Encode(iso, buffer, dirty[first]->lba, last - first);
+        WriteSectors(iso, dirty[first]->lba, buffer, last - first);
+
+        // kept as written, for the next updates of an open image
+        for (i = first; i < last; i++) {
+            memcpy(dirty[i]->data, buffer + (U64)(i - first) * iso->sector_size, iso->sector_size);
+            dirty[i]->dirty = 0;
+        }
+        AlignedFree(buffer);
+    }
+    free(dirty);
+
+    iso->sectors = cache;
+}
+
+/*----------------------------------------------------------------------------*/
+void SectorFree(IMAGE* iso) {
+    SECTORS*     cache;
+    unsigned int i;
+
+    // the changes not flushed are lost
+    cache = iso->sectors;
+    if (cache == NULL) return;
+
+    for (i = 0; i < cache->size; i++) free(cache->table[i].data);
+    free(cache->table);
+    free(cache);
+    iso->sectors = NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+void SectorDrop(IMAGE* iso, U64 position, U64 length) {
+    SECTORS* cache;
+    SECTOR*  sector;
+    U64      first, last, lba;
+    unsigned int i;
+
+    // the data written over kept sectors is newer than them
+    cache = iso->sectors;
+    if (!length || !cache->count) return;
+
+    first = position / iso->sector_size;
+    last = (position + length - 1) / iso->sector_size;
+    if (last - first < cache->count) {
+        for (lba = first; lba <= last; lba++) {
+            sector = SectorFind(cache, lba);
+            if (sector != NULL) SectorRemove(cache, sector);
+        }
+        return;
+    }
+
+    for (i = 0; i < cache->size; ) {
+        sector = &cache->table[i];
+        // a removed sector can be replaced by the next one
+        if ((sector->data != NULL) && (sector->lba >= first) && (sector->lba <= last)) SectorRemove(cache, sector);
+        else i++;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+SECTOR* SectorFind(SECTORS* cache, U64 lba) {
+    unsigned int i;
+
+    for (i = SectorSlot(cache, lba); cache->table[i].data != NULL; i = (i + 1) & (cache->size - 1)) {
+        if (cache->table[i].lba == lba) return(&cache->table[i]);
+    }
+
+    return(NULL);
+}
+
+/*----------------------------------------------------------------------------*/
+SECTOR* SectorAdd(SECTORS* cache, U64 lba, unsigned int length) {
+    SECTOR*      table;
+    unsigned int size, i, j;
+
+    // at most half full
+    if (2 * (cache->count + 1) > cache->size) {
+        table = cache->table;
+        size = cache->size;
+        cache->size <<= 1;
+        cache->table = (SECTOR*)Memory(cache->size, sizeof(SECTOR));
+        for (i = 0; i < size; i++) {
+            if (table[i].data == NULL) continue;
+            for (j = SectorSlot(cache, table[i].lba); cache->table[j].data != NULL; j = (j + 1) & (cache->size - 1));
+            cache->table[j] = table[i];
+        }
+        free(table);
+    }
+
+    for (i = SectorSlot(cache, lba); cache->table[i].data != NULL; i = (i + 1) & (cache->size - 1));
+    cache->table[i].lba = lba;
+    cache->table[i].data = Memory(length, sizeof(char));
+    cache->table[i].dirty = 0;
+    cache->count++;
+
+    return(&cache->table[i]);
+}
+
+/*----------------------------------------------------------------------------*/
+void SectorRemove(SECTORS* cache, SECTOR* sector) {
+    unsigned int i, j, k, mask;
+
+    free(sector->data);
+    sector->data = NULL;
+    cache->count--;
+
+    // the next sectors of the run are moved back if the free slot is between
+    // their own slot and them
+    mask = cache->size - 1;
+    i = sector - cache->table;
+    for (j = (i + 1) & mask; cache->table[j].data != NULL; j = (j + 1) & mask) {
+        k = SectorSlot(cache, cache->table[j].lba);
+        if (((j - k) & mask) >= ((j - i) & mask)) {
+            cache->table[i] = cache->table[j];
+            cache->table[j].data = NULL;
+            i = j;
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+unsigned int SectorSlot(SECTORS* cache, U64 lba) {
+    return((unsigned int)((lba * 0x9E3779B97F4A7C15ULL) >> 32) & (cache->size - 1));
+}
+
+/*----------------------------------------------------------------------------*/
+int CompareSector(const void* a, const void* b) {
+    U64 x, y;
+
+    x = (*(SECTOR**)a)->lba;
+    y = (*(SECTOR**)b)->lba;
+
+    return(x < y ? -1 : x > y);
+}
+
+/*----------------------------------------------------------------------------*/
+IsoImage::IsoImage() {
+    volume = NULL;
+    changes = NULL;
+    count = max = 0;
+    name = NULL;
+    message[0] = '\0';
+}
+
+/*----------------------------------------------------------------------------*/
+IsoImage::~IsoImage() {
+    close();
+}
+
+/*----------------------------------------------------------------------------*/
+int IsoImage::open(const char* filename) {
+    close();
+
+    try {
+        name = Memory(StrLen((char*)filename) + 1, sizeof(char));
+        strcpy(name, filename);
+
+        volume = Memory(1, sizeof(VOLUME));
+        VolumeOpen((VOLUME*)volume, name, IMAGE_WRITE);
+    }
+    catch (IsoError& e) {
+        Drop();
+        return(Fail(e.what()));
+    }
+
+    return(UMD_OK);
+}
+
+/*----------------------------------------------------------------------------*/
+int IsoImage::lookup(const char* path, unsigned int* lba, unsigned int* size) {
+    U64 length;
+
+    if (lookup64(path, lba, &length)) return(UMD_ERROR);
+    if (length >> 32) return(Fail("File size larger than 32 bits, see lookup64()\n"));
+
+    if (size != NULL) *size = (unsigned int)length;
+
+    return(UMD_OK);
+}
+
+/*----------------------------------------------------------------------------*/
+int IsoImage::lookup64(const char* path, unsigned int* lba, unsigned long long* size) {
+    ENTRY* entry;
+    char*  filename;
+
+    if (volume == NULL) return(Fail("Image not open\n"));
+
+    // the same names as the tool, from the index of the open image
+    try {
+        filename = Normalize((char*)path);
+        entry = Search(&((VOLUME*)volume)->index, filename);
+        free(filename);
+    }
+    catch (IsoError& e) {
+        return(Fail(e.what()));
+    }
+    if (entry == NULL) return(Fail("File not found in the UMD image\n"));
+
+    if (lba != NULL) *lba = entry->lba;
+    if (size != NULL) *size = Length(entry);
+
+    return(UMD_OK);
+}
+
+/*----------------------------------------------------------------------------*/
+int IsoImage::replace(const char* path, const char* newfile) {
+    CHANGE* change;
+    IMAGE   file;
+
+    if (lookup64(path, NULL, NULL)) return(UMD_ERROR);
+
+    // only queued, all the files are written by commit(), but a file that
+    // can't be read fails here
+    try {
+        Open(&file, (char*)newfile, IMAGE_READ);
+        Close(&file);
+
+        if (count == max) {
+            max = max ? max << 1 : 64;
+            changes = realloc(changes, max * sizeof(CHANGE));
+            if (changes == NULL) EXIT("Memory error\n");
+        }
+        change = &((CHANGE*)changes)[count];
+        memset(change, 0, sizeof(CHANGE));
+        change->oldname = Memory(StrLen((char*)path) + 1, sizeof(char));
+        strcpy(change->oldname, path);
+        change->newname = Memory(StrLen((char*)newfile) + 1, sizeof(char));
+        strcpy(change->newname, newfile);
+        count++;
+    }
+    catch (IsoError& e) {
+        return(Fail(e.what()));
+    }
+
+    return(UMD_OK);
+}
+
+/*----------------------------------------------------------------------------*/
+int IsoImage::commit(void) {
+    int kept;
+
+    if (volume == NULL) return(Fail("Image not open\n"));
+    if (!count) return(UMD_OK);
+
+    // the image is kept open by an update in place, else it is closed and
+    // parsed again for the next calls
+    try {
+        kept = Apply((VOLUME*)volume, (CHANGE*)changes, count);
+        Discard();
+        if (!kept) VolumeOpen((VOLUME*)volume, name, IMAGE_WRITE);
+    }
+    catch (IsoError& e) {
+        // the state of the image is unknown, it must be opened again
+        Drop();
+        Discard();
+        return(Fail(e.what()));
+    }
+
+    return(UMD_OK);
+}
+
+/*----------------------------------------------------------------------------*/
+void IsoImage::discard(void) {
+    Discard();
+}
+
+/*----------------------------------------------------------------------------*/
+void IsoImage::close(void) {
+    // the pending replacements are discarded
+    if (volume != NULL) {
+        try {
+            VolumeClose((VOLUME*)volume);
+        }
+        catch (IsoError& e) {
+            Fail(e.what());
         }
+        free(volume);
+        volume = NULL;
+    }
+    Discard();
+
+    free(name);
+    name = NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+void IsoImage::Drop(void) {
+    if (volume == NULL) return;
 
-        free(buffer);
+    // after an error, the files still open are closed and the memory freed,
+    // the errors of the close are lost behind the first one
+    try {
+        VolumeClose((VOLUME*)volume);
+    }
+    catch (IsoError&) {
     }
+    free(volume);
+    volume = NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+const char* IsoImage::error(void) {
+    return(message);
+}
+
+/*----------------------------------------------------------------------------*/
+int IsoImage::option(const char* option) {
+    return(Option((char*)option) ? UMD_OK : UMD_ERROR);
 }
 
 /*----------------------------------------------------------------------------*/
-char* ReadSectors(char* isoname, U64 lba, int sectors) {
-    return(Read(isoname, lba * sector_size, sectors * sector_size));
+int IsoImage::Fail(const char* text) {
+    int i;
+
+    // the messages of the tool, without the final new line
+    snprintf(message, sizeof(message), "%s", text);
+    i = StrLen(message);
+    if (i && (message[i - 1] == '\n')) message[i - 1] = '\0';
+
+    return(UMD_ERROR);
 }
 
 /*----------------------------------------------------------------------------*/
-void WriteSectors(char* isoname, U64 lba, char* buffer, int sectors) {
-    Write(isoname, lba * sector_size, sectors * sector_size, buffer);
+void IsoImage::Discard(void) {
+    int i;
+
+    for (i = 0; i < count; i++) {
+        free(((CHANGE*)changes)[i].oldname);
+        free(((CHANGE*)changes)[i].newname);
+    }
+    free(changes);
+    changes = NULL;
+    count = max = 0;
 }
 
 /*----------------------------------------------------------------------------*/
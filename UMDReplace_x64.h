@@ -0,0 +1,76 @@
+/*----------------------------------------------------------------------------*/
+/*-- UMD-replace.h                                                          --*/
+/*-- Library interface of UMD-replace, to patch images without a process    --*/
+/*-- Copyright (C) 2012-2015 CUE  --  2022 Snake128                         --*/
+/*--                                                                        --*/
+/*-- This program is free software: you can redistribute it and/or modify   --*/
+/*-- it under the terms of the GNU General Public License as published by   --*/
+/*-- the Free Software Foundation, either version 3 of the License, or      --*/
+/*-- (at your option) any later version.                                    --*/
+/*--                                                                        --*/
+/*-- This program is distributed in the hope that it will be useful,        --*/
+/*-- but WITHOUT ANY WARRANTY; without even the implied warranty of         --*/
+/*-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the           --*/
+/*-- GNU General Public License for more details.                           --*/
+/*--                                                                        --*/
+/*-- You should have received a copy of the GNU General Public License      --*/
+/*-- along with this program. If not, see <http://www.gnu.org/licenses/>.   --*/
+/*----------------------------------------------------------------------------*/
+
+#ifndef UMDREPLACE_X64_H
+#define UMDREPLACE_X64_H
+
+/*----------------------------------------------------------------------------*/
+#include <stdexcept>
+
+/*----------------------------------------------------------------------------*/
+#define UMD_OK           0              // done
+#define UMD_ERROR        -1             // failed, see IsoImage::error()
+
+/*----------------------------------------------------------------------------*/
+// the errors of the tool and the library, caught by main() or the methods
+class IsoError : public std::runtime_error {
+public:
+    IsoError(const char* text) : std::runtime_error(text) {}
+};
+
+/*----------------------------------------------------------------------------*/
+// an open image: the volume descriptor and the folder tree are parsed once,
+// then any number of files are looked up and replaced, and written at once
+// by commit(), which keeps the image open and indexed when no sector is
+// moved; discard() drops the queued files; lookup64() gives the size of the
+// files over 4 GB (multi-extent); the options (Option strings of the tool,
+// like "--inplace" or "--place=gap") are shared by all the images of the
+// process
+class IsoImage {
+public:
+    IsoImage();
+    ~IsoImage();
+
+    int  open(const char* filename);
+    int  lookup(const char* path, unsigned int* lba, unsigned int* size);
+    int  lookup64(const char* path, unsigned int* lba, unsigned long long* size);
+    int  replace(const char* path, const char* newfile);
+    int  commit(void);
+    void discard(void);
+    void close(void);
+
+    const char* error(void);
+    static int  option(const char* option);
+
+private:
+    void*        volume;                // parsed image, or NULL if closed
+    void*        changes;               // pending replacements
+    int          count, max;
+    char*        name;                  // image file name
+    char         message[256];          // last error
+    int          Fail(const char* text);
+    void         Discard(void);
+    void         Drop(void);
+};
+
+#endif
+
+/*----------------------------------------------------------------------------*/
+/*--  EOF                     Copyright (C) 2012-2015 CUE  - 2022 Snake128  --*/
+/*----------------------------------------------------------------------------*/